@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "vmill/Program/AddressSpace.h"
+
+// Re-runs a guest-like workload from a checkpoint, the way a fuzzing or
+// replay loop would, and checks that every restore brings back the memory,
+// the page permissions, and the state derived from them.
+
+namespace {
+
+static constexpr uint64_t kPageSize = 4096;
+static constexpr uint64_t kDataAddr = 0x100000;
+static constexpr uint64_t kDataSize = 16 * kPageSize;
+static constexpr uint64_t kCodeAddr = 0x200000;
+static constexpr uint64_t kOtherCodeAddr = 0x201000;
+static constexpr uint64_t kNumRuns = 4;
+
+static uint8_t ReadByte(vmill::AddressSpace &memory, uint64_t addr) {
+  uint8_t val = 0;
+  CHECK(memory.TryRead(addr, &val))
+      << "Unable to read " << std::hex << addr;
+  return val;
+}
+
+// Returns the byte that the checkpointed state has at `addr`.
+static uint8_t InitialByte(uint64_t addr) {
+  return static_cast<uint8_t>((addr - kDataAddr) / kPageSize);
+}
+
+static void CheckInitialState(vmill::AddressSpace &memory,
+                              vmill::CodeVersion code_version) {
+  for (auto addr = kDataAddr; addr < kDataAddr + kDataSize; ++addr) {
+    CHECK_EQ(InitialByte(addr), ReadByte(memory, addr))
+        << "Byte at " << std::hex << addr << " was not restored";
+    CHECK(memory.CanWrite(addr))
+        << "Permissions of " << std::hex << addr << " were not restored";
+  }
+  CHECK(memory.CanRead(kCodeAddr) && !memory.CanWrite(kCodeAddr));
+  CHECK(memory.CanExecute(kCodeAddr));
+  CHECK(memory.IsMarkedTraceHead(static_cast<vmill::PC>(kCodeAddr)));
+  CHECK(!memory.IsMarkedTraceHead(static_cast<vmill::PC>(kCodeAddr + 16)));
+  CHECK(code_version ==
+        memory.ComputeCodeVersion(static_cast<vmill::PC>(kCodeAddr)))
+      << "Data version was not restored";
+}
+
+// Writes to some pages, changes the permissions of others, including of a
+// page whose data was folded into lifted code, and discovers a new trace.
+static void RunWorkload(vmill::AddressSpace &memory, uint64_t run) {
+  for (auto addr = kDataAddr; addr < kDataAddr + kDataSize;
+       addr += 3 * kPageSize) {
+    CHECK(memory.TryWrite(addr + run, static_cast<uint8_t>(0xA0 + run)));
+  }
+  memory.SetPermissions(kDataAddr + kPageSize, kPageSize, true, false, false);
+  CHECK(!memory.TryWrite(kDataAddr + kPageSize, static_cast<uint8_t>(1)));
+  memory.SetPermissions(kDataAddr + 4 * kPageSize, 2 * kPageSize,
+                        false, false, false);
+
+  memory.SetPermissions(kCodeAddr, kPageSize, true, true, false);
+  CHECK(memory.TryWrite(kCodeAddr, static_cast<uint8_t>(0xCC)));
+  memory.SetPermissions(kCodeAddr, kPageSize, true, false, true);
+  memory.MarkAsTraceHead(static_cast<vmill::PC>(kCodeAddr + 16));
+}
+
+// Writes repeatedly to the ranges of a clone, including to ones that turn
+// into a different kind of range on their first write, and checks that none
+// of the writes go into the ranges that the clone still shares with its
+// parent.
+static void CheckCloneIsolation(void) {
+  static constexpr uint64_t kEmptyAddr = 0x400000;
+  static constexpr uint64_t kFullAddr = 0x500000;
+
+  vmill::AddressSpace parent;
+  parent.AddMap(kEmptyAddr, kPageSize, "[a]");
+  parent.AddMap(kFullAddr, kPageSize, "[b]");
+  CHECK(parent.TryWrite(kFullAddr, static_cast<uint8_t>(0x11)));
+
+  vmill::AddressSpace clone(parent);
+  for (uint64_t i = 0; i < 3; ++i) {
+    CHECK(clone.TryWrite(kEmptyAddr + i, static_cast<uint8_t>(i + 1)));
+  }
+  CHECK(clone.TryWrite(kFullAddr, static_cast<uint8_t>(0x99)));
+
+  CHECK_EQ(0x11, ReadByte(parent, kFullAddr))
+      << "Write to a clone went into a range shared with its parent";
+  CHECK_EQ(0, ReadByte(parent, kEmptyAddr));
+  CHECK_EQ(0x99, ReadByte(clone, kFullAddr));
+  CHECK_EQ(3, ReadByte(clone, kEmptyAddr + 2));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  vmill::AddressSpace memory;
+  memory.AddMap(kDataAddr, kDataSize, "[data]");
+  for (auto addr = kDataAddr; addr < kDataAddr + kDataSize; ++addr) {
+    CHECK(memory.TryWrite(addr, InitialByte(addr)));
+  }
+  memory.AddMap(kCodeAddr, kPageSize, "[code]");
+  CHECK(memory.TryWrite(kCodeAddr, static_cast<uint8_t>(0x90)));
+  memory.SetPermissions(kCodeAddr, kPageSize, true, false, true);
+  CHECK(memory.CanFoldData(kCodeAddr));
+  memory.MarkAsFoldedData(kCodeAddr, static_cast<vmill::PC>(kCodeAddr));
+  memory.MarkAsTraceHead(static_cast<vmill::PC>(kCodeAddr));
+
+  // A trace that didn't fold the page.
+  memory.AddMap(kOtherCodeAddr, kPageSize, "[other]");
+  memory.SetPermissions(kOtherCodeAddr, kPageSize, true, false, true);
+  memory.MarkAsTraceHead(static_cast<vmill::PC>(kOtherCodeAddr));
+
+  const auto code_version = memory.ComputeCodeVersion(
+      static_cast<vmill::PC>(kCodeAddr));
+  const auto other_code_version = memory.ComputeCodeVersion(
+      static_cast<vmill::PC>(kOtherCodeAddr));
+  memory.Checkpoint();
+
+  // Runs that only write to memory and change permissions.
+  for (uint64_t run = 0; run < kNumRuns; ++run) {
+    RunWorkload(memory, run);
+    CHECK(code_version != memory.ComputeCodeVersion(
+        static_cast<vmill::PC>(kCodeAddr)))
+        << "Reprotecting a folded page did not change the data version";
+    CHECK(!memory.IsMarkedTraceHead(static_cast<vmill::PC>(kCodeAddr)));
+    CHECK(other_code_version == memory.ComputeCodeVersion(
+        static_cast<vmill::PC>(kOtherCodeAddr)))
+        << "Reprotecting a folded page changed the version of other code";
+    CHECK(memory.IsMarkedTraceHead(static_cast<vmill::PC>(kOtherCodeAddr)));
+    memory.RestoreCheckpoint();
+    CheckInitialState(memory, code_version);
+    CHECK_EQ(0x90, ReadByte(memory, kCodeAddr));
+  }
+
+  // Runs that also change the maps.
+  for (uint64_t run = 0; run < kNumRuns; ++run) {
+    RunWorkload(memory, run);
+    memory.RemoveMap(kDataAddr + 8 * kPageSize, kPageSize);
+    memory.AddMap(0x300000, kPageSize, "[new]");
+    memory.RestoreCheckpoint();
+    CheckInitialState(memory, code_version);
+    CHECK(!memory.IsMapped(0x300000));
+  }
+
+  // A clone of a restored address space is independent of it.
+  RunWorkload(memory, 0);
+  vmill::AddressSpace clone(memory);
+  memory.RestoreCheckpoint();
+  CheckInitialState(memory, code_version);
+  CHECK_EQ(0xA0, ReadByte(clone, kDataAddr));
+  CHECK(!clone.CanWrite(kDataAddr + kPageSize));
+
+  CheckCloneIsolation();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/Program/AddressSpace.h"
+
+// `fld tbyte` and `fstp tbyte` are lifted into calls to the 80-bit float
+// memory intrinsics. These pass a `double`, but access 10 bytes of guest
+// memory, so none of the memory passes may treat them as 8-byte accesses.
+
+namespace vmill {
+extern "C" {
+double __remill_read_memory_f80(AddressSpace *memory, uint64_t addr);
+AddressSpace *__remill_write_memory_f80(
+    AddressSpace *memory, uint64_t addr, double val);
+}  // extern "C"
+}  // namespace vmill
+
+namespace {
+
+static constexpr uint64_t kPageAddr = 0x10000;
+static constexpr uint64_t kSrcAddr = kPageAddr + 0x100;
+static constexpr uint64_t kDstAddr = kPageAddr + 0x200;
+
+// Declares the memory intrinsic `name`, which accesses values of `val_type`.
+static llvm::Function *DeclareIntrinsic(llvm::Module *module, const char *name,
+                                        llvm::Type *memory_type,
+                                        llvm::Type *val_type, bool is_write) {
+  auto &context = module->getContext();
+  std::vector<llvm::Type *> params = {memory_type,
+                                      llvm::Type::getInt64Ty(context)};
+  llvm::Type *ret_type = val_type;
+  if (is_write) {
+    params.push_back(val_type);
+    ret_type = memory_type;
+  }
+  return llvm::Function::Create(
+      llvm::FunctionType::get(ret_type, params, false),
+      llvm::GlobalValue::ExternalLinkage, name, module);
+}
+
+// Returns the number of calls to `callee` in `func`.
+static unsigned NumCallsTo(llvm::Function *func, llvm::Function *callee) {
+  unsigned num_calls = 0;
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+        if (call->getCalledFunction() == callee) {
+          num_calls++;
+        }
+      }
+    }
+  }
+  return num_calls;
+}
+
+// Builds the code that the lifter produces for a `fld tbyte [src]` and a
+// `fstp tbyte [dst]`, surrounded by narrower accesses that overlap the 80-bit
+// ones, and checks that the memory passes leave the 80-bit accesses alone.
+static void CheckLiftedCode(void) {
+  llvm::LLVMContext context;
+  llvm::Module module("f80", context);
+
+  auto memory_type = llvm::PointerType::get(
+      llvm::StructType::create(context, "struct.Memory"), 0);
+  auto i16_type = llvm::Type::getInt16Ty(context);
+  auto i64_type = llvm::Type::getInt64Ty(context);
+  auto f64_type = llvm::Type::getDoubleTy(context);
+
+  auto read_f80 = DeclareIntrinsic(
+      &module, "__remill_read_memory_f80", memory_type, f64_type, false);
+  auto write_f80 = DeclareIntrinsic(
+      &module, "__remill_write_memory_f80", memory_type, f64_type, true);
+  auto write_f64 = DeclareIntrinsic(
+      &module, "__remill_write_memory_f64", memory_type, f64_type, true);
+  auto read_16 = DeclareIntrinsic(
+      &module, "__remill_read_memory_16", memory_type, i16_type, false);
+  auto write_16 = DeclareIntrinsic(
+      &module, "__remill_write_memory_16", memory_type, i16_type, true);
+
+  auto func = llvm::Function::Create(
+      llvm::FunctionType::get(memory_type,
+                              {memory_type, i64_type, i64_type}, false),
+      llvm::GlobalValue::ExternalLinkage, "trace", &module);
+  auto args = func->arg_begin();
+  llvm::Value *memory = &*args++;
+  llvm::Value *src = &*args++;
+  llvm::Value *dst = &*args++;
+
+  llvm::IRBuilder<> ir(llvm::BasicBlock::Create(context, "", func));
+  auto dst_hi = ir.CreateAdd(dst, ir.getInt64(8));
+
+  // The low 8 bytes of `src` are written as a `double`, so forwarding them
+  // into the `fld` would lose the exponent in bytes 8 and 9.
+  memory = ir.CreateCall(
+      write_f64, {memory, src, llvm::ConstantFP::get(f64_type, 1.5)});
+  memory = ir.CreateCall(write_16, {memory, dst_hi, ir.getInt16(0x1234)});
+  auto val = ir.CreateCall(read_f80, {memory, src});
+
+  // The `fstp` overwrites bytes 8 and 9 of `dst`, so the earlier 16-bit write
+  // must not be forwarded into the later read.
+  memory = ir.CreateCall(write_f80, {memory, dst, val});
+  auto hi = ir.CreateCall(read_16, {memory, dst_hi});
+  memory = ir.CreateCall(write_16, {memory, src, hi});
+  ir.CreateRet(memory);
+  CHECK(!llvm::verifyFunction(*func, &llvm::errs()));
+
+  vmill::OptimizeMemoryAccesses(func, true);
+  CHECK(!llvm::verifyFunction(*func, &llvm::errs()));
+  CHECK_EQ(1U, NumCallsTo(func, read_f80))
+      << "80-bit read was forwarded from an 8-byte write";
+  CHECK_EQ(1U, NumCallsTo(func, write_f80));
+  CHECK_EQ(1U, NumCallsTo(func, read_16))
+      << "16-bit read was forwarded across an overlapping 80-bit write";
+
+  // Only the narrower accesses get an inline TLB check.
+  vmill::InlineTLBLookups(func);
+  CHECK(!llvm::verifyFunction(*func, &llvm::errs()));
+  CHECK_EQ(1U, NumCallsTo(func, read_f80));
+  CHECK_EQ(1U, NumCallsTo(func, write_f80));
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+        auto callee = call->getCalledFunction();
+        if (callee == read_f80 || callee == write_f80) {
+          CHECK_EQ(&func->getEntryBlock(), &block)
+              << "80-bit access was guarded by an inline TLB check";
+        }
+      }
+    }
+  }
+}
+
+// Runs a `fld tbyte` and `fstp tbyte` pair through the runtime, and checks
+// that all 10 bytes make it from the source to the destination.
+static void CheckRoundTrip(void) {
+  vmill::AddressSpace memory;
+  memory.AddMap(kPageAddr, 4096, "[f80]");
+
+  // The x87 encoding of 1.5: a 64-bit explicit-integer significand followed
+  // by a 16-bit sign and exponent.
+  const uint8_t one_and_a_half[10] = {
+      0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xC0, 0xFF, 0x3F};
+  CHECK(memory.TryWrite(kSrcAddr, one_and_a_half, sizeof(one_and_a_half)));
+
+  const auto val = vmill::__remill_read_memory_f80(&memory, kSrcAddr);
+  CHECK_EQ(1.5, val);
+  vmill::__remill_write_memory_f80(&memory, kDstAddr, val);
+
+  uint8_t copy[10] = {};
+  CHECK(memory.TryRead(kDstAddr, copy, sizeof(copy)));
+  CHECK(!memcmp(one_and_a_half, copy, sizeof(copy)))
+      << "80-bit value did not survive a round trip through guest memory";
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  CheckLiftedCode();
+#if defined(__x86_64__) || defined(__i386__)
+  CheckRoundTrip();
+#endif
+  return EXIT_SUCCESS;
+}
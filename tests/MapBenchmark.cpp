@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "vmill/Program/AddressSpace.h"
+#include "vmill/Util/Timer.h"
+
+// Simulates the `mmap`/`munmap` pattern of a malloc-heavy guest: many large
+// allocations served by their own maps, placed top-down by `FindHole` the way
+// the Linux `mmap` emulation places them, and freed in a random order, with
+// some of them trimmed (i.e. partially unmapped) instead.
+
+DEFINE_uint64(num_live_maps, 16384,
+              "Number of maps that the simulated allocator keeps live.");
+
+DEFINE_uint64(num_ops, 262144, "Number of `mmap`s and `munmap`s to time.");
+
+DEFINE_uint64(seed, 0, "Seed for the random allocation sizes and frees.");
+
+namespace {
+
+static constexpr uint64_t kPageSize = 4096;
+static constexpr uint64_t kMmapMin = 0x10000;
+static constexpr uint64_t kMmapMax = 0x7ffff7fff000;
+
+struct Allocation {
+  uint64_t base;
+  uint64_t size;
+};
+
+class MallocSimulator {
+ public:
+  explicit MallocSimulator(uint64_t seed)
+      : random(seed) {}
+
+  // Maps a new allocation of between 128 KiB and 2 MiB, the range of sizes
+  // that glibc's `malloc` serves with `mmap`.
+  void Allocate(void) {
+    const auto size = (32 + (random() % 480)) * kPageSize;
+    uint64_t base = 0;
+    CHECK(memory.FindHole(kMmapMin, kMmapMax, size, &base))
+        << "Ran out of holes for a " << size << "-byte map";
+    CHECK(!memory.IsMapped(base) && !memory.IsMapped(base + size - 1))
+        << "Hole at " << std::hex << base << " overlaps with a map";
+    memory.AddMap(base, size, "[malloc]");
+    live.push_back({base, size});
+  }
+
+  // Unmaps a random allocation, or trims off the end of it.
+  void Free(void) {
+    const auto index = random() % live.size();
+    auto &alloc = live[index];
+    if (alloc.size > kPageSize && !(random() % 4)) {
+      const auto new_size = (alloc.size / kPageSize / 2) * kPageSize;
+      memory.RemoveMap(alloc.base + new_size, alloc.size - new_size);
+      CHECK(!memory.IsMapped(alloc.base + new_size));
+      alloc.size = new_size;
+    } else {
+      memory.RemoveMap(alloc.base, alloc.size);
+      CHECK(!memory.IsMapped(alloc.base));
+      alloc = live.back();
+      live.pop_back();
+    }
+  }
+
+  // Allocates or frees, keeping about `num_live` allocations live.
+  void Step(size_t num_live) {
+    if (live.empty() || (live.size() < num_live && (random() % 2))) {
+      Allocate();
+    } else {
+      Free();
+    }
+  }
+
+  size_t NumLive(void) const {
+    return live.size();
+  }
+
+ private:
+  std::mt19937_64 random;
+  vmill::AddressSpace memory;
+  std::vector<Allocation> live;
+};
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  // Every `AddMap` and `RemoveMap` logs at the `INFO` level, which would
+  // otherwise dominate the timings.
+  FLAGS_minloglevel = google::WARNING;
+
+  MallocSimulator simulator(FLAGS_seed);
+  while (simulator.NumLive() < FLAGS_num_live_maps) {
+    simulator.Allocate();
+  }
+
+  vmill::Timer timer;
+  for (uint64_t i = 0; i < FLAGS_num_ops; ++i) {
+    simulator.Step(FLAGS_num_live_maps);
+  }
+  const auto seconds = timer.ElapsedSeconds();
+
+  std::cout
+      << FLAGS_num_ops << " mmaps/munmaps with about "
+      << FLAGS_num_live_maps << " live maps took " << seconds << "s ("
+      << (seconds * 1e6 / static_cast<double>(FLAGS_num_ops)) << "us each)"
+      << std::endl;
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "remill/Arch/Arch.h"
+#include "remill/BC/Compat/Error.h"
+#include "remill/BC/Compat/RuntimeDyld.h"
+
+#include "vmill/BC/Compiler.h"
+#include "vmill/BC/Optimize.h"
+
+// Runs a guest loop of SSE and AVX instructions, lifted the way remill lifts
+// them, with its vector registers promoted into vector values and vectorized,
+// and checks that it computes the same state as the unpromoted scalar code.
+//
+//    loop:
+//      paddd   xmm0, xmm1        ; As one `<4 x i32>` operation.
+//      movq    xmm2, xmm0        ; As an `i64` piece of `XMM0`.
+//      vaddps  ymm3, ymm3, ymm1  ; As eight `float` operations.
+//      dec     rcx
+//      jnz     loop
+//      jmp     observe           ; Reads `XMM2` and `YMM3` from the `State`.
+
+namespace {
+
+static constexpr unsigned kNumVecRegs = 4;
+static constexpr uint64_t kVecRegSize = 64;
+static constexpr uint64_t kNumIterations = 100;
+
+// Lays out the vector registers the way remill's X86 `State` does: each one
+// is a `ZMM` register, whose low lanes are the `XMM` and `YMM` registers.
+struct alignas(64) TestState {
+  uint8_t vec[kNumVecRegs][kVecRegSize];
+  uint64_t rcx;
+  uint64_t sum;
+};
+
+static constexpr uint64_t kRCXOffset = kNumVecRegs * kVecRegSize;
+static constexpr uint64_t kSumOffset = kRCXOffset + 8;
+
+using TraceFunction = void *(TestState *, uint64_t, void *);
+
+// Returns a pointer to the `type` value at `offset` within the state.
+static llvm::Value *StatePointer(llvm::IRBuilder<> &ir, llvm::Value *state,
+                                 uint64_t offset, llvm::Type *type) {
+  auto byte_ptr = ir.CreateBitCast(state, ir.getInt8PtrTy());
+  return ir.CreateBitCast(ir.CreateConstGEP1_64(byte_ptr, offset),
+                          llvm::PointerType::get(type, 0));
+}
+
+static llvm::Value *LoadState(llvm::IRBuilder<> &ir, llvm::Value *state,
+                              uint64_t offset, llvm::Type *type) {
+  return ir.CreateLoad(StatePointer(ir, state, offset, type));
+}
+
+static void StoreState(llvm::IRBuilder<> &ir, llvm::Value *state,
+                       uint64_t offset, llvm::Value *val) {
+  ir.CreateStore(val, StatePointer(ir, state, offset, val->getType()));
+}
+
+// Builds the code that runs after the loop, which sums up some of the lanes of
+// `XMM2` and `YMM3`, so that they must be in the `State` when it's called.
+static llvm::Function *BuildObserve(llvm::Module *module,
+                                    llvm::FunctionType *func_type) {
+  auto &context = module->getContext();
+  auto func = llvm::Function::Create(
+      func_type, llvm::GlobalValue::ExternalLinkage, "observe", module);
+  func->addFnAttr(llvm::Attribute::NoInline);
+  auto args = func->arg_begin();
+  llvm::Value *state = &*args++;
+  args++;
+  llvm::Value *memory = &*args++;
+
+  llvm::IRBuilder<> ir(llvm::BasicBlock::Create(context, "", func));
+  auto i64_type = ir.getInt64Ty();
+  auto sum = LoadState(ir, state, kSumOffset, i64_type);
+  sum = ir.CreateAdd(sum, LoadState(ir, state, 2 * kVecRegSize, i64_type));
+  sum = ir.CreateAdd(sum, LoadState(ir, state, 3 * kVecRegSize + 24,
+                                    i64_type));
+  StoreState(ir, state, kSumOffset, sum);
+  ir.CreateRet(memory);
+  return func;
+}
+
+// Builds the lifted trace of the guest loop.
+static llvm::Function *BuildTrace(llvm::Module *module, const char *name,
+                                  llvm::Function *observe) {
+  auto &context = module->getContext();
+  auto func = llvm::Function::Create(
+      observe->getFunctionType(), llvm::GlobalValue::ExternalLinkage, name,
+      module);
+  auto args = func->arg_begin();
+  llvm::Value *state = &*args++;
+  llvm::Value *pc = &*args++;
+  llvm::Value *memory = &*args++;
+
+  auto entry = llvm::BasicBlock::Create(context, "", func);
+  auto loop = llvm::BasicBlock::Create(context, "loop", func);
+  auto exit = llvm::BasicBlock::Create(context, "exit", func);
+  llvm::IRBuilder<> ir(entry);
+  ir.CreateBr(loop);
+
+  ir.SetInsertPoint(loop);
+
+  // paddd xmm0, xmm1
+  auto v4i32_type = llvm::VectorType::get(ir.getInt32Ty(), 4);
+  StoreState(ir, state, 0, ir.CreateAdd(
+      LoadState(ir, state, 0, v4i32_type),
+      LoadState(ir, state, kVecRegSize, v4i32_type)));
+
+  // movq xmm2, xmm0
+  StoreState(ir, state, 2 * kVecRegSize,
+             LoadState(ir, state, 0, ir.getInt64Ty()));
+  StoreState(ir, state, 2 * kVecRegSize + 8, ir.getInt64(0));
+
+  // vaddps ymm3, ymm3, ymm1
+  auto float_type = ir.getFloatTy();
+  for (uint64_t i = 0; i < 8; ++i) {
+    StoreState(ir, state, 3 * kVecRegSize + (i * 4), ir.CreateFAdd(
+        LoadState(ir, state, 3 * kVecRegSize + (i * 4), float_type),
+        LoadState(ir, state, kVecRegSize + (i * 4), float_type)));
+  }
+
+  // dec rcx; jnz loop
+  auto rcx = ir.CreateSub(LoadState(ir, state, kRCXOffset, ir.getInt64Ty()),
+                          ir.getInt64(1));
+  StoreState(ir, state, kRCXOffset, rcx);
+  ir.CreateCondBr(ir.CreateICmpNE(rcx, ir.getInt64(0)), loop, exit);
+
+  // jmp observe
+  ir.SetInsertPoint(exit);
+  ir.CreateRet(ir.CreateCall(observe, {state, pc, memory}));
+  return func;
+}
+
+// Checks that the vector registers are kept as vectors across the loop of
+// `func`, i.e. that they flow around it in vector values, rather than through
+// the `State` structure.
+static void CheckLoopIsInRegisters(llvm::Function *func) {
+  llvm::BasicBlock *loop = nullptr;
+  for (auto &block : *func) {
+    for (auto succ : llvm::successors(&block)) {
+      if (succ == &block) {
+        loop = &block;
+      }
+    }
+  }
+  CHECK(loop != nullptr)
+      << "Loop was not simplified into one block";
+
+  auto num_vector_phis = 0U;
+  for (auto &inst : *loop) {
+    CHECK(!llvm::isa<llvm::LoadInst>(&inst) &&
+          !llvm::isa<llvm::StoreInst>(&inst))
+        << "Loop accesses the vector registers through the State";
+    if (llvm::isa<llvm::PHINode>(&inst) && inst.getType()->isVectorTy()) {
+      num_vector_phis++;
+    }
+  }
+  CHECK_EQ(2U, num_vector_phis)
+      << "XMM0 and YMM3 were not kept as vectors across the loop";
+}
+
+static void InitState(TestState *state) {
+  memset(state, 0, sizeof(TestState));
+  for (unsigned i = 0; i < kNumVecRegs; ++i) {
+    for (uint64_t j = 0; j < kVecRegSize; j += sizeof(float)) {
+      const auto val = static_cast<float>(i * 16 + j) * 0.25f;
+      memcpy(&(state->vec[i][j]), &val, sizeof(val));
+    }
+  }
+  state->rcx = kNumIterations;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  google::InitGoogleLogging(argv[0]);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  auto context = std::make_shared<llvm::LLVMContext>();
+  vmill::Compiler compiler(context);
+  auto host_arch = remill::GetHostArch();
+
+  llvm::Module module("vector", *context);
+  module.setTargetTriple(host_arch->Triple().str());
+  module.setDataLayout(host_arch->DataLayout().getStringRepresentation());
+
+  auto state_type = llvm::PointerType::get(
+      llvm::StructType::create(*context, "struct.State"), 0);
+  auto memory_type = llvm::PointerType::get(
+      llvm::StructType::create(*context, "struct.Memory"), 0);
+  auto func_type = llvm::FunctionType::get(
+      memory_type, {state_type, llvm::Type::getInt64Ty(*context), memory_type},
+      false);
+
+  auto observe = BuildObserve(&module, func_type);
+  BuildTrace(&module, "scalar_trace", observe);
+  auto vector_trace = BuildTrace(&module, "vector_trace", observe);
+
+  std::vector<std::pair<uint64_t, uint64_t>> vector_regs;
+  for (uint64_t i = 0; i < kNumVecRegs; ++i) {
+    vector_regs.emplace_back(i * kVecRegSize, kVecRegSize);
+  }
+  CHECK(vmill::PromoteStateToRegisters(vector_trace, vector_regs));
+  CHECK(!llvm::verifyFunction(*vector_trace, &llvm::errs()));
+
+  auto done = false;
+  vmill::CleanUpFunctions(
+      &module,
+      [vector_trace, &done] (void) -> llvm::Function * {
+        if (done) {
+          return nullptr;
+        }
+        done = true;
+        return vector_trace;
+      },
+      compiler.HostMachine());
+  CHECK(!llvm::verifyFunction(*vector_trace, &llvm::errs()));
+  CheckLoopIsInRegisters(vector_trace);
+
+  llvm::SmallString<128> path;
+  CHECK(!llvm::sys::fs::createTemporaryFile("vector-test", "o", path));
+  compiler.CompileModuleToFile(module, path.str().str());
+
+  auto maybe_buff = llvm::MemoryBuffer::getFile(path);
+  CHECK(!remill::IsError(maybe_buff))
+      << "Unable to read " << path.str().str() << ": "
+      << remill::GetErrorString(maybe_buff);
+  auto maybe_obj = llvm::object::ObjectFile::createObjectFile(
+      *remill::GetReference(maybe_buff));
+  CHECK(!remill::IsError(maybe_obj))
+      << "Unable to load " << path.str().str() << ": "
+      << remill::GetErrorString(maybe_obj);
+  llvm::sys::fs::remove(path);
+
+  llvm::SectionMemoryManager memory_manager;
+  llvm::RuntimeDyld loader(memory_manager, memory_manager);
+  loader.loadObject(*remill::GetReference(maybe_obj));
+  CHECK(!loader.hasError()) << loader.getErrorString().str();
+  loader.finalizeWithMemoryManagerLocking();
+
+  auto scalar_func = reinterpret_cast<TraceFunction *>(
+      loader.getSymbol("scalar_trace").getAddress());
+  auto vector_func = reinterpret_cast<TraceFunction *>(
+      loader.getSymbol("vector_trace").getAddress());
+  CHECK(scalar_func && vector_func);
+
+  TestState scalar_state;
+  TestState vector_state;
+  InitState(&scalar_state);
+  InitState(&vector_state);
+  scalar_func(&scalar_state, 0, nullptr);
+  vector_func(&vector_state, 0, nullptr);
+
+  CHECK_EQ(0U, scalar_state.rcx);
+  CHECK_EQ(0U, vector_state.rcx);
+  CHECK_NE(0U, scalar_state.sum);
+  CHECK_EQ(scalar_state.sum, vector_state.sum)
+      << "Vector registers were not written back before a call";
+  for (unsigned i = 0; i < kNumVecRegs; ++i) {
+    CHECK(!memcmp(scalar_state.vec[i], vector_state.vec[i], kVecRegSize))
+        << "Vectorized loop computed a different vector register " << i;
+  }
+  return EXIT_SUCCESS;
+}
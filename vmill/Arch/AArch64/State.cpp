@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "remill/Arch/AArch64/Runtime/State.h"
+
+#include "vmill/Arch/Arch.h"
+
+namespace vmill {
+namespace {
+
+static uint64_t OffsetOf(const State &state, const void *field) {
+  return static_cast<uint64_t>(
+      reinterpret_cast<uintptr_t>(field) -
+      reinterpret_cast<uintptr_t>(&state));
+}
+
+}  // namespace
+
+std::vector<uint64_t> AArch64ArithmeticFlagOffsets(void) {
+  static const State state = {};
+  return {OffsetOf(state, &state.sr.n), OffsetOf(state, &state.sr.z),
+          OffsetOf(state, &state.sr.c), OffsetOf(state, &state.sr.v)};
+}
+
+uint64_t AArch64StackPointerOffset(void) {
+  static const State state = {};
+  return OffsetOf(state, &state.gpr.sp.qword);
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> AArch64VectorRegisterSlots(void) {
+  static const State state = {};
+  std::vector<std::pair<uint64_t, uint64_t>> slots;
+  for (const auto &reg : state.simd.v) {
+    slots.emplace_back(OffsetOf(state, &reg), sizeof(reg));
+  }
+  return slots;
+}
+
+// Arguments are passed in `X0` through `X7`, and the return address is in the
+// link register.
+bool AArch64ReadFunctionCall(const ArchState *state_, uint64_t *args,
+                             size_t num_args, PC *ret_pc) {
+  auto state = static_cast<const State *>(state_);
+  const uint64_t arg_regs[] = {
+      state->gpr.x0.qword, state->gpr.x1.qword, state->gpr.x2.qword,
+      state->gpr.x3.qword, state->gpr.x4.qword, state->gpr.x5.qword,
+      state->gpr.x6.qword, state->gpr.x7.qword};
+  if (num_args > (sizeof(arg_regs) / sizeof(arg_regs[0]))) {
+    return false;
+  }
+  for (size_t i = 0; i < num_args; ++i) {
+    args[i] = arg_regs[i];
+  }
+  *ret_pc = static_cast<PC>(state->gpr.x30.qword);
+  return true;
+}
+
+void AArch64ReturnFromFunction(ArchState *state_, uint64_t ret_val,
+                               PC ret_pc) {
+  auto state = static_cast<State *>(state_);
+  state->gpr.x0.qword = ret_val;
+  state->gpr.pc.qword = static_cast<uint64_t>(ret_pc);
+}
+
+}  // namespace vmill
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <glog/logging.h>
+
 #include "remill/Arch/Arch.h"
 
 #include "vmill/Arch/Arch.h"
@@ -24,6 +26,30 @@ extern void LogX86RegisterState(std::ostream &os, const ArchState *state_);
 extern void LogAMD64RegisterState(std::ostream &os, const ArchState *state_);
 extern void LogAArch64RegisterState(std::ostream &os, const ArchState *state_);
 
+extern std::vector<uint64_t> X86ArithmeticFlagOffsets(void);
+extern std::vector<uint64_t> AArch64ArithmeticFlagOffsets(void);
+
+extern uint64_t X86StackPointerOffset(void);
+extern uint64_t AArch64StackPointerOffset(void);
+
+extern std::vector<std::pair<uint64_t, uint64_t>> X86VectorRegisterSlots(void);
+extern std::vector<std::pair<uint64_t, uint64_t>>
+AArch64VectorRegisterSlots(void);
+
+extern bool X86DecodeStringOp(const std::string &bytes, bool is_64_bit,
+                              StringOp *op);
+
+extern bool X86ReadFunctionCall(const ArchState *state, AddressSpace *memory,
+                                uint64_t *args, size_t num_args, PC *ret_pc,
+                                bool is_64_bit);
+extern bool AArch64ReadFunctionCall(const ArchState *state, uint64_t *args,
+                                    size_t num_args, PC *ret_pc);
+
+extern void X86ReturnFromFunction(ArchState *state, uint64_t ret_val,
+                                  PC ret_pc, bool is_64_bit);
+extern void AArch64ReturnFromFunction(ArchState *state, uint64_t ret_val,
+                                      PC ret_pc);
+
 void LogRegisterState(std::ostream &os, const ArchState *state) {
   auto arch = remill::GetTargetArch();
   if (arch->IsX86()) {
@@ -35,4 +61,78 @@ void LogRegisterState(std::ostream &os, const ArchState *state) {
   }
 }
 
+std::vector<uint64_t> ArithmeticFlagOffsets(void) {
+  auto arch = remill::GetTargetArch();
+  if (arch->IsX86() || arch->IsAMD64()) {
+    return X86ArithmeticFlagOffsets();
+  } else if (arch->IsAArch64()) {
+    return AArch64ArithmeticFlagOffsets();
+  } else {
+    return {};
+  }
+}
+
+uint64_t StackPointerOffset(void) {
+  auto arch = remill::GetTargetArch();
+  if (arch->IsX86() || arch->IsAMD64()) {
+    return X86StackPointerOffset();
+  } else if (arch->IsAArch64()) {
+    return AArch64StackPointerOffset();
+  } else {
+    LOG(FATAL)
+        << "Cannot find the stack pointer for the target architecture.";
+    return 0;
+  }
+}
+
+std::vector<std::pair<uint64_t, uint64_t>> VectorRegisterSlots(void) {
+  auto arch = remill::GetTargetArch();
+  if (arch->IsX86() || arch->IsAMD64()) {
+    return X86VectorRegisterSlots();
+  } else if (arch->IsAArch64()) {
+    return AArch64VectorRegisterSlots();
+  } else {
+    return {};
+  }
+}
+
+bool ReadFunctionCall(const ArchState *state, AddressSpace *memory,
+                      uint64_t *args, size_t num_args, PC *ret_pc) {
+  auto arch = remill::GetTargetArch();
+  if (arch->IsX86()) {
+    return X86ReadFunctionCall(state, memory, args, num_args, ret_pc, false);
+  } else if (arch->IsAMD64()) {
+    return X86ReadFunctionCall(state, memory, args, num_args, ret_pc, true);
+  } else if (arch->IsAArch64()) {
+    return AArch64ReadFunctionCall(state, args, num_args, ret_pc);
+  } else {
+    return false;
+  }
+}
+
+void ReturnFromFunction(ArchState *state, uint64_t ret_val, PC ret_pc) {
+  auto arch = remill::GetTargetArch();
+  if (arch->IsX86()) {
+    X86ReturnFromFunction(state, ret_val, ret_pc, false);
+  } else if (arch->IsAMD64()) {
+    X86ReturnFromFunction(state, ret_val, ret_pc, true);
+  } else if (arch->IsAArch64()) {
+    AArch64ReturnFromFunction(state, ret_val, ret_pc);
+  } else {
+    LOG(FATAL)
+        << "Cannot return from functions on the target architecture.";
+  }
+}
+
+bool DecodeStringOp(const std::string &bytes, StringOp *op) {
+  auto arch = remill::GetTargetArch();
+  if (arch->IsX86()) {
+    return X86DecodeStringOp(bytes, false, op);
+  } else if (arch->IsAMD64()) {
+    return X86DecodeStringOp(bytes, true, op);
+  } else {
+    return false;
+  }
+}
+
 }  // namespace vmill
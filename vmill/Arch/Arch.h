@@ -17,14 +17,67 @@
 #ifndef VMILL_ARCH_ARCH_H_
 #define VMILL_ARCH_ARCH_H_
 
+#include <cstddef>
+#include <cstdint>
 #include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
 
 struct ArchState;
 
 namespace vmill {
 
+class AddressSpace;
+enum class PC : uint64_t;
+
 void LogRegisterState(std::ostream &os, const ArchState *state);
 
+// Returns the byte offsets of the one-byte arithmetic flags (e.g. `CF`, `ZF`)
+// within the `State` structure of the target architecture.
+std::vector<uint64_t> ArithmeticFlagOffsets(void);
+
+// Returns the byte offset of the stack pointer register within the `State`
+// structure of the target architecture.
+uint64_t StackPointerOffset(void);
+
+// Returns the byte offsets and sizes of the vector registers (e.g. `XMM0`, or
+// `V0` on AArch64) within the `State` structure of the target architecture.
+std::vector<std::pair<uint64_t, uint64_t>> VectorRegisterSlots(void);
+
+enum StringOpKind {
+  kStringOpCopy,  // E.g. `rep movsb`.
+  kStringOpFill,  // E.g. `rep stosb`.
+  kStringOpCompareWhileEqual,  // E.g. `repe cmpsb`.
+  kStringOpCompareWhileNotEqual  // E.g. `repne cmpsb`.
+};
+
+// A repeated string instruction that can be executed as a bulk operation on
+// guest memory. The offsets are byte offsets within the `State` structure.
+struct StringOp {
+  StringOpKind kind;
+  uint64_t element_size;
+  uint64_t count_offset;
+  uint64_t source_offset;
+  uint64_t dest_offset;
+  uint64_t value_offset;  // Value stored by a fill.
+  uint64_t direction_offset;  // One-byte flag, non-zero if going backward.
+};
+
+// Reads the return address and the first `num_args` integer arguments of a
+// guest function call, as seen on entry to the called function. Returns
+// `false` if the arguments can't be read.
+bool ReadFunctionCall(const ArchState *state, AddressSpace *memory,
+                      uint64_t *args, size_t num_args, PC *ret_pc);
+
+// Returns from a guest function call to `ret_pc`, as if by the called
+// function's return instruction, with the integer return value `ret_val`.
+void ReturnFromFunction(ArchState *state, uint64_t ret_val, PC ret_pc);
+
+// Returns `true` if the machine code `bytes` of an instruction is a repeated
+// string instruction that can be executed in bulk, and if so, fills in `op`.
+bool DecodeStringOp(const std::string &bytes, StringOp *op);
+
 }  // namespace vmill
 
 #endif  // VMILL_ARCH_ARCH_H_
@@ -18,6 +18,8 @@
 #include <glog/logging.h>
 
 #include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <limits>
 #include <set>
 #include <string>
@@ -32,6 +34,27 @@
 
 DECLARE_bool(verbose);
 
+DEFINE_uint64(max_jump_table_entries, 512,
+              "Maximum number of entries in a recovered jump table. The number "
+              "of entries comes from the bounds check guarding the jump; "
+              "bigger tables are left as indirect jumps. A value of zero "
+              "disables jump table recovery.");
+
+DEFINE_bool(devirtualize_got_calls, true,
+            "Predict the targets of indirect jumps and calls through memory "
+            "slots (e.g. PLT jumps through the GOT), and lift them as guarded "
+            "direct transfers of control flow.");
+
+DEFINE_bool(fold_read_only_data, true,
+            "Fold loads from absolute or PC-relative addresses in read-only "
+            "memory (e.g. `.rodata` and relocated GOT entries) into "
+            "constants in the lifted code.");
+
+DEFINE_bool(lift_functions, false,
+            "Lift whole guest functions, including the code following system "
+            "calls, into single functions with multiple entry points, and "
+            "allow direct callees to be inlined into their callers.");
+
 namespace vmill {
 namespace {
 
@@ -59,6 +82,352 @@ static std::string ReadInstructionBytes(
 
 using DecoderWorkList = std::set<uint64_t>;
 
+// Returns `true` if `name` names a segment whose base is zero in a flat
+// memory model.
+static bool IsFlatSegment(const std::string &name) {
+  return name.empty() || name == "DS_BASE" || name == "CS_BASE" ||
+         name == "SS_BASE" || name == "ES_BASE";
+}
+
+// Returns `true` if `op` reads memory at an address that can be computed at
+// decode time, i.e. an absolute or PC-relative address, and if so, stores
+// the address into `addr_out`.
+static bool GetStaticMemoryAddress(const remill::Arch *arch,
+                                   const remill::Instruction &inst,
+                                   const remill::Operand &op,
+                                   uint64_t *addr_out) {
+  if (remill::Operand::kTypeAddress != op.type ||
+      remill::Operand::Address::kMemoryRead != op.addr.kind) {
+    return false;
+  }
+
+  const auto &addr = op.addr;
+  if (!addr.index_reg.name.empty() ||
+      !IsFlatSegment(addr.segment_base_reg.name)) {
+    return false;
+  }
+
+  const uint64_t addr_mask = 32 == arch->address_size ? 0xFFFFFFFFULL : ~0ULL;
+  const auto disp = static_cast<uint64_t>(addr.displacement);
+  if (addr.base_reg.name.empty()) {
+    *addr_out = disp & addr_mask;
+    return true;
+
+  // PC-relative addresses are relative to the next instruction.
+  } else if (addr.base_reg.name == "RIP" || addr.base_reg.name == "NEXT_PC") {
+    *addr_out = (inst.next_pc + disp) & addr_mask;
+    return true;
+
+  } else {
+    return false;
+  }
+}
+
+// Try to predict the target of an indirect jump or call whose target is
+// loaded from a single memory slot, e.g. `jmp [rip + GOT]` in a PLT entry.
+// The slot may be writable; the lifted code re-checks the prediction against
+// the live value of the slot.
+static bool PredictIndirectTarget(const remill::Arch *arch,
+                                  AddressSpace &addr_space,
+                                  const remill::Instruction &inst,
+                                  PC *target_out) {
+  if (!FLAGS_devirtualize_got_calls) {
+    return false;
+  }
+
+  const uint64_t slot_size = arch->address_size / 8;
+  for (const auto &op : inst.operands) {
+    uint64_t slot_addr = 0;
+    if (!GetStaticMemoryAddress(arch, inst, op, &slot_addr)) {
+      continue;
+    }
+
+    if (op.size != (slot_size * 8) || !addr_space.CanRead(slot_addr) ||
+        !addr_space.CanRead(slot_addr + slot_size - 1)) {
+      return false;
+    }
+
+    uint64_t target = 0;
+    if (8 == slot_size) {
+      if (!addr_space.TryRead(slot_addr, &target)) {
+        return false;
+      }
+    } else {
+      uint32_t target32 = 0;
+      if (!addr_space.TryRead(slot_addr, &target32)) {
+        return false;
+      }
+      target = target32;
+    }
+
+    if (!addr_space.CanExecute(target)) {
+      return false;
+    }
+
+    *target_out = static_cast<PC>(target);
+    return true;
+  }
+
+  return false;
+}
+
+// Record the values read by the memory operands of `inst` whose addresses
+// are known at decode time, and that lie in readable but non-writable memory.
+static void FindReadOnlyData(const remill::Arch *arch,
+                             AddressSpace &addr_space,
+                             const remill::Instruction &inst,
+                             ReadOnlyDataMap &data) {
+  if (!FLAGS_fold_read_only_data) {
+    return;
+  }
+
+  for (const auto &op : inst.operands) {
+    uint64_t addr = 0;
+    if (!GetStaticMemoryAddress(arch, inst, op, &addr)) {
+      continue;
+    }
+
+    const uint64_t size = op.size / 8;
+    const auto last_addr = addr + size - 1;
+    if (!size || size > 8 || !addr_space.CanFoldData(addr) ||
+        !addr_space.CanFoldData(last_addr)) {
+      continue;
+    }
+
+    std::string bytes(size, '\0');
+    if (!addr_space.TryRead(addr, &(bytes[0]), size)) {
+      continue;
+    }
+
+    data[addr] = std::move(bytes);
+  }
+}
+
+// Record which pages had their data folded into `trace`, so that changing
+// one of them only invalidates the code entered at the trace's entry PCs.
+static void MarkFoldedData(AddressSpace &addr_space,
+                           const DecodedTrace &trace) {
+  for (const auto &entry : trace.read_only_data) {
+    const auto addr = entry.first;
+    const auto last_addr = addr + entry.second.size() - 1;
+    addr_space.MarkAsFoldedData(addr, trace.pc);
+    addr_space.MarkAsFoldedData(last_addr, trace.pc);
+    for (auto entry_pc : trace.entry_pcs) {
+      addr_space.MarkAsFoldedData(addr, entry_pc);
+      addr_space.MarkAsFoldedData(last_addr, entry_pc);
+    }
+  }
+}
+
+// Returns the name of the widest general-purpose register that contains the
+// register `name`, e.g. `RAX` for `EAX`, or `R8` for `R8D`.
+static std::string FullRegisterName(const std::string &name) {
+  if (name.size() > 1 && 'R' == name[0] && isdigit(name[1])) {
+    auto end = name.size();
+    while (end && !isdigit(name[end - 1])) {
+      --end;
+    }
+    return name.substr(0, end);
+  } else if (3 == name.size() && 'E' == name[0]) {
+    return "R" + name.substr(1);
+  } else if (2 == name.size() && ('X' == name[1] || 'P' == name[1] ||
+                                  'I' == name[1])) {
+    return "R" + name;
+  } else {
+    return name;
+  }
+}
+
+// Returns the instruction of `insts` that falls through to `pc`, or `nullptr`
+// if there is none.
+static const remill::Instruction *FallThroughPredecessor(
+    const InstructionMap &insts, uint64_t pc) {
+  auto it = insts.lower_bound(static_cast<PC>(pc));
+  if (it == insts.begin()) {
+    return nullptr;
+  }
+  --it;
+  const auto &inst = it->second;
+  if (inst.next_pc != pc) {
+    return nullptr;
+  }
+  switch (inst.category) {
+    case remill::Instruction::kCategoryNormal:
+    case remill::Instruction::kCategoryNoOp:
+    case remill::Instruction::kCategoryConditionalBranch:
+      return &inst;
+    default:
+      return nullptr;
+  }
+}
+
+// Returns `true` if `name` is the name of the semantics function of an x86
+// instruction in the `iform` class `iclass`, e.g. `JNBE_RELBRb` for `JNBE`.
+static bool IsInstructionClass(const std::string &name, const char *iclass) {
+  const auto len = strlen(iclass);
+  return name.size() > len && !name.compare(0, len, iclass) &&
+         '_' == name[len];
+}
+
+// Finds the number of entries in the jump table indexed by `index_reg` in
+// the indirect jump at `jump_pc`, from the bounds check that guards it, e.g.
+//
+//      cmp   edi, 7
+//      ja    default
+//      mov   edi, edi
+//      jmp   [table + rdi * 8]
+//
+// Only moves into the index register (e.g. zero extensions) may come between
+// the bounds check and the jump.
+static bool FindJumpTableSize(const InstructionMap &insts, uint64_t jump_pc,
+                              std::string index_reg, uint64_t *num_entries) {
+  index_reg = FullRegisterName(index_reg);
+  auto pc = jump_pc;
+  for (auto i = 0; i < 4; ++i) {
+    auto inst = FallThroughPredecessor(insts, pc);
+    if (!inst) {
+      return false;
+    }
+    pc = inst->pc;
+
+    if (remill::Instruction::kCategoryConditionalBranch != inst->category) {
+      std::string read_reg;
+      auto writes_index = false;
+      auto num_reads = 0;
+      for (const auto &op : inst->operands) {
+        if (remill::Operand::kTypeRegister != op.type) {
+          ++num_reads;
+        } else if (remill::Operand::kActionWrite == op.action) {
+          writes_index = writes_index ||
+                         FullRegisterName(op.reg.name) == index_reg;
+        } else {
+          read_reg = op.reg.name;
+          ++num_reads;
+        }
+      }
+      if (writes_index) {
+        if (1 != num_reads || read_reg.empty()) {
+          return false;
+        }
+        index_reg = FullRegisterName(read_reg);
+      }
+      continue;
+    }
+
+    // The jump to the default case must be taken when the index is too big.
+    auto is_above = IsInstructionClass(inst->function, "JNBE");
+    if (!is_above && !IsInstructionClass(inst->function, "JNB")) {
+      return false;
+    }
+
+    auto cmp = FallThroughPredecessor(insts, pc);
+    if (!cmp || !IsInstructionClass(cmp->function, "CMP")) {
+      return false;
+    }
+
+    auto compares_index = false;
+    auto has_bound = false;
+    uint64_t bound = 0;
+    for (const auto &op : cmp->operands) {
+      if (remill::Operand::kTypeRegister == op.type) {
+        compares_index = FullRegisterName(op.reg.name) == index_reg;
+      } else if (remill::Operand::kTypeImmediate == op.type) {
+        has_bound = !op.imm.is_signed ||
+                    0 <= static_cast<int64_t>(op.imm.val);
+        bound = op.imm.val;
+      }
+    }
+    if (!compares_index || !has_bound ||
+        bound >= FLAGS_max_jump_table_entries) {
+      return false;
+    }
+
+    *num_entries = is_above ? bound + 1 : bound;
+    return 0 != *num_entries;
+  }
+  return false;
+}
+
+// Try to recover the targets of an indirect jump through a table of absolute
+// code addresses, e.g. `jmp [table + reg * 8]`. The table is only trusted if
+// it lives in readable but non-writable memory, if its size is known from the
+// bounds check that guards the jump, and if all of its entries point into
+// executable memory. Otherwise, the jump is left as an indirect jump.
+static bool RecoverJumpTable(const remill::Arch *arch,
+                             AddressSpace &addr_space,
+                             const InstructionMap &insts,
+                             const remill::Instruction &inst,
+                             JumpTable *table) {
+  if (!FLAGS_max_jump_table_entries) {
+    return false;
+  }
+
+  const uint64_t entry_size = arch->address_size / 8;
+  const uint64_t addr_mask = 32 == arch->address_size ? 0xFFFFFFFFULL : ~0ULL;
+
+  for (const auto &op : inst.operands) {
+    if (remill::Operand::kTypeAddress != op.type ||
+        remill::Operand::Address::kMemoryRead != op.addr.kind) {
+      continue;
+    }
+
+    const auto &addr = op.addr;
+    if (!addr.base_reg.name.empty() || addr.index_reg.name.empty() ||
+        !IsFlatSegment(addr.segment_base_reg.name) ||
+        static_cast<uint64_t>(addr.scale) != entry_size) {
+      return false;
+    }
+
+    uint64_t num_entries = 0;
+    if (!FindJumpTableSize(insts, inst.pc, addr.index_reg.name,
+                           &num_entries)) {
+      return false;
+    }
+
+    table->address = static_cast<uint64_t>(addr.displacement) & addr_mask;
+    table->code_version = addr_space.ComputeCodeVersion(
+        static_cast<PC>(table->address));
+    table->targets.clear();
+
+    std::set<uint64_t> seen_targets;
+    for (uint64_t i = 0; i < num_entries; ++i) {
+      const auto entry_addr = (table->address + i * entry_size) & addr_mask;
+      const auto entry_last_addr = (entry_addr + entry_size - 1) & addr_mask;
+      if (!addr_space.CanRead(entry_addr) ||
+          !addr_space.CanRead(entry_last_addr) ||
+          addr_space.CanWrite(entry_addr) ||
+          addr_space.CanWrite(entry_last_addr)) {
+        return false;
+      }
+
+      uint64_t target = 0;
+      if (8 == entry_size) {
+        if (!addr_space.TryRead(entry_addr, &target)) {
+          return false;
+        }
+      } else {
+        uint32_t target32 = 0;
+        if (!addr_space.TryRead(entry_addr, &target32)) {
+          return false;
+        }
+        target = target32;
+      }
+
+      if (!addr_space.CanExecute(target)) {
+        return false;
+      }
+
+      if (seen_targets.insert(target).second) {
+        table->targets.push_back(static_cast<PC>(target));
+      }
+    }
+
+    return true;
+  }
+
+  return false;
+}
+
 // Enqueue control flow targets for processing. We only follow directly
 // reachable control-flow targets in this list.
 static void AddSuccessorsToWorkList(const remill::Instruction &inst,
@@ -68,7 +437,14 @@ static void AddSuccessorsToWorkList(const remill::Instruction &inst,
     case remill::Instruction::kCategoryError:
     case remill::Instruction::kCategoryIndirectJump:
     case remill::Instruction::kCategoryFunctionReturn:
+      break;
+
+    // When lifting whole functions, execution usually carries on within the
+    // function after a system call.
     case remill::Instruction::kCategoryAsyncHyperCall:
+      if (FLAGS_lift_functions) {
+        work_list.insert(inst.next_pc);
+      }
       break;
 
     case remill::Instruction::kCategoryIndirectFunctionCall:
@@ -127,6 +503,29 @@ static TraceId HashTraceInstructions(const DecodedTrace &trace) {
     hash2.Update(entry.second.bytes.data(), entry.second.bytes.size());
   }
 
+  // The lifted code embeds the targets of recovered jump tables, so a change
+  // to the contents of a table must produce a different trace.
+  for (const auto &entry : trace.jump_tables) {
+    const auto &table = entry.second;
+    hash2.Update(&(table.code_version), sizeof(table.code_version));
+    hash2.Update(table.targets.data(), table.targets.size() * sizeof(PC));
+  }
+
+  for (const auto &entry : trace.predicted_targets) {
+    hash2.Update(&(entry.first), sizeof(entry.first));
+    hash2.Update(&(entry.second), sizeof(entry.second));
+  }
+
+  for (auto entry_pc : trace.entry_pcs) {
+    hash2.Update(&entry_pc, sizeof(entry_pc));
+  }
+
+  // Likewise for folded read-only data.
+  for (const auto &entry : trace.read_only_data) {
+    hash2.Update(&(entry.first), sizeof(entry.first));
+    hash2.Update(entry.second.data(), entry.second.size());
+  }
+
   return {trace.pc, static_cast<TraceHash>(hash2.Digest())};
 }
 
@@ -191,9 +590,51 @@ DecodedTraceList DecodeTraces(AddressSpace &addr_space, PC start_pc) {
       } else {
         AddSuccessorsToWorkList(inst, work_list);
         AddSuccessorsToTraceList(inst, trace_list);
+        FindReadOnlyData(arch, addr_space, inst, trace.read_only_data);
+      }
+
+      // Execution can also resume after a system call by way of the
+      // dispatcher, e.g. once a signal handler returns, so the next
+      // instruction is another entry point into the function.
+      if (FLAGS_lift_functions &&
+          remill::Instruction::kCategoryAsyncHyperCall == inst.category &&
+          inst.next_pc != trace_pc_uint) {
+        trace.entry_pcs.insert(static_cast<PC>(inst.next_pc));
+      }
+
+      if (remill::Instruction::kCategoryIndirectJump == inst.category) {
+        JumpTable table;
+        if (RecoverJumpTable(arch, addr_space, trace.instructions, inst,
+                             &table)) {
+          DLOG_IF(INFO, FLAGS_verbose)
+              << "Recovered " << table.targets.size() << " targets from "
+              << "jump table at " << std::hex << table.address
+              << " used by indirect jump at " << pc << std::dec;
+
+          for (auto target : table.targets) {
+            work_list.insert(static_cast<uint64_t>(target));
+          }
+          trace.jump_tables[static_cast<PC>(pc)] = std::move(table);
+          continue;
+        }
+      }
+
+      if (remill::Instruction::kCategoryIndirectJump == inst.category ||
+          remill::Instruction::kCategoryIndirectFunctionCall == inst.category) {
+        PC target = static_cast<PC>(0);
+        if (PredictIndirectTarget(arch, addr_space, inst, &target)) {
+          DLOG_IF(INFO, FLAGS_verbose)
+              << "Predicted target " << std::hex
+              << static_cast<uint64_t>(target) << " of indirect control "
+              << "flow at " << pc << std::dec;
+
+          trace.predicted_targets[static_cast<PC>(pc)] = target;
+          trace_list.insert(static_cast<uint64_t>(target));
+        }
       }
     }
 
+    MarkFoldedData(addr_space, trace);
     trace.id = HashTraceInstructions(trace);
 
     DLOG_IF(INFO, FLAGS_verbose)
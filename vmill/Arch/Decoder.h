@@ -20,6 +20,8 @@
 #include <functional>
 #include <list>
 #include <map>
+#include <set>
+#include <vector>
 
 #include "remill/Arch/Instruction.h"
 #include "vmill/BC/Trace.h"
@@ -30,11 +32,33 @@ class AddressSpace;
 
 using InstructionMap = std::map<PC, remill::Instruction>;
 
+// Targets recovered from a table of code addresses, e.g. the table used by
+// `jmp [table + reg * 8]` to implement a `switch` statement.
+struct JumpTable {
+  uint64_t address;  // Address of the first entry in the table.
+  CodeVersion code_version;  // Version of the memory containing the table.
+  std::vector<PC> targets;  // Unique targets, in table order.
+};
+
+// Maps the PC of an indirect jump to the table through which it dispatches.
+using JumpTableMap = std::map<PC, JumpTable>;
+
+// Maps the PC of an indirect jump or call through a memory slot (e.g. a GOT
+// entry) to the code address held by that slot at decode time.
+using PredictedTargetMap = std::map<PC, PC>;
+
 struct DecodedTrace {
   PC pc;  // Entry PC of the trace.
   CodeVersion code_version; // Version of address space at decode time.
   TraceId id;  // Unique ID for a given trace.
   InstructionMap instructions;
+  JumpTableMap jump_tables;
+  PredictedTargetMap predicted_targets;
+  ReadOnlyDataMap read_only_data;  // Read-only data loaded by the trace.
+
+  // Other PCs at which the lifted trace can be entered, e.g. the instructions
+  // following system calls. These are only used when lifting functions.
+  std::set<PC> entry_pcs;
 };
 
 class DecodedTraceList : public std::list<DecodedTrace> {};
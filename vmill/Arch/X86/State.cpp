@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define ADDRESS_SIZE_BITS 64
+#define HAS_FEATURE_AVX 1
+#define HAS_FEATURE_AVX512 1
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "remill/Arch/X86/Runtime/State.h"
+
+#include "vmill/Arch/Arch.h"
+#include "vmill/Program/AddressSpace.h"
+
+namespace vmill {
+namespace {
+
+static uint64_t OffsetOf(const State &state, const void *field) {
+  return static_cast<uint64_t>(
+      reinterpret_cast<uintptr_t>(field) -
+      reinterpret_cast<uintptr_t>(&state));
+}
+
+}  // namespace
+
+// The arithmetic flags are the only flags whose values are re-computed by
+// nearly every instruction. The direction flag is left out on purpose.
+std::vector<uint64_t> X86ArithmeticFlagOffsets(void) {
+  static const State state = {};
+  return {OffsetOf(state, &state.aflag.cf), OffsetOf(state, &state.aflag.pf),
+          OffsetOf(state, &state.aflag.af), OffsetOf(state, &state.aflag.zf),
+          OffsetOf(state, &state.aflag.sf), OffsetOf(state, &state.aflag.of)};
+}
+
+uint64_t X86StackPointerOffset(void) {
+  static const State state = {};
+  return OffsetOf(state, &state.gpr.rsp.qword);
+}
+
+// Each slot covers one `ZMM` register, along with the `XMM` and `YMM`
+// registers that alias its low lanes.
+std::vector<std::pair<uint64_t, uint64_t>> X86VectorRegisterSlots(void) {
+  static const State state = {};
+  std::vector<std::pair<uint64_t, uint64_t>> slots;
+  for (const auto &reg : state.vec) {
+    slots.emplace_back(OffsetOf(state, &reg), sizeof(reg));
+  }
+  return slots;
+}
+
+// Arguments are passed in registers on AMD64, and on the stack on x86.
+bool X86ReadFunctionCall(const ArchState *state_, AddressSpace *memory,
+                         uint64_t *args, size_t num_args, PC *ret_pc,
+                         bool is_64_bit) {
+  auto state = static_cast<const State *>(state_);
+  if (is_64_bit) {
+    const uint64_t arg_regs[] = {
+        state->gpr.rdi.qword, state->gpr.rsi.qword, state->gpr.rdx.qword,
+        state->gpr.rcx.qword, state->gpr.r8.qword, state->gpr.r9.qword};
+    if (num_args > (sizeof(arg_regs) / sizeof(arg_regs[0]))) {
+      return false;
+    }
+
+    uint64_t ret_addr = 0;
+    if (!memory->TryRead(state->gpr.rsp.qword, &ret_addr)) {
+      return false;
+    }
+    for (size_t i = 0; i < num_args; ++i) {
+      args[i] = arg_regs[i];
+    }
+    *ret_pc = static_cast<PC>(ret_addr);
+    return true;
+  }
+
+  const auto esp = state->gpr.rsp.dword;
+  uint32_t ret_addr = 0;
+  if (!memory->TryRead(esp, &ret_addr)) {
+    return false;
+  }
+  for (size_t i = 0; i < num_args; ++i) {
+    uint32_t arg = 0;
+    if (!memory->TryRead(esp + 4 * (i + 1), &arg)) {
+      return false;
+    }
+    args[i] = arg;
+  }
+  *ret_pc = static_cast<PC>(ret_addr);
+  return true;
+}
+
+void X86ReturnFromFunction(ArchState *state_, uint64_t ret_val, PC ret_pc,
+                           bool is_64_bit) {
+  auto state = static_cast<State *>(state_);
+  if (is_64_bit) {
+    state->gpr.rax.qword = ret_val;
+    state->gpr.rsp.qword += 8;
+    state->gpr.rip.qword = static_cast<uint64_t>(ret_pc);
+  } else {
+    state->gpr.rax.dword = static_cast<uint32_t>(ret_val);
+    state->gpr.rsp.dword += 4;
+    state->gpr.rip.dword = static_cast<uint32_t>(ret_pc);
+  }
+}
+
+// Decodes `rep movs`, `rep stos`, `repe cmps`, and `repne cmps`. Anything with
+// a segment override or an address size override is left alone, as the bulk
+// operations only deal with flat addresses of the default size.
+bool X86DecodeStringOp(const std::string &bytes, bool is_64_bit,
+                       StringOp *op) {
+  auto has_rep = false;
+  auto has_repne = false;
+  auto has_opsize = false;
+  auto has_rex_w = false;
+
+  size_t i = 0;
+  for (; i < bytes.size(); ++i) {
+    const auto byte = static_cast<uint8_t>(bytes[i]);
+    if (0xF3 == byte) {
+      has_rep = true;
+      has_repne = false;
+    } else if (0xF2 == byte) {
+      has_repne = true;
+      has_rep = false;
+    } else if (0x66 == byte) {
+      has_opsize = true;
+    } else if (is_64_bit && 0x40 == (byte & 0xF0)) {
+      has_rex_w = 0 != (byte & 0x08);
+      ++i;  // REX must immediately precede the opcode.
+      break;
+    } else {
+      break;
+    }
+  }
+
+  if (i >= bytes.size() || (!has_rep && !has_repne)) {
+    return false;
+  }
+
+  static const State state = {};
+  switch (static_cast<uint8_t>(bytes[i])) {
+    case 0xA4:
+    case 0xA5:
+      op->kind = kStringOpCopy;
+      break;
+    case 0xAA:
+    case 0xAB:
+      op->kind = kStringOpFill;
+      break;
+    case 0xA6:
+    case 0xA7:
+      op->kind = has_rep ? kStringOpCompareWhileEqual :
+                 kStringOpCompareWhileNotEqual;
+      break;
+    default:
+      return false;
+  }
+
+  // Only compares distinguish between `repe` and `repne`.
+  if (has_repne && (kStringOpCopy == op->kind || kStringOpFill == op->kind)) {
+    return false;
+  }
+
+  if (0 == (bytes[i] & 1)) {
+    op->element_size = 1;
+  } else if (has_rex_w) {
+    op->element_size = 8;
+  } else if (has_opsize) {
+    op->element_size = 2;
+  } else {
+    op->element_size = 4;
+  }
+
+  op->count_offset = OffsetOf(state, &state.gpr.rcx.qword);
+  op->source_offset = OffsetOf(state, &state.gpr.rsi.qword);
+  op->dest_offset = OffsetOf(state, &state.gpr.rdi.qword);
+  op->value_offset = OffsetOf(state, &state.gpr.rax.qword);
+  op->direction_offset = OffsetOf(state, &state.aflag.df);
+  return true;
+}
+
+}  // namespace vmill
@@ -44,6 +44,7 @@
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
 #include "remill/Arch/Arch.h"
+#include "remill/Arch/Name.h"
 #include "remill/BC/Compat/FileSystem.h"
 #include "remill/BC/Util.h"
 #include "remill/BC/Version.h"
@@ -56,6 +57,20 @@
 DEFINE_bool(disable_optimizer, false,
             "Should the optimized machine code be produced?");
 
+#if REMILL_ON_AMD64 && defined(__linux__)
+# define VMILL_DEFAULT_CODE_MODEL "small"
+#else
+# define VMILL_DEFAULT_CODE_MODEL "large"
+#endif
+
+DEFINE_string(code_model, VMILL_DEFAULT_CODE_MODEL,
+              "Code model used to compile lifted code and the runtime. One of "
+              "`small`, `medium`, or `large`. The small and medium models "
+              "require that the code cache, its data, and the runtime be "
+              "within 2 GiB of each other, and use direct calls and jumps.");
+
+#undef VMILL_DEFAULT_CODE_MODEL
+
 namespace vmill {
 namespace {
 
@@ -94,6 +109,34 @@ static llvm::CodeGenOpt::Level CodeGenOptLevel(void) {
   }
 }
 
+static llvm::CodeModel::Model GetCodeModel(void) {
+  if (FLAGS_code_model == "small") {
+    return llvm::CodeModel::Small;
+  } else if (FLAGS_code_model == "medium") {
+    return llvm::CodeModel::Medium;
+  } else if (FLAGS_code_model == "large") {
+    return llvm::CodeModel::Large;
+  } else {
+    LOG(FATAL)
+        << "Invalid code model " << FLAGS_code_model
+        << "; expected one of `small`, `medium`, or `large`.";
+    return llvm::CodeModel::Large;
+  }
+}
+
+// Under the small and medium code models, calls to functions declared but
+// not defined in a module are made direct (i.e. not through the PLT) by
+// treating the functions as hidden. The code cache guarantees that the
+// callees are reachable, going through trampolines if necessary.
+static void MakeCallsDirect(llvm::Module &module) {
+  for (auto &func : module) {
+    if (func.isDeclaration() && !func.isIntrinsic() &&
+        !func.hasLocalLinkage()) {
+      func.setVisibility(llvm::GlobalValue::HiddenVisibility);
+    }
+  }
+}
+
 static void RemoveThreadLocals(llvm::Module &module) {
   for (auto &global : module.globals()) {
     if (global.isThreadLocal()) {
@@ -140,7 +183,7 @@ Compiler::Compiler(const std::shared_ptr<llvm::LLVMContext> &context_)
   machine = std::unique_ptr<llvm::TargetMachine>(target->createTargetMachine(
       host_triple, cpu, GetNativeFeatureString(), options,
       llvm::Reloc::PIC_,
-      llvm::CodeModel::Large,
+      GetCodeModel(),
       CodeGenOptLevel()));
 
   CHECK(machine)
@@ -148,6 +191,12 @@ Compiler::Compiler(const std::shared_ptr<llvm::LLVMContext> &context_)
       << host_triple << " and CPU " << cpu.str();
 }
 
+// Returns `true` if compiled code can only directly reach code and data that
+// is within 2 GiB of it.
+bool Compiler::HasNearCodeModel(void) {
+  return llvm::CodeModel::Large != GetCodeModel();
+}
+
 void Compiler::CompileModuleToFile(llvm::Module &module,
                                    const std::string &path) {
   Timer timer;
@@ -171,6 +220,10 @@ void Compiler::CompileModuleToFile(llvm::Module &module,
   RemoveThreadLocals(module);
   MoveConstructors(module);
 
+  if (HasNearCodeModel()) {
+    MakeCallsDirect(module);
+  }
+
   llvm::MCContext *machine_context = nullptr;
 
   llvm::legacy::PassManager pm;
@@ -42,6 +42,16 @@ class Compiler {
   void CompileModuleToFile(
       llvm::Module &module, const std::string &path);
 
+  // Returns `true` if the code model used to compile modules requires that
+  // everything that compiled code references directly be within 2 GiB of it.
+  static bool HasNearCodeModel(void);
+
+  // Returns the target machine description of the host. This provides the
+  // cost models used by the vectorizers.
+  inline llvm::TargetMachine *HostMachine(void) const {
+    return machine.get();
+  }
+
  private:
   Compiler(void) = delete;
 
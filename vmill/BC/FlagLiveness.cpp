@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
+
+namespace vmill {
+namespace {
+
+// Bit set of arithmetic flags. Bit `i` corresponds to the `i`th flag offset.
+using FlagSet = uint32_t;
+
+// Summary of how a lifted trace, and everything it tail-calls within the
+// batch, treats the flags.
+struct TraceFlagInfo {
+  bool is_analyzable;
+  FlagSet killed_on_entry;  // Flags written before being read, on all paths.
+  std::unordered_map<llvm::Instruction *, FlagSet> reads;
+  std::unordered_map<llvm::StoreInst *, FlagSet> writes;
+};
+
+using TraceFlagInfoMap = std::unordered_map<llvm::Function *, TraceFlagInfo>;
+
+// Returns the set of flags overlapped by the `size` bytes at `offset`.
+static FlagSet FlagsInRange(const std::vector<uint64_t> &flag_offsets,
+                            int64_t offset, uint64_t size) {
+  FlagSet flags = 0;
+  for (size_t i = 0; i < flag_offsets.size(); ++i) {
+    const auto flag_offset = static_cast<int64_t>(flag_offsets[i]);
+    if (offset <= flag_offset &&
+        flag_offset < (offset + static_cast<int64_t>(size))) {
+      flags |= 1U << i;
+    }
+  }
+  return flags;
+}
+
+// Find all of the loads and stores of the flags in `func`. Returns `false` if
+// the state pointer is used in a way that we can't account for.
+static bool FindFlagAccesses(llvm::Function *func,
+                             const std::vector<uint64_t> &flag_offsets,
+                             TraceFlagInfo &info) {
+  if (func->isDeclaration() || func->arg_empty()) {
+    return false;
+  }
+
+  llvm::DataLayout dl(func->getParent());
+  auto state = &*func->arg_begin();  // `State *` is the first argument.
+
+  std::vector<llvm::Value *> work_list;
+  work_list.push_back(state);
+
+  while (!work_list.empty()) {
+    auto ptr = work_list.back();
+    work_list.pop_back();
+
+    for (auto user : ptr->users()) {
+      if (llvm::isa<llvm::BitCastOperator>(user) ||
+          llvm::isa<llvm::GEPOperator>(user)) {
+        int64_t offset = 0;
+        if (!GetConstantOffsetFrom(user, state, dl, &offset)) {
+          return false;
+        }
+        work_list.push_back(user);
+        continue;
+
+      // Calls that take the state pointer are handled as opaque uses of all
+      // flags during the liveness analysis.
+      } else if (auto call = llvm::dyn_cast<llvm::CallInst>(user)) {
+        auto callee = call->getCalledFunction();
+        if (ptr != state || IsStateInvariantIntrinsic(callee) ||
+            (callee && callee->isIntrinsic())) {
+          return false;
+        }
+        continue;
+      }
+
+      int64_t offset = 0;
+      CHECK(GetConstantOffsetFrom(ptr, state, dl, &offset));
+
+      if (auto load = llvm::dyn_cast<llvm::LoadInst>(user)) {
+        const auto size = dl.getTypeStoreSize(load->getType());
+        if (auto flags = FlagsInRange(flag_offsets, offset, size)) {
+          info.reads[load] = flags;
+        }
+
+      } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+        if (store->getValueOperand() == ptr) {
+          return false;
+        }
+        const auto type = store->getValueOperand()->getType();
+        const auto size = dl.getTypeStoreSize(type);
+        if (auto flags = FlagsInRange(flag_offsets, offset, size)) {
+          info.writes[store] = flags;
+        }
+
+      } else {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+class FlagLivenessAnalysis {
+ public:
+  FlagLivenessAnalysis(TraceFlagInfoMap &infos_, FlagSet all_flags_,
+                       bool abi_dead_flags_)
+      : infos(infos_),
+        all_flags(all_flags_),
+        abi_dead_flags(abi_dead_flags_) {}
+
+  // Compute the live flags at the entry to `func`. If `dead_stores` is
+  // non-null, then it is filled with the flag stores whose values are never
+  // read.
+  FlagSet Analyze(llvm::Function *func,
+                  std::vector<llvm::StoreInst *> *dead_stores) {
+    const auto &info = infos[func];
+    if (!info.is_analyzable) {
+      return all_flags;
+    }
+
+    // Backward data-flow over the blocks, iterated to a fixed point.
+    std::unordered_map<llvm::BasicBlock *, FlagSet> live_in;
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (auto &block : *func) {
+        auto live = LiveOut(&block, live_in);
+        for (auto it = block.rbegin(); it != block.rend(); ++it) {
+          live = Transfer(&*it, info, live, nullptr);
+        }
+        auto &old_live = live_in[&block];
+        if (old_live != live) {
+          old_live = live;
+          changed = true;
+        }
+      }
+    }
+
+    if (dead_stores) {
+      for (auto &block : *func) {
+        auto live = LiveOut(&block, live_in);
+        for (auto it = block.rbegin(); it != block.rend(); ++it) {
+          live = Transfer(&*it, info, live, dead_stores);
+        }
+      }
+    }
+
+    return live_in[&(func->getEntryBlock())];
+  }
+
+ private:
+  FlagSet LiveOut(llvm::BasicBlock *block,
+                  std::unordered_map<llvm::BasicBlock *, FlagSet> &live_in) {
+    FlagSet live = 0;
+    for (auto it = llvm::succ_begin(block); it != llvm::succ_end(block);
+         ++it) {
+      live |= live_in[*it];
+    }
+    return live;
+  }
+
+  // Backward transfer function for a single instruction.
+  FlagSet Transfer(llvm::Instruction *inst, const TraceFlagInfo &info,
+                   FlagSet live,
+                   std::vector<llvm::StoreInst *> *dead_stores) {
+    if (llvm::isa<llvm::ReturnInst>(inst)) {
+      return all_flags;
+
+    } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(inst)) {
+      auto write_it = info.writes.find(store);
+      if (write_it == info.writes.end()) {
+        return live;
+      }
+      const auto flags = write_it->second;
+      if (dead_stores && !(flags & live) && IsFlagStore(store)) {
+        dead_stores->push_back(store);
+      }
+      return live & ~flags;
+
+    } else if (auto load = llvm::dyn_cast<llvm::LoadInst>(inst)) {
+      auto read_it = info.reads.find(load);
+      if (read_it != info.reads.end()) {
+        live |= read_it->second;
+      }
+      return live;
+
+    } else if (auto call = llvm::dyn_cast<llvm::CallInst>(inst)) {
+      auto callee = call->getCalledFunction();
+      if (IsStateInvariantIntrinsic(callee) ||
+          (callee && callee->isIntrinsic())) {
+        return live;
+      }
+
+      // The x86-64 and AArch64 ABIs don't preserve the flags across function
+      // returns.
+      if (abi_dead_flags && callee &&
+          callee->getName() == "__remill_function_return") {
+        return 0;
+      }
+
+      // Direct calls to other traces in this batch only need the flags that
+      // those traces don't unconditionally overwrite. Exits through the
+      // dispatcher don't get this treatment, even with a constant target PC:
+      // the dispatcher might run a different version of the target's code
+      // (e.g. under `--version_code`, or after re-lifting), or a hook.
+      if (callee) {
+        auto info_it = infos.find(callee);
+        if (info_it != infos.end() && info_it->second.is_analyzable) {
+          return all_flags & ~info_it->second.killed_on_entry;
+        }
+      }
+
+      return all_flags;
+
+    } else {
+      return live;
+    }
+  }
+
+  // Returns `true` if `store` writes only to flags, and so it is safe to
+  // remove if all those flags are dead.
+  static bool IsFlagStore(llvm::StoreInst *store) {
+    auto type = store->getValueOperand()->getType();
+    return type->isIntegerTy(8) || type->isIntegerTy(1);
+  }
+
+  TraceFlagInfoMap &infos;
+  const FlagSet all_flags;
+  const bool abi_dead_flags;
+};
+
+}  // namespace
+
+// Remove stores to the arithmetic flags that are never read, either within
+// the trace that stores them, or within any trace in `traces` that the trace
+// directly calls.
+unsigned RemoveDeadFlagStores(const TraceMap &traces,
+                              const std::vector<uint64_t> &flag_offsets,
+                              bool abi_dead_flags) {
+  if (traces.empty() || flag_offsets.empty()) {
+    return 0;
+  }
+
+  CHECK(flag_offsets.size() < 32)
+      << "Too many flags to track in a `FlagSet`.";
+
+  const FlagSet all_flags = (1U << flag_offsets.size()) - 1U;
+
+  TraceFlagInfoMap infos;
+  for (const auto &entry : traces) {
+    auto &info = infos[entry.second];
+    info.killed_on_entry = 0;
+    info.is_analyzable = FindFlagAccesses(entry.second, flag_offsets, info);
+  }
+
+  FlagLivenessAnalysis analysis(infos, all_flags, abi_dead_flags);
+
+  // Start by assuming that no trace kills any flags, and grow the killed
+  // sets until they stop changing. This converges on the least fixed point,
+  // which is the safe one in the presence of loops between traces.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (const auto &entry : traces) {
+      auto &info = infos[entry.second];
+      if (!info.is_analyzable) {
+        continue;
+      }
+      const auto killed = all_flags & ~analysis.Analyze(entry.second, nullptr);
+      if (killed != info.killed_on_entry) {
+        info.killed_on_entry = killed;
+        changed = true;
+      }
+    }
+  }
+
+  unsigned num_removed = 0;
+  std::vector<llvm::StoreInst *> dead_stores;
+  for (const auto &entry : traces) {
+    dead_stores.clear();
+    (void) analysis.Analyze(entry.second, &dead_stores);
+    for (auto store : dead_stores) {
+      store->eraseFromParent();
+      num_removed++;
+    }
+  }
+
+  return num_removed;
+}
+
+}  // namespace vmill
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Type.h>
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
+
+namespace vmill {
+namespace {
+
+// Returns the constant value of the `size` bytes at `addr`, if they were all
+// recorded in `data`.
+static bool ReadFoldedData(const ReadOnlyDataMap &data, uint64_t addr,
+                           unsigned size, uint64_t *val) {
+  auto it = data.upper_bound(addr);
+  if (it == data.begin()) {
+    return false;
+  }
+
+  --it;
+  const auto &bytes = it->second;
+  const auto offset = addr - it->first;
+  if (size > sizeof(uint64_t) || (offset + size) > bytes.size()) {
+    return false;
+  }
+
+  // Guests and hosts are both little-endian.
+  *val = 0;
+  memcpy(val, bytes.data() + offset, size);
+  return true;
+}
+
+}  // namespace
+
+// Replace the memory reads of `func` from constant addresses in `data` with
+// the values read at decode time.
+bool FoldReadOnlyMemoryReads(llvm::Function *func,
+                             const ReadOnlyDataMap &data) {
+  if (data.empty()) {
+    return false;
+  }
+
+  std::vector<MemoryAccess> reads;
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      MemoryAccess access = {};
+      if (GetMemoryAccess(&inst, &access) && !access.is_write &&
+          llvm::isa<llvm::ConstantInt>(access.address)) {
+        reads.push_back(access);
+      }
+    }
+  }
+
+  auto changed = false;
+  for (const auto &read : reads) {
+    const auto addr = llvm::dyn_cast<llvm::ConstantInt>(read.address);
+    uint64_t val = 0;
+    if (!ReadFoldedData(data, addr->getZExtValue(), read.size, &val)) {
+      continue;
+    }
+
+    auto type = read.call->getType();
+    auto int_type = llvm::Type::getIntNTy(func->getContext(), read.size * 8);
+    llvm::Constant *folded_val = llvm::ConstantInt::get(int_type, val);
+    if (type != int_type) {
+      folded_val = llvm::ConstantExpr::getBitCast(folded_val, type);
+    }
+
+    read.call->replaceAllUsesWith(folded_val);
+    read.call->eraseFromParent();
+    changed = true;
+  }
+
+  return changed;
+}
+
+}  // namespace vmill
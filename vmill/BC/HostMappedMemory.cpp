@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Metadata.h>
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
+#include "vmill/Program/AddressSpace.h"
+
+namespace vmill {
+namespace {
+
+// Replace `access` by a direct access to the host mapping of guest memory.
+// Faulting accesses are caught by the runtime's `SIGSEGV` handler.
+static void LowerAccess(const MemoryAccess &access) {
+  auto call = access.call;
+  llvm::IRBuilder<> ir(call);
+
+  // The host base of an address space never changes while lifted code is
+  // running against it.
+  auto base_field_addr = ir.CreateAdd(
+      ir.CreatePtrToInt(access.memory, ir.getInt64Ty()),
+      ir.getInt64(offsetof(Memory, host_base)));
+  auto host_base = ir.CreateLoad(ir.CreateIntToPtr(
+      base_field_addr, llvm::PointerType::get(ir.getInt64Ty(), 0)));
+  host_base->setMetadata(llvm::LLVMContext::MD_invariant_load,
+                         llvm::MDNode::get(call->getContext(), llvm::None));
+
+  // Host-mapped guests have 32-bit addresses.
+  auto addr = ir.CreateZExt(
+      ir.CreateZExtOrTrunc(access.address, ir.getInt32Ty()),
+      ir.getInt64Ty());
+
+  auto val_type = access.is_write ? access.value->getType() : call->getType();
+  auto host_ptr = ir.CreateIntToPtr(
+      ir.CreateAdd(host_base, addr), llvm::PointerType::get(val_type, 0));
+
+  // Guest addresses need not be aligned.
+  if (access.is_write) {
+    ir.CreateAlignedStore(access.value, host_ptr, 1);
+    call->replaceAllUsesWith(access.memory);
+  } else {
+    call->replaceAllUsesWith(ir.CreateAlignedLoad(host_ptr, 1));
+  }
+  call->eraseFromParent();
+}
+
+}  // namespace
+
+bool LowerToHostMappedAccesses(llvm::Function *func) {
+  std::vector<MemoryAccess> accesses;
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      MemoryAccess access = {};
+      if (GetMemoryAccess(&inst, &access) &&
+          access.size <= sizeof(uint64_t)) {
+        accesses.push_back(access);
+      }
+    }
+  }
+
+  for (const auto &access : accesses) {
+    LowerAccess(access);
+  }
+
+  return !accesses.empty();
+}
+
+}  // namespace vmill
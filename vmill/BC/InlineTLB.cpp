@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
+
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+#include "remill/BC/Version.h"
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
+#include "vmill/Program/AddressSpace.h"
+
+namespace vmill {
+namespace {
+
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(8, 0)
+using TerminatorInst = llvm::Instruction;
+#else
+using TerminatorInst = llvm::TerminatorInst;
+#endif
+
+static constexpr uint64_t kPageSize = 4096;
+
+// Lifted code rarely accesses more pages than fit in the TLB, so bias the
+// layout towards hits.
+static constexpr uint32_t kHitWeight = 1000;
+static constexpr uint32_t kMissWeight = 1;
+
+// Loads the 64-bit field at `offset` within the TLB entry at `entry_addr`.
+static llvm::Value *LoadEntryField(llvm::IRBuilder<> &ir,
+                                   llvm::Value *entry_addr, size_t offset) {
+  auto field_addr = ir.CreateAdd(entry_addr, ir.getInt64(offset));
+  return ir.CreateLoad(ir.CreateIntToPtr(
+      field_addr, llvm::PointerType::get(ir.getInt64Ty(), 0)));
+}
+
+// Guard `access` with an inline check of the TLB. On a hit, the guest memory
+// is accessed directly through its host address, and on a miss, the original
+// call to the memory intrinsic is performed, which refills the TLB.
+static void InlineTLBLookup(const MemoryAccess &access) {
+  auto call = access.call;
+  llvm::IRBuilder<> ir(call);
+
+  auto addr = ir.CreateZExtOrTrunc(access.address, ir.getInt64Ty());
+  auto last_addr = ir.CreateAdd(addr, ir.getInt64(access.size - 1));
+  auto page_addr = ir.CreateAnd(last_addr, ir.getInt64(~(kPageSize - 1)));
+  auto index = ir.CreateAnd(ir.CreateLShr(addr, kTLBPageShift),
+                            ir.getInt64(kTLBIndexMask));
+
+  // `Memory` is at the beginning of the `AddressSpace`, and the TLB is at the
+  // beginning of `Memory`.
+  auto tlb_addr = ir.CreatePtrToInt(access.memory, ir.getInt64Ty());
+  auto entry_addr = ir.CreateAdd(
+      tlb_addr, ir.CreateMul(index, ir.getInt64(sizeof(TLBEntry))));
+  auto tag = LoadEntryField(
+      ir, entry_addr, access.is_write ? offsetof(TLBEntry, write_tag) :
+                                        offsetof(TLBEntry, read_tag));
+  auto is_hit = ir.CreateICmpEQ(tag, page_addr);
+
+  TerminatorInst *then_term = nullptr;
+  TerminatorInst *else_term = nullptr;
+  llvm::SplitBlockAndInsertIfThenElse(is_hit, call, &then_term, &else_term);
+
+  auto head_block = then_term->getParent()->getSinglePredecessor();
+  llvm::MDBuilder md(call->getContext());
+  head_block->getTerminator()->setMetadata(
+      llvm::LLVMContext::MD_prof,
+      md.createBranchWeights(kHitWeight, kMissWeight));
+
+  llvm::IRBuilder<> then_ir(then_term);
+  auto delta = LoadEntryField(
+      then_ir, entry_addr, offsetof(TLBEntry, host_delta));
+  auto val_type = access.is_write ? access.value->getType() : call->getType();
+  auto host_ptr = then_ir.CreateIntToPtr(
+      then_ir.CreateAdd(addr, delta), llvm::PointerType::get(val_type, 0));
+
+  // Guest addresses need not be aligned.
+  llvm::Value *hit_val = nullptr;
+  if (access.is_write) {
+    then_ir.CreateAlignedStore(access.value, host_ptr, 1);
+    hit_val = access.memory;
+  } else {
+    hit_val = then_ir.CreateAlignedLoad(host_ptr, 1);
+  }
+
+  call->moveBefore(else_term);
+
+  llvm::IRBuilder<> join_ir(&*else_term->getSuccessor(0)->begin());
+  auto phi = join_ir.CreatePHI(call->getType(), 2);
+  call->replaceAllUsesWith(phi);
+  phi->addIncoming(hit_val, then_term->getParent());
+  phi->addIncoming(call, else_term->getParent());
+}
+
+}  // namespace
+
+bool InlineTLBLookups(llvm::Function *func) {
+  std::vector<MemoryAccess> accesses;
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      MemoryAccess access = {};
+      if (GetMemoryAccess(&inst, &access) &&
+          access.size <= sizeof(uint64_t)) {
+        accesses.push_back(access);
+      }
+    }
+  }
+
+  for (const auto &access : accesses) {
+    InlineTLBLookup(access);
+  }
+
+  return !accesses.empty();
+}
+
+}  // namespace vmill
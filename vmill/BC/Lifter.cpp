@@ -17,6 +17,7 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
 #include <cstdint>
 #include <functional>
 #include <limits>
@@ -24,6 +25,7 @@
 #include <sstream>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -32,6 +34,7 @@
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Metadata.h>
 #include <llvm/IR/Module.h>
 
@@ -50,15 +53,75 @@
 #include "remill/OS/FileSystem.h"
 #include "remill/OS/OS.h"
 
+#include "vmill/Arch/Arch.h"
 #include "vmill/Arch/Decoder.h"
+#include "vmill/BC/Compiler.h"
 #include "vmill/BC/Lifter.h"
 #include "vmill/BC/Optimize.h"
 #include "vmill/BC/Trace.h"
 #include "vmill/BC/Util.h"
+#include "vmill/Program/AddressSpace.h"
+
+DECLARE_bool(inline_tlb);
+DECLARE_bool(lift_functions);
 
 DEFINE_string(instruction_callback, "",
               "Name of a function to call before each lifted instruction.");
 
+DEFINE_bool(call_stubs, true,
+            "Lift direct calls to traces outside of the current module as "
+            "calls through patchable stubs, rather than as calls to "
+            "`__remill_function_call`.");
+
+DEFINE_bool(flag_liveness, true,
+            "Remove stores to the arithmetic flags that are overwritten before "
+            "being read, either in the same trace or in successor traces "
+            "lifted in the same batch.");
+
+DEFINE_bool(abi_dead_flags, false,
+            "Assume that the arithmetic flags are dead across guest function "
+            "returns, as per the platform ABI.");
+
+DEFINE_bool(optimize_memory, true,
+            "Forward guest memory writes to later reads of the same address, "
+            "and remove redundant reads, within each lifted trace.");
+
+DEFINE_bool(coalesce_memory, true,
+            "Coalesce adjacent guest memory accesses that fall on the same "
+            "page into wider accesses. A fault in a coalesced access reports "
+            "the combined access size.");
+
+DEFINE_bool(bulk_string_ops, true,
+            "Execute repeated string instructions, e.g. `rep movsb`, as bulk "
+            "copies, fills, and compares of guest memory, rather than one "
+            "element at a time.");
+
+DEFINE_bool(promote_state, false,
+            "Promote the register state accessed by a lifted trace into "
+            "virtual registers, writing them back at the trace exits. Guest "
+            "vector registers are promoted whole, as vector values.");
+
+DEFINE_bool(promote_stack_slots, false,
+            "Cache the guest stack slots accessed relative to the entry stack "
+            "pointer of a lifted trace in host registers. Requires "
+            "--promote_state.");
+
+DEFINE_bool(vectorize, false,
+            "Enable the loop and SLP vectorizers, using the cost models of the "
+            "host, when optimizing lifted code. This turns the element-wise "
+            "operations of guest vector instructions back into host vector "
+            "operations. Implies --promote_state, so that guest vector "
+            "registers are kept in host vector registers.");
+
+DEFINE_bool(profile_blocks, false,
+            "Instrument lifted traces to count how many times each guest "
+            "basic block executes. The counts are added to the workspace's "
+            "block profile at the end of the run.");
+
+DEFINE_bool(use_profile, true,
+            "Use the workspace's block profile, if any, to guide the layout "
+            "of newly lifted traces.");
+
 namespace vmill {
 namespace {
 
@@ -78,17 +141,47 @@ class LifterImpl : public Lifter {
  public:
   virtual ~LifterImpl(void);
 
-  explicit LifterImpl(const std::shared_ptr<llvm::LLVMContext> &);
+  LifterImpl(const std::shared_ptr<llvm::LLVMContext> &,
+             const BlockProfile *profile_);
 
   std::unique_ptr<llvm::Module> Lift(
-        const DecodedTraceList &traces) final;
+        const DecodedTraceList &traces,
+        const std::unordered_set<uint64_t> &hooked_pcs_) final;
 
   llvm::Function *LiftTrace(const DecodedTrace &trace);
 
+  // Returns the function to call in order to transfer control to the trace
+  // at `pc`. This is either the lifted trace, if it is part of the module
+  // being lifted, or a patchable call stub.
+  llvm::Function *GetCallTarget(PC pc);
+
+  // Returns the function to call for the predicted target of the indirect
+  // jump or call at `pc`, if any.
+  llvm::Function *GetPredictedTarget(const DecodedTrace &trace, PC pc);
+
+  // Returns the number of times the block at `pc` executed in the profiled
+  // runs.
+  uint64_t ProfiledCount(PC pc) const;
+
+  // Add a profiling counter for the block at `block_pc` to `block`.
+  void AddBlockCounter(llvm::BasicBlock *block, PC block_pc);
+
+  // Add a bulk fast path for the repeated string instruction `op` to
+  // `block`. Returns the block into which the instruction itself should be
+  // lifted.
+  llvm::BasicBlock *LiftBulkStringOp(llvm::BasicBlock *block,
+                                     const StringOp &op,
+                                     llvm::IntegerType *addr_type);
 
   void LiftTracesIntoModule(const FuncToTraceMap &lifted_funcs,
                             llvm::Module *module);
 
+  // Entry PCs of the traces in the current batch that fold read-only data.
+  std::unordered_set<uint64_t> folded_trace_pcs;
+
+  // Entry PCs of the hooked functions.
+  std::unordered_set<uint64_t> hooked_pcs;
+
   // LLVM context that manages all modules.
   const std::shared_ptr<llvm::LLVMContext> context;
 
@@ -111,11 +204,24 @@ class LifterImpl : public Lifter {
   // Metadata ID for program counters.
   unsigned pc_metadata_id;
 
+  // Describes the host machine to the vectorizers. This is `nullptr` if
+  // vectorization is disabled.
+  const std::unique_ptr<Compiler> compiler;
+
+  // Block profile from prior runs. This is `nullptr` if there is no profile.
+  const BlockProfile * const profile;
+
+  // Profiling counters of the lifted functions. These are created inside of
+  // `semantics`, and moved into the target module along with the functions.
+  std::unordered_map<llvm::Function *,
+                     std::vector<llvm::GlobalVariable *>> block_counters;
+
  private:
   LifterImpl(void) = delete;
 };
 
-LifterImpl::LifterImpl(const std::shared_ptr<llvm::LLVMContext> &context_)
+LifterImpl::LifterImpl(const std::shared_ptr<llvm::LLVMContext> &context_,
+                       const BlockProfile *profile_)
     : Lifter(),
       context(context_),
       semantics(remill::LoadTargetSemantics(context.get())),
@@ -123,7 +229,9 @@ LifterImpl::LifterImpl(const std::shared_ptr<llvm::LLVMContext> &context_)
       intrinsics(semantics.get()),
       bb_func(remill::BasicBlockFunction(semantics.get())),
       lifter(remill::GetTargetArch(), &intrinsics),
-      pc_metadata_id(context->getMDKindID("PC")) {
+      pc_metadata_id(context->getMDKindID("PC")),
+      compiler(FLAGS_vectorize ? new Compiler(context) : nullptr),
+      profile(profile_ && !profile_->empty() ? profile_ : nullptr) {
 
   auto target_arch = remill::GetTargetArch();
 
@@ -139,7 +247,7 @@ LifterImpl::~LifterImpl(void) {}
 
 // Optimize the lifted function. This ends up being pretty slow because it
 // goes and optimizes everything else in the module (a.k.a. semantics module).
-static void RunO3(const FuncToTraceMap &funcs) {
+static void RunO3(const FuncToTraceMap &funcs, llvm::TargetMachine *machine) {
   if (funcs.empty()) {
     return;
   }
@@ -157,16 +265,146 @@ static void RunO3(const FuncToTraceMap &funcs) {
     }
   };
 
-  OptimizeModule(module, generator);
+  OptimizeModule(module, generator, machine);
+}
+
+// Run the clean-up passes over `funcs`, and the vectorizers too if `machine`
+// is non-null.
+static void CleanUp(const std::vector<llvm::Function *> &funcs,
+                    llvm::TargetMachine *machine=nullptr) {
+  if (funcs.empty()) {
+    return;
+  }
+
+  auto module = funcs.front()->getParent();
+  auto func_it = funcs.begin();
+  auto func_it_end = funcs.end();
+
+  CleanUpFunctions(module, [&func_it, func_it_end] (void) -> llvm::Function * {
+    if (func_it == func_it_end) {
+      return nullptr;
+    } else {
+      return *func_it++;
+    }
+  }, machine);
+}
+
+// Remove the flag stores that no trace in this batch will ever read. The
+// flag computations feeding those stores then die in the clean-up.
+static void RemoveDeadFlags(const FuncToTraceMap &funcs) {
+  TraceMap traces;
+  std::vector<llvm::Function *> batch_funcs;
+  batch_funcs.reserve(funcs.size());
+  for (const auto &entry : funcs) {
+    traces[static_cast<uint64_t>(entry.second->pc)] = entry.first;
+    batch_funcs.push_back(entry.first);
+  }
+
+  auto num_removed = RemoveDeadFlagStores(
+      traces, ArithmeticFlagOffsets(), FLAGS_abi_dead_flags);
+
+  if (num_removed) {
+    CleanUp(batch_funcs);
+  }
+}
+
+// Fold the reads of read-only guest memory into constants. Addresses only
+// become constant once the program counter has been propagated, so this runs
+// after the main optimizations.
+static void FoldReadOnlyData(const FuncToTraceMap &funcs) {
+  std::vector<llvm::Function *> changed_funcs;
+  for (const auto &entry : funcs) {
+    if (FoldReadOnlyMemoryReads(entry.first, entry.second->read_only_data)) {
+      changed_funcs.push_back(entry.first);
+    }
+  }
+
+  CleanUp(changed_funcs);
+}
+
+// Optimize the guest memory accesses of the lifted functions.
+static void OptimizeMemory(const FuncToTraceMap &funcs) {
+  std::vector<llvm::Function *> changed_funcs;
+  for (const auto &entry : funcs) {
+    if (OptimizeMemoryAccesses(entry.first, FLAGS_coalesce_memory)) {
+      changed_funcs.push_back(entry.first);
+    }
+  }
+
+  CleanUp(changed_funcs);
+}
+
+// Check the software TLB inline before each scalar guest memory access. This
+// runs last, as the expanded accesses are opaque to the memory optimizations.
+static void InlineTLB(const FuncToTraceMap &funcs) {
+  std::vector<llvm::Function *> changed_funcs;
+  for (const auto &entry : funcs) {
+    if (InlineTLBLookups(entry.first)) {
+      changed_funcs.push_back(entry.first);
+    }
+  }
+
+  CleanUp(changed_funcs);
+}
+
+// Access host-mapped guest memory directly, rather than through the runtime.
+static void MapMemoryToHost(const FuncToTraceMap &funcs) {
+  std::vector<llvm::Function *> changed_funcs;
+  for (const auto &entry : funcs) {
+    if (LowerToHostMappedAccesses(entry.first)) {
+      changed_funcs.push_back(entry.first);
+    }
+  }
+
+  CleanUp(changed_funcs);
+}
+
+// Promote the state structure accesses of the lifted functions into virtual
+// registers, then clean up the leftover loads and stores. Guest vector
+// registers become vector values, which is when the vectorizers (enabled if
+// `machine` is non-null) can best turn their element-wise code back into
+// host vector operations.
+static void PromoteState(const FuncToTraceMap &funcs,
+                         llvm::TargetMachine *machine) {
+  const auto vector_regs = VectorRegisterSlots();
+  std::vector<llvm::Function *> promoted_funcs;
+  for (const auto &entry : funcs) {
+    if (PromoteStateToRegisters(entry.first, vector_regs)) {
+      promoted_funcs.push_back(entry.first);
+    }
+  }
+
+  CleanUp(promoted_funcs, machine);
+}
+
+// Promote the guest stack slots of the lifted functions into virtual
+// registers. This depends on the stack pointer having been promoted.
+static void PromoteStack(const FuncToTraceMap &funcs) {
+  const auto sp_offset = StackPointerOffset();
+  std::vector<llvm::Function *> promoted_funcs;
+  for (const auto &entry : funcs) {
+    if (PromoteStackSlots(entry.first, sp_offset)) {
+      promoted_funcs.push_back(entry.first);
+    }
+  }
+
+  CleanUp(promoted_funcs);
 }
 
 std::unique_ptr<llvm::Module> LifterImpl::Lift(
-    const DecodedTraceList &traces) {
+    const DecodedTraceList &traces,
+    const std::unordered_set<uint64_t> &hooked_pcs_) {
 
   std::unique_ptr<llvm::Module> module;
 
   // First off, declare the traces to be lifted.
+  hooked_pcs = hooked_pcs_;
+  folded_trace_pcs.clear();
   for (const auto &trace : traces) {
+    if (!trace.read_only_data.empty()) {
+      folded_trace_pcs.insert(static_cast<uint64_t>(trace.pc));
+    }
+
     if (!module) {
       std::stringstream ss;
       ss << std::hex << static_cast<uint64_t>(trace.pc) << "_at_"
@@ -192,6 +430,230 @@ std::unique_ptr<llvm::Module> LifterImpl::Lift(
   return module;
 }
 
+llvm::Function *LifterImpl::GetCallTarget(PC pc) {
+  auto func = semantics->getFunction(LiftedFunctionName(pc));
+
+  // Traces that fold read-only data are only valid in some address spaces,
+  // so they are always entered through the dispatcher, which checks the
+  // code version. Hooked functions are entered through their hooks, which
+  // the call stubs and the dispatcher know about.
+  const auto pc_uint = static_cast<uint64_t>(pc);
+  if (func && (folded_trace_pcs.count(pc_uint) || hooked_pcs.count(pc_uint))) {
+    func = nullptr;
+  } else if (func) {
+    return func;
+  }
+
+  if (!FLAGS_call_stubs) {
+    return nullptr;
+  }
+
+  // The target trace lives in some other module, or has not yet been lifted.
+  // The code cache binds the stub to the target once it is live.
+  const auto stub_name = CallStubName(pc);
+  func = semantics->getFunction(stub_name);
+  if (!func) {
+    func = remill::DeclareLiftedFunction(semantics.get(), stub_name);
+  }
+  return func;
+}
+
+llvm::Function *LifterImpl::GetPredictedTarget(const DecodedTrace &trace,
+                                               PC pc) {
+  auto target_it = trace.predicted_targets.find(pc);
+  if (target_it == trace.predicted_targets.end()) {
+    return nullptr;
+  }
+  return GetCallTarget(target_it->second);
+}
+
+uint64_t LifterImpl::ProfiledCount(PC pc) const {
+  auto count_it = profile->find(static_cast<uint64_t>(pc));
+  if (count_it == profile->end()) {
+    return 0;
+  }
+  return count_it->second;
+}
+
+// Each counter is a `BlockCount` in the `.vprofile` section. The increment is
+// volatile so that it survives optimization; lost updates from racing threads
+// are fine.
+void LifterImpl::AddBlockCounter(llvm::BasicBlock *block, PC block_pc) {
+  auto int64_type = llvm::Type::getInt64Ty(*context);
+  std::vector<llvm::Type *> types(2, int64_type);
+  auto counter_type = llvm::StructType::get(*context, types, true);
+
+  std::vector<llvm::Constant *> values(2);
+  values[0] = llvm::ConstantInt::get(
+      int64_type, static_cast<uint64_t>(block_pc));
+  values[1] = llvm::ConstantInt::get(int64_type, 0);
+
+  // Things in the used list must be named.
+  std::stringstream ss;
+  ss << "count_" << std::hex << static_cast<uint64_t>(block_pc);
+
+  auto counter = new llvm::GlobalVariable(
+      *semantics, counter_type, false, llvm::GlobalValue::PrivateLinkage,
+      llvm::ConstantStruct::get(counter_type, values), ss.str());
+#ifdef __APPLE__
+  counter->setSection(".__DATA,.vprofile");
+#else
+  counter->setSection(".vprofile");
+#endif
+  counter->setAlignment(8);
+  block_counters[block->getParent()].push_back(counter);
+
+  llvm::IRBuilder<> ir(block);
+  auto count_ptr = ir.CreateConstGEP1_64(
+      ir.CreateBitCast(counter, llvm::PointerType::get(int64_type, 0)), 1);
+  auto count = ir.CreateLoad(count_ptr, true /* isVolatile */);
+  ir.CreateStore(ir.CreateAdd(count, llvm::ConstantInt::get(int64_type, 1)),
+                 count_ptr, true /* isVolatile */);
+}
+
+// Returns the runtime function that implements the bulk string operation
+// `kind`. See `__vmill_memory_copy` and friends.
+static llvm::Function *GetStringOpFunction(llvm::Module *module,
+                                           StringOpKind kind,
+                                           llvm::Type *memory_type) {
+  auto &context = module->getContext();
+  auto int32_type = llvm::Type::getInt32Ty(context);
+  auto int64_type = llvm::Type::getInt64Ty(context);
+
+  const char *name = nullptr;
+  std::vector<llvm::Type *> param_types(5, int64_type);
+  param_types[0] = memory_type;
+  param_types.push_back(int32_type);  // `backward`.
+
+  switch (kind) {
+    case kStringOpCopy:
+      name = "__vmill_memory_copy";
+      break;
+    case kStringOpFill:
+      name = "__vmill_memory_fill";
+      break;
+    case kStringOpCompareWhileEqual:
+    case kStringOpCompareWhileNotEqual:
+      name = "__vmill_memory_compare";
+      param_types.push_back(int32_type);  // `while_equal`.
+      break;
+  }
+
+  param_types.push_back(llvm::PointerType::get(int64_type, 0));
+
+  auto func = module->getFunction(name);
+  if (!func) {
+    func = llvm::Function::Create(
+        llvm::FunctionType::get(memory_type, param_types, false),
+        llvm::GlobalValue::ExternalLinkage, name, module);
+  }
+  return func;
+}
+
+// The fast path processes as many elements as it can without faulting, and
+// updates the count and address registers to match. The instruction's own
+// semantics then finish the job, which makes faults exact. Compares always
+// leave the last element to the instruction, so that it computes the flags.
+llvm::BasicBlock *LifterImpl::LiftBulkStringOp(llvm::BasicBlock *block,
+                                               const StringOp &op,
+                                               llvm::IntegerType *addr_type) {
+  auto func = block->getParent();
+  auto bulk_block = llvm::BasicBlock::Create(*context, "", func);
+  auto inst_block = llvm::BasicBlock::Create(*context, "", func);
+
+  auto &entry_block = func->getEntryBlock();
+  llvm::IRBuilder<> entry_ir(&entry_block, entry_block.getFirstInsertionPt());
+  auto num_done_ptr = entry_ir.CreateAlloca(entry_ir.getInt64Ty());
+
+  auto memory_ptr_ref = remill::LoadMemoryPointerRef(block);
+  auto state_ptr = remill::LoadStatePointer(block);
+
+  llvm::IRBuilder<> ir(block);
+  auto byte_ptr = ir.CreateBitCast(state_ptr, ir.getInt8PtrTy());
+  auto get_reg_ptr = [&ir, byte_ptr] (uint64_t offset, llvm::Type *type) {
+    return ir.CreateBitCast(ir.CreateConstGEP1_64(byte_ptr, offset),
+                            llvm::PointerType::get(type, 0));
+  };
+
+  const auto is_compare = kStringOpCompareWhileEqual == op.kind ||
+                          kStringOpCompareWhileNotEqual == op.kind;
+  auto one = llvm::ConstantInt::get(addr_type, 1);
+  auto count_ptr = get_reg_ptr(op.count_offset, addr_type);
+  auto count = ir.CreateLoad(count_ptr);
+  ir.CreateCondBr(ir.CreateICmpUGT(count, one), bulk_block, inst_block);
+
+  ir.SetInsertPoint(bulk_block);
+  auto int64_type = ir.getInt64Ty();
+  auto is_backward = ir.CreateICmpNE(
+      ir.CreateLoad(get_reg_ptr(op.direction_offset, ir.getInt8Ty())),
+      ir.getInt8(0));
+
+  auto dst_ptr = get_reg_ptr(op.dest_offset, addr_type);
+  auto dst = ir.CreateLoad(dst_ptr);
+  llvm::Value *src_ptr = nullptr;
+  llvm::Value *src = nullptr;
+  auto limit = is_compare ? ir.CreateSub(count, one) : count;
+
+  std::vector<llvm::Value *> args;
+  args.push_back(ir.CreateLoad(memory_ptr_ref));
+  args.push_back(ir.CreateZExt(dst, int64_type));
+  if (kStringOpFill == op.kind) {
+    args.push_back(ir.CreateLoad(get_reg_ptr(op.value_offset, int64_type)));
+  } else {
+    src_ptr = get_reg_ptr(op.source_offset, addr_type);
+    src = ir.CreateLoad(src_ptr);
+    args.push_back(ir.CreateZExt(src, int64_type));
+  }
+  args.push_back(ir.CreateZExt(limit, int64_type));
+  args.push_back(ir.getInt64(op.element_size));
+  args.push_back(ir.CreateZExt(is_backward, ir.getInt32Ty()));
+  if (is_compare) {
+    args.push_back(ir.getInt32(kStringOpCompareWhileEqual == op.kind));
+  }
+  args.push_back(num_done_ptr);
+
+  auto op_func = GetStringOpFunction(
+      semantics.get(), op.kind, args[0]->getType());
+  ir.CreateStore(ir.CreateCall(op_func, args), memory_ptr_ref);
+
+  auto num_done = ir.CreateTrunc(ir.CreateLoad(num_done_ptr), addr_type);
+  auto delta = ir.CreateMul(
+      num_done, llvm::ConstantInt::get(addr_type, op.element_size));
+  ir.CreateStore(ir.CreateSub(count, num_done), count_ptr);
+  ir.CreateStore(ir.CreateSelect(is_backward, ir.CreateSub(dst, delta),
+                                 ir.CreateAdd(dst, delta)),
+                 dst_ptr);
+  if (src) {
+    ir.CreateStore(ir.CreateSelect(is_backward, ir.CreateSub(src, delta),
+                                   ir.CreateAdd(src, delta)),
+                   src_ptr);
+  }
+  ir.CreateBr(inst_block);
+  return inst_block;
+}
+
+// Returns branch weight metadata for successors whose profiled execution
+// counts are `counts`. The counts are scaled down to fit into the 32-bit
+// weights, and never-executed successors keep a small non-zero weight.
+static llvm::MDNode *CreateBranchWeights(llvm::LLVMContext &context,
+                                         const std::vector<uint64_t> &counts) {
+  uint64_t max_count = 0;
+  for (auto count : counts) {
+    max_count = std::max(max_count, count);
+  }
+
+  const uint64_t scale = max_count / std::numeric_limits<uint32_t>::max() + 1;
+  std::vector<uint32_t> weights;
+  weights.reserve(counts.size());
+  for (auto count : counts) {
+    weights.push_back(static_cast<uint32_t>(
+        std::max<uint64_t>(1, count / scale)));
+  }
+
+  llvm::MDBuilder md(context);
+  return md.createBranchWeights(weights);
+}
+
 // Modify the lifting of function calls so that execution returns to the code
 // following the call to the lifted function, or to `__remill_function_call`,
 // but then we compare the current PC to what it should be had we returned
@@ -220,6 +682,27 @@ static void LiftPostFunctionCall(llvm::BasicBlock *call_block,
   delete ret_inst;
 }
 
+// Split control flow at the end of `block` based on whether or not the
+// computed program counter matches `expected_pc`. Returns the block to which
+// control goes on a match and on a mismatch, respectively.
+static std::pair<llvm::BasicBlock *, llvm::BasicBlock *>
+AddProgramCounterGuard(llvm::BasicBlock *block, llvm::IntegerType *pc_type,
+                       PC expected_pc) {
+  auto func = block->getParent();
+  auto &context = func->getContext();
+  auto match_block = llvm::BasicBlock::Create(context, "", func);
+  auto mismatch_block = llvm::BasicBlock::Create(context, "", func);
+
+  auto expected_pc_val = llvm::ConstantInt::get(
+      pc_type, static_cast<uint64_t>(expected_pc));
+  auto pc = remill::LoadProgramCounter(block);
+
+  llvm::IRBuilder<> ir(block);
+  ir.CreateCondBr(ir.CreateICmpEQ(pc, expected_pc_val),
+                  match_block, mismatch_block);
+  return {match_block, mismatch_block};
+}
+
 llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
 
   const auto &insts = trace.instructions;
@@ -236,6 +719,12 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
 
   remill::CloneBlockFunctionInto(func);
 
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(3, 7)
+  if (profile) {
+    func->setEntryCount(ProfiledCount(trace.pc));
+  }
+#endif
+
   // Hard-code the trace address into the bitcode.
   auto func_entry_block = &(func->front());
   auto arch = remill::GetTargetArch();
@@ -245,21 +734,42 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
   // Function that will create basic blocks as needed.
   std::unordered_map<uint64_t, llvm::BasicBlock *> blocks;
   auto GetOrCreateBlock = \
-      [func, context_ptr, pc_type, pc_ptr, &blocks] (PC block_pc) {
+      [=, &blocks] (PC block_pc) {
         auto &block = blocks[static_cast<uint64_t>(block_pc)];
         if (!block) {
           block = llvm::BasicBlock::Create(*context_ptr, "", func);
           (void) new llvm::StoreInst(
               llvm::ConstantInt::get(pc_type, static_cast<uint64_t>(block_pc)),
               pc_ptr, block);
+          if (FLAGS_profile_blocks) {
+            AddBlockCounter(block, block_pc);
+          }
         }
         return block;
       };
 
   // Create a branch from the entrypoint of the lifted function to the basic
-  // block representing the first decoded instruction.
+  // block representing the first decoded instruction. Functions with other
+  // entry points dispatch on the program counter argument.
   auto entry_block = GetOrCreateBlock(trace.pc);
-  llvm::BranchInst::Create(entry_block, func_entry_block);
+  if (trace.entry_pcs.empty()) {
+    llvm::BranchInst::Create(entry_block, func_entry_block);
+  } else {
+    auto dispatch = llvm::SwitchInst::Create(
+        remill::NthArgument(func, remill::kPCArgNum), entry_block,
+        static_cast<unsigned>(trace.entry_pcs.size()), func_entry_block);
+    for (auto entry_pc : trace.entry_pcs) {
+      dispatch->addCase(
+          llvm::ConstantInt::get(pc_type, static_cast<uint64_t>(entry_pc)),
+          GetOrCreateBlock(entry_pc));
+    }
+  }
+
+  // Direct callees within the batch are lifted as separate functions. When
+  // lifting whole functions, they may be inlined into their callers.
+  if (FLAGS_lift_functions) {
+    func->removeFnAttr(llvm::Attribute::NoInline);
+  }
 
   // Guarantee that a basic block exists, even if the first instruction
   // failed to decode.
@@ -294,6 +804,11 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
       ret_pc = llvm::ConstantInt::get(pc_type, inst.next_pc);
     }
 
+    StringOp string_op;
+    if (FLAGS_bulk_string_ops && DecodeStringOp(inst.bytes, &string_op)) {
+      block = LiftBulkStringOp(block, string_op, pc_type);
+    }
+
     if (remill::kLiftedInstruction != lifter.LiftIntoBlock(inst, block)) {
       remill::AddTerminatingTailCall(block, intrinsics.error);
       continue;
@@ -319,17 +834,53 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
             block);
         break;
 
-      case remill::Instruction::kCategoryIndirectJump:
-        remill::AddTerminatingTailCall(block, intrinsics.jump);
+      case remill::Instruction::kCategoryIndirectJump: {
+        auto table_it = trace.jump_tables.find(entry.first);
+        if (table_it == trace.jump_tables.end()) {
+          auto target_func = GetPredictedTarget(trace, entry.first);
+          if (target_func) {
+            auto blocks = AddProgramCounterGuard(
+                block, pc_type, trace.predicted_targets.at(entry.first));
+            remill::AddTerminatingTailCall(blocks.first, target_func);
+            remill::AddTerminatingTailCall(blocks.second, intrinsics.jump);
+          } else {
+            remill::AddTerminatingTailCall(block, intrinsics.jump);
+          }
+          break;
+        }
+
+        // Dispatch directly to the recovered targets of a jump table. The
+        // switch is over the computed program counter, and not over the
+        // table index, so if the table is changed out from under us then
+        // we safely fall back to the generic indirect jump.
+        const auto &targets = table_it->second.targets;
+        auto default_block = llvm::BasicBlock::Create(*context_ptr, "", func);
+        remill::AddTerminatingTailCall(default_block, intrinsics.jump);
+
+        auto dispatch = llvm::SwitchInst::Create(
+            remill::LoadProgramCounter(block), default_block,
+            static_cast<unsigned>(targets.size()), block);
+
+        std::vector<uint64_t> counts(1, 0);  // Default case.
+        for (auto target_pc : targets) {
+          dispatch->addCase(
+              llvm::ConstantInt::get(pc_type, static_cast<uint64_t>(target_pc)),
+              GetOrCreateBlock(target_pc));
+          counts.push_back(profile ? ProfiledCount(target_pc) : 0);
+        }
+
+        if (profile) {
+          dispatch->setMetadata(llvm::LLVMContext::MD_prof,
+                                CreateBranchWeights(*context_ptr, counts));
+        }
         break;
+      }
 
       case remill::Instruction::kCategoryDirectFunctionCall:
         if (inst.branch_taken_pc != inst.next_pc) {
 
-          const auto target_func_name = LiftedFunctionName(
+          auto target_func = GetCallTarget(
               static_cast<PC>(inst.branch_taken_pc));
-
-          auto target_func = semantics->getFunction(target_func_name);
           if (!target_func) {
             remill::AddTerminatingTailCall(block, intrinsics.function_call);
           } else {
@@ -341,34 +892,76 @@ llvm::Function *LifterImpl::LiftTrace(const DecodedTrace &trace) {
         }
         break;
 
-      case remill::Instruction::kCategoryIndirectFunctionCall:
-        remill::AddTerminatingTailCall(block, intrinsics.function_call);
-        LiftPostFunctionCall(
-            block, GetOrCreateBlock(static_cast<PC>(inst.next_pc)), ret_pc);
+      case remill::Instruction::kCategoryIndirectFunctionCall: {
+        auto fall_through_block = GetOrCreateBlock(
+            static_cast<PC>(inst.next_pc));
+        auto target_func = GetPredictedTarget(trace, entry.first);
+        if (target_func) {
+          auto blocks = AddProgramCounterGuard(
+              block, pc_type, trace.predicted_targets.at(entry.first));
+          remill::AddTerminatingTailCall(blocks.first, target_func);
+          LiftPostFunctionCall(blocks.first, fall_through_block, ret_pc);
+          remill::AddTerminatingTailCall(blocks.second,
+                                         intrinsics.function_call);
+          LiftPostFunctionCall(blocks.second, fall_through_block, ret_pc);
+        } else {
+          remill::AddTerminatingTailCall(block, intrinsics.function_call);
+          LiftPostFunctionCall(block, fall_through_block, ret_pc);
+        }
         break;
+      }
 
       case remill::Instruction::kCategoryFunctionReturn:
         remill::AddTerminatingTailCall(block, intrinsics.function_return);
         break;
 
       case remill::Instruction::kCategoryConditionalBranch:
-      case remill::Instruction::kCategoryConditionalAsyncHyperCall:
-        llvm::BranchInst::Create(
-            GetOrCreateBlock(static_cast<PC>(inst.branch_taken_pc)),
-            GetOrCreateBlock(static_cast<PC>(inst.branch_not_taken_pc)),
+      case remill::Instruction::kCategoryConditionalAsyncHyperCall: {
+        const auto taken_pc = static_cast<PC>(inst.branch_taken_pc);
+        const auto not_taken_pc = static_cast<PC>(inst.branch_not_taken_pc);
+        auto branch = llvm::BranchInst::Create(
+            GetOrCreateBlock(taken_pc), GetOrCreateBlock(not_taken_pc),
             remill::LoadBranchTaken(block), block);
+
+        // The successor block counts approximate the edge counts. Cold
+        // successors are laid out away from the hot path.
+        if (profile) {
+          std::vector<uint64_t> counts(2);
+          counts[0] = ProfiledCount(taken_pc);
+          counts[1] = ProfiledCount(not_taken_pc);
+          branch->setMetadata(llvm::LLVMContext::MD_prof,
+                              CreateBranchWeights(*context_ptr, counts));
+        }
         break;
+      }
 
       // Lift async hyper calls in such a way that the call graph structure
       // is maintained. Specifically, if we imagine these hyper calls as being
       // system call instructions, then most likely they are wrapped inside of
       // another function, and we eventually want to reach the function return
       // instruction, so that the lifted caller can continue on.
-      case remill::Instruction::kCategoryAsyncHyperCall:
+      //
+      // When lifting whole functions, execution carries on within the lifted
+      // function if the hyper call returns to the next instruction.
+      case remill::Instruction::kCategoryAsyncHyperCall: {
         remill::AddTerminatingTailCall(block, intrinsics.async_hyper_call);
-        block->getTerminator()->eraseFromParent();
-        remill::AddTerminatingTailCall(block, intrinsics.jump);
+        auto ret = llvm::cast<llvm::ReturnInst>(block->getTerminator());
+        auto memory_ptr = ret->getReturnValue();
+        ret->eraseFromParent();
+        if (!FLAGS_lift_functions) {
+          remill::AddTerminatingTailCall(block, intrinsics.jump);
+          break;
+        }
+
+        (void) new llvm::StoreInst(
+            memory_ptr, remill::LoadMemoryPointerRef(block), block);
+        auto blocks = AddProgramCounterGuard(
+            block, pc_type, static_cast<PC>(inst.next_pc));
+        llvm::BranchInst::Create(
+            GetOrCreateBlock(static_cast<PC>(inst.next_pc)), blocks.first);
+        remill::AddTerminatingTailCall(blocks.second, intrinsics.jump);
         break;
+      }
     }
   }
 
@@ -396,18 +989,76 @@ static llvm::MDNode *CreatePCAnnotation(llvm::Constant *pc) {
 
 void LifterImpl::LiftTracesIntoModule(const FuncToTraceMap &lifted_funcs,
                                       llvm::Module *module) {
-  RunO3(lifted_funcs);  // Optimize the lifted functions.
+  // Optimize the lifted functions.
+  auto machine = compiler ? compiler->HostMachine() : nullptr;
+  RunO3(lifted_funcs, machine);
+
+  FoldReadOnlyData(lifted_funcs);
+
+  if (FLAGS_flag_liveness) {
+    RemoveDeadFlags(lifted_funcs);
+  }
+
+  if (FLAGS_promote_state || FLAGS_vectorize) {
+    PromoteState(lifted_funcs, machine);
+
+    if (FLAGS_promote_stack_slots) {
+      PromoteStack(lifted_funcs);
+    }
+  }
+
+  if (FLAGS_optimize_memory) {
+    OptimizeMemory(lifted_funcs);
+  }
+
+  if (AddressSpace::HostMappingEnabled()) {
+    MapMemoryToHost(lifted_funcs);
+  } else if (FLAGS_inline_tlb) {
+    InlineTLB(lifted_funcs);
+  }
 
   auto context_ptr = context.get();
   auto int8_ptr_type  = llvm::Type::getInt8PtrTy(module->getContext());
 
   std::vector<llvm::Constant *> used_list;
 
+  // Functions are emitted in module order, so order them from hottest to
+  // coldest, so that hot traces end up near each other in the code cache.
+  using OrderedFunc = std::pair<uint64_t, const DecodedTrace *>;
+  std::vector<std::pair<OrderedFunc, llvm::Function *>> ordered_funcs;
+  ordered_funcs.reserve(lifted_funcs.size());
+  for (const auto &entry : lifted_funcs) {
+    const auto count = profile ? ProfiledCount(entry.second->pc) : 0;
+    ordered_funcs.push_back({{count, entry.second}, entry.first});
+  }
+
+  std::sort(ordered_funcs.begin(), ordered_funcs.end(),
+            [] (const std::pair<OrderedFunc, llvm::Function *> &a,
+                const std::pair<OrderedFunc, llvm::Function *> &b) {
+              if (a.first.first != b.first.first) {
+                return a.first.first > b.first.first;
+              }
+              return a.first.second->pc < b.first.second->pc;
+            });
+
   // Move the optimized functions into the target module, and add in code
   // cache index entries.
-  for (const auto &entry : lifted_funcs) {
-    auto func = entry.first;
-    const auto &trace = *(entry.second);
+  for (const auto &entry : ordered_funcs) {
+    auto func = entry.second;
+    const auto &trace = *(entry.first.second);
+
+    // Bring along the function's profiling counters.
+    auto counters_it = block_counters.find(func);
+    if (counters_it != block_counters.end()) {
+      for (auto counter : counters_it->second) {
+        counter->removeFromParent();
+        module->getGlobalList().push_back(counter);
+        used_list.push_back(
+            llvm::ConstantExpr::getBitCast(counter, int8_ptr_type));
+      }
+      block_counters.erase(counters_it);
+    }
+
     remill::MoveFunctionIntoModule(func, module);
 
     std::vector<llvm::Type *> types(2);
@@ -482,8 +1133,9 @@ void LifterImpl::LiftTracesIntoModule(const FuncToTraceMap &lifted_funcs,
 }  // namespace
 
 std::unique_ptr<Lifter> Lifter::Create(
-    const std::shared_ptr<llvm::LLVMContext> &context) {
-  return std::unique_ptr<Lifter>(new LifterImpl(context));
+    const std::shared_ptr<llvm::LLVMContext> &context,
+    const BlockProfile *profile) {
+  return std::unique_ptr<Lifter>(new LifterImpl(context, profile));
 }
 
 Lifter::Lifter(void) {}
@@ -19,8 +19,11 @@
 
 #include <cstdint>
 #include <memory>
+#include <unordered_set>
 #include <vector>
 
+#include "vmill/BC/Trace.h"
+
 namespace llvm {
 class LLVMContext;
 class Module;
@@ -44,13 +47,18 @@ class Lifter {
  public:
   virtual ~Lifter(void);
 
+  // If `profile` is non-null then it guides the layout of the lifted code.
   static std::unique_ptr<Lifter> Create(
-      const std::shared_ptr<llvm::LLVMContext> &context);
+      const std::shared_ptr<llvm::LLVMContext> &context,
+      const BlockProfile *profile=nullptr);
 
   // Lift a list of decoded traces into a new LLVM bitcode module, and
-  // return the resulting module.
+  // return the resulting module. Calls to the hooked functions whose entry
+  // PCs are in `hooked_pcs` always go through a call stub or the dispatcher,
+  // so that their hooks run.
   virtual std::unique_ptr<llvm::Module> Lift(
-      const DecodedTraceList &traces) = 0;
+      const DecodedTraceList &traces,
+      const std::unordered_set<uint64_t> &hooked_pcs) = 0;
 
  protected:
   Lifter(void);
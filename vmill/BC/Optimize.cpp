@@ -14,29 +14,60 @@
  * limitations under the License.
  */
 
+#include <limits>
+
+#include <llvm/Analysis/TargetTransformInfo.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
 
 #include <llvm/Transforms/IPO.h>
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(7, 0)
+# include <llvm/Transforms/InstCombine/InstCombine.h>
+#endif
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/Utils/Local.h>
 #include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/ValueMapper.h>
+#include <llvm/Transforms/Vectorize.h>
 
 #include "remill/BC/Compat/TargetLibraryInfo.h"
+#include "remill/BC/Version.h"
 
 #include "vmill/BC/Optimize.h"
 
 namespace vmill {
 
+namespace {
+
+// Without the host's cost models, the vectorizers think that there are no
+// vector registers, and so do nothing.
+static void AddHostCostModels(llvm::legacy::PassManagerBase &manager,
+                              llvm::TargetMachine *machine) {
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(3, 7)
+  manager.add(llvm::createTargetTransformInfoWrapperPass(
+      machine->getTargetIRAnalysis()));
+#else
+  machine->addAnalysisPasses(manager);
+#endif
+}
+
+}  // namespace
+
 void OptimizeModule(llvm::Module *module,
-                    std::function<llvm::Function *(void)> generator) {
+                    std::function<llvm::Function *(void)> generator,
+                    llvm::TargetMachine *machine) {
   llvm::legacy::FunctionPassManager func_manager(module);
   llvm::legacy::PassManager module_manager;
 
+  if (machine) {
+    AddHostCostModels(func_manager, machine);
+    AddHostCostModels(module_manager, machine);
+  }
+
   auto TLI = new llvm::TargetLibraryInfoImpl(
       llvm::Triple(module->getTargetTriple()));
 
@@ -51,8 +82,8 @@ void OptimizeModule(llvm::Module *module,
   builder.DisableUnrollLoops = false;  // Unroll loops!
   builder.DisableUnitAtATime = false;
   builder.RerollLoops = false;
-  builder.SLPVectorize = false;
-  builder.LoopVectorize = false;
+  builder.SLPVectorize = nullptr != machine;
+  builder.LoopVectorize = nullptr != machine;
   IF_LLVM_GTE_36(builder.VerifyInput = true;)
   IF_LLVM_GTE_36(builder.VerifyOutput = true;)
 
@@ -67,4 +98,32 @@ void OptimizeModule(llvm::Module *module,
   module_manager.run(*module);
 }
 
+void CleanUpFunctions(llvm::Module *module,
+                      std::function<llvm::Function *(void)> generator,
+                      llvm::TargetMachine *machine) {
+  llvm::legacy::FunctionPassManager func_manager(module);
+  func_manager.add(llvm::createSROAPass());
+  func_manager.add(llvm::createEarlyCSEPass());
+  func_manager.add(llvm::createInstructionCombiningPass());
+
+  // Promoted vector registers are only visible as vector values once SROA
+  // has turned their allocas into SSA values, so vectorize after that.
+  if (machine) {
+    AddHostCostModels(func_manager, machine);
+    func_manager.add(llvm::createLoopVectorizePass());
+    func_manager.add(llvm::createSLPVectorizerPass());
+    func_manager.add(llvm::createInstructionCombiningPass());
+  }
+  func_manager.add(llvm::createDeadStoreEliminationPass());
+  func_manager.add(llvm::createCFGSimplificationPass());
+  func_manager.add(llvm::createAggressiveDCEPass());
+
+  func_manager.doInitialization();
+  llvm::Function *func = nullptr;
+  while (nullptr != (func = generator())) {
+    func_manager.run(*func);
+  }
+  func_manager.doFinalization();
+}
+
 }  // namespace vmill
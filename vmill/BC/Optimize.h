@@ -17,17 +17,84 @@
 #ifndef VMILL_BC_OPTIMIZE_H_
 #define VMILL_BC_OPTIMIZE_H_
 
+#include <cstdint>
 #include <functional>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "vmill/BC/Trace.h"
 
 namespace llvm {
+class Function;
 class Module;
+class TargetMachine;
 }  // namespace llvm
 
 namespace vmill {
 
+// Optimize the functions produced by `generator`. If `machine` is non-null
+// then the loop and SLP vectorizers are enabled, using the cost models of
+// `machine`.
 void OptimizeModule(
     llvm::Module *module,
-    std::function<llvm::Function *(void)> generator);
+    std::function<llvm::Function *(void)> generator,
+    llvm::TargetMachine *machine=nullptr);
+
+// Run a light-weight set of scalar clean-up passes over the functions
+// produced by `generator`. If `machine` is non-null then the loop and SLP
+// vectorizers also run, using the cost models of `machine`.
+void CleanUpFunctions(
+    llvm::Module *module,
+    std::function<llvm::Function *(void)> generator,
+    llvm::TargetMachine *machine=nullptr);
+
+// Promote the `State` structure accesses of a lifted trace into virtual
+// registers, writing them back before calls and returns. Each of the vector
+// registers in `vector_regs` (pairs of `State` offsets and sizes) is promoted
+// whole into one vector value, whose lanes are the register's elements.
+// Returns `true` if anything was promoted.
+bool PromoteStateToRegisters(
+    llvm::Function *func,
+    const std::vector<std::pair<uint64_t, uint64_t>> &vector_regs);
+
+// Promote the guest stack slots accessed by a lifted trace relative to its
+// entry stack pointer (located at `sp_offset` within the `State` structure)
+// into allocas, writing dirty slots back at the trace exits, before calls
+// into the runtime, and before possibly aliasing accesses. This expects
+// `PromoteStateToRegisters` to have already run. Returns `true` if anything
+// was promoted.
+bool PromoteStackSlots(llvm::Function *func, uint64_t sp_offset);
+
+// Forward guest memory writes to later reads, remove redundant reads, and,
+// if `coalesce` is true, merge adjacent same-page accesses into wider ones.
+// Returns `true` if `func` was changed.
+bool OptimizeMemoryAccesses(llvm::Function *func, bool coalesce);
+
+// Guard the scalar guest memory accesses of `func` with inline checks of the
+// address space's software TLB, so that only misses call into the runtime.
+// Returns `true` if `func` was changed.
+bool InlineTLBLookups(llvm::Function *func);
+
+// Replace the scalar guest memory accesses of `func` by direct accesses to
+// the host mapping of guest memory. Returns `true` if `func` was changed.
+bool LowerToHostMappedAccesses(llvm::Function *func);
+
+// Replace the reads of guest memory at constant addresses in `data` with the
+// read-only values recorded there. Returns `true` if `func` was changed.
+bool FoldReadOnlyMemoryReads(llvm::Function *func,
+                             const ReadOnlyDataMap &data);
+
+// Maps the entry PCs of a batch of lifted traces to their functions.
+using TraceMap = std::map<uint64_t, llvm::Function *>;
+
+// Remove stores to the arithmetic flags (located at `flag_offsets` within the
+// `State` structure) whose values are never read by `traces`, or by any of
+// the traces in `traces` that they directly call. Returns the number of
+// removed stores.
+unsigned RemoveDeadFlagStores(const TraceMap &traces,
+                              const std::vector<uint64_t> &flag_offsets,
+                              bool abi_dead_flags);
 
 }  // namespace vmill
 
@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+#include "remill/BC/Version.h"
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
+
+namespace vmill {
+namespace {
+
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(8, 0)
+using TerminatorInst = llvm::Instruction;
+#else
+using TerminatorInst = llvm::TerminatorInst;
+#endif
+
+// Guest memory permissions are tracked with page granularity, so two accesses
+// to the same page either both fault or both succeed.
+static constexpr uint64_t kPageSize = 4096;
+
+// Largest access produced by coalescing narrower accesses, i.e. the size of
+// an AVX vector.
+static constexpr unsigned kMaxCoalescedSize = 32;
+
+// Returns `true` if two accesses might touch overlapping bytes.
+static bool MayAlias(const MemoryAccess &a, const MemoryAccess &b) {
+  const auto a_addr = DecomposeGuestAddress(a.address);
+  const auto b_addr = DecomposeGuestAddress(b.address);
+  if (a_addr.base != b_addr.base) {
+    return true;
+  }
+  return (a_addr.offset < (b_addr.offset + static_cast<int64_t>(b.size))) &&
+         (b_addr.offset < (a_addr.offset + static_cast<int64_t>(a.size)));
+}
+
+// Returns `true` if `a` and `b` access exactly the same bytes.
+static bool MustAlias(const MemoryAccess &a, const MemoryAccess &b) {
+  if (a.size != b.size) {
+    return false;
+  }
+  const auto a_addr = DecomposeGuestAddress(a.address);
+  const auto b_addr = DecomposeGuestAddress(b.address);
+  return a_addr.base == b_addr.base && a_addr.offset == b_addr.offset;
+}
+
+// Returns `true` if `inst` might read or write guest memory, or otherwise
+// observe the results of our transformations (e.g. a hyper call).
+static bool IsMemoryClobber(llvm::Instruction *inst) {
+  auto call = llvm::dyn_cast<llvm::CallInst>(inst);
+  if (!call) {
+    return false;
+  }
+  auto callee = call->getCalledFunction();
+  return !callee || !callee->isIntrinsic();
+}
+
+// Returns the value of an earlier access, converted to the type of `read`.
+static llvm::Value *ConvertValue(llvm::Value *val, llvm::CallInst *read) {
+  if (val->getType() == read->getType()) {
+    return val;
+  }
+  llvm::IRBuilder<> ir(read);
+  return ir.CreateBitCast(val, read->getType());
+}
+
+// Within each block, forward the values of writes to later reads of the same
+// address, and reuse the values of earlier reads of the same address.
+//
+// This preserves fault behavior: the earlier access touches the same bytes
+// as the eliminated read, so if the earlier access faulted then it has
+// already recorded the (first) fault. This assumes that writable guest
+// memory is also readable.
+static unsigned ForwardMemoryValues(llvm::Function *func) {
+  unsigned num_changed = 0;
+  std::vector<MemoryAccess> available;
+  std::vector<llvm::Instruction *> dead_reads;
+
+  for (auto &block : *func) {
+    available.clear();
+    for (auto &inst : block) {
+      MemoryAccess access;
+      if (!GetMemoryAccess(&inst, &access)) {
+        if (IsMemoryClobber(&inst)) {
+          available.clear();
+        }
+        continue;
+      }
+
+      if (access.is_write) {
+        auto new_end = std::remove_if(
+            available.begin(), available.end(),
+            [&access] (const MemoryAccess &prev) {
+              return MayAlias(prev, access);
+            });
+        available.erase(new_end, available.end());
+        available.push_back(access);
+        continue;
+      }
+
+      auto found = false;
+      for (const auto &prev : available) {
+        if (MustAlias(prev, access)) {
+          auto val = prev.is_write ? prev.value : prev.call;
+          access.call->replaceAllUsesWith(ConvertValue(val, access.call));
+          dead_reads.push_back(access.call);
+          found = true;
+          break;
+        }
+      }
+
+      if (!found) {
+        available.push_back(access);
+      }
+    }
+  }
+
+  for (auto inst : dead_reads) {
+    inst->eraseFromParent();
+    num_changed++;
+  }
+
+  return num_changed;
+}
+
+// Accesses of the same kind and size, where each access touches the bytes
+// immediately following those touched by the previous access, and where the
+// accesses execute in that order.
+using AccessRun = std::vector<MemoryAccess>;
+
+// Returns the type of the value read or written by `access`.
+static llvm::Type *AccessType(const MemoryAccess &access) {
+  return access.is_write ? access.value->getType() : access.call->getType();
+}
+
+// Returns `true` if `access` is a candidate for being coalesced.
+static bool IsCoalescable(const MemoryAccess &access) {
+  auto type = AccessType(access);
+  return (type->isIntegerTy() || type->isFloatTy() || type->isDoubleTy()) &&
+         (access.size * 2) <= kMaxCoalescedSize;
+}
+
+// Returns `true` if `low` and `high` access adjacent bytes.
+static bool AreAdjacent(const MemoryAccess &low, const MemoryAccess &high) {
+  const auto low_addr = DecomposeGuestAddress(low.address);
+  const auto high_addr = DecomposeGuestAddress(high.address);
+  return low.size == high.size &&
+         low_addr.base == high_addr.base &&
+         (low_addr.offset + static_cast<int64_t>(low.size)) == high_addr.offset;
+}
+
+// Returns `true` if `access` can be added to the end of `run`.
+static bool CanExtendRun(const AccessRun &run, const MemoryAccess &access) {
+  return AreAdjacent(run.back(), access) &&
+         ((run.size() + 1) * access.size) <= kMaxCoalescedSize;
+}
+
+// Move the longest prefix of `run` whose total size has a memory intrinsic
+// (i.e. is a power of two) into `runs`, and clear `run`.
+static void FinishRun(AccessRun &run, std::vector<AccessRun> &runs) {
+  size_t num_accesses = 1;
+  while ((num_accesses * 2) <= run.size()) {
+    num_accesses *= 2;
+  }
+  if (2 <= num_accesses) {
+    run.resize(num_accesses);
+    runs.push_back(run);
+  }
+  run.clear();
+}
+
+// Find runs of reads, or runs of writes, that are adjacent in guest memory
+// and where the lower accesses execute first. No other memory access may
+// execute within a run, so moving the reads of a run up to its first read
+// doesn't reorder them with respect to any other read. Each write of a run
+// must also consume the memory token of the previous write.
+static void FindAccessRuns(llvm::BasicBlock &block,
+                           std::vector<AccessRun> &runs) {
+  AccessRun read_run;
+  AccessRun write_run;
+
+  for (auto &inst : block) {
+    MemoryAccess access;
+    if (!GetMemoryAccess(&inst, &access)) {
+      if (IsMemoryClobber(&inst)) {
+        FinishRun(read_run, runs);
+        FinishRun(write_run, runs);
+      }
+      continue;
+    }
+
+    if (!access.is_write) {
+      FinishRun(write_run, runs);
+      if (!read_run.empty() && IsCoalescable(access) &&
+          access.memory == read_run.back().memory &&
+          CanExtendRun(read_run, access)) {
+        read_run.push_back(access);
+        continue;
+      }
+
+      FinishRun(read_run, runs);
+      if (IsCoalescable(access)) {
+        read_run.push_back(access);
+      }
+      continue;
+    }
+
+    FinishRun(read_run, runs);
+
+    if (!write_run.empty() && IsCoalescable(access) &&
+        access.memory == write_run.back().call &&
+        write_run.back().call->hasOneUse() &&
+        CanExtendRun(write_run, access)) {
+      write_run.push_back(access);
+      continue;
+    }
+
+    FinishRun(write_run, runs);
+    if (IsCoalescable(access)) {
+      write_run.push_back(access);
+    }
+  }
+
+  FinishRun(read_run, runs);
+  FinishRun(write_run, runs);
+}
+
+// Emits the runtime check that the `size` bytes at `addr` are all on the same
+// page.
+static llvm::Value *IsOnOnePage(llvm::IRBuilder<> &ir, llvm::Value *addr,
+                                unsigned size) {
+  auto addr_type = addr->getType();
+  auto page_offset = ir.CreateAnd(
+      addr, llvm::ConstantInt::get(addr_type, kPageSize - 1));
+  return ir.CreateICmpULE(
+      page_offset, llvm::ConstantInt::get(addr_type, kPageSize - size));
+}
+
+// Creates a stack slot for passing a 32-byte value to or from a memory
+// intrinsic.
+static llvm::Value *CreateWideSlot(llvm::Function *func, llvm::Type *type) {
+  auto &entry_block = func->getEntryBlock();
+  llvm::IRBuilder<> ir(&entry_block, entry_block.getFirstInsertionPt());
+  return ir.CreateAlloca(type);
+}
+
+// Emits a read of the `size` bytes at `addr` using `wide_func`.
+static llvm::Value *EmitWideRead(llvm::IRBuilder<> &ir,
+                                 llvm::Function *wide_func,
+                                 llvm::Value *memory, llvm::Value *addr,
+                                 unsigned size) {
+  if (32 != size) {
+    return ir.CreateCall(wide_func, {memory, addr});
+  }
+  auto slot = CreateWideSlot(ir.GetInsertBlock()->getParent(),
+                             ir.getIntNTy(size * 8));
+  ir.CreateCall(wide_func, {memory, addr, slot});
+  return ir.CreateLoad(slot);
+}
+
+// Emits a write of the `size`-byte value `val` to `addr` using `wide_func`.
+// Returns the new memory pointer.
+static llvm::Value *EmitWideWrite(llvm::IRBuilder<> &ir,
+                                  llvm::Function *wide_func,
+                                  llvm::Value *memory, llvm::Value *addr,
+                                  llvm::Value *val, unsigned size) {
+  if (32 != size) {
+    return ir.CreateCall(wide_func, {memory, addr, val});
+  }
+  auto slot = CreateWideSlot(ir.GetInsertBlock()->getParent(),
+                             val->getType());
+  ir.CreateStore(val, slot);
+  return ir.CreateCall(wide_func, {memory, addr, slot});
+}
+
+// Replace a run of adjacent reads by a single wide read, guarded by a check
+// that the wide read stays on one page. If the check fails then the original
+// narrow reads are performed.
+static bool CoalesceReads(const AccessRun &run) {
+  auto first = run.front().call;
+  const auto elem_size = run.front().size;
+  const auto size = static_cast<unsigned>(elem_size * run.size());
+  auto wide_func = GetMemoryIntrinsic(first->getModule(), false, size);
+  if (!wide_func) {
+    return false;
+  }
+
+  // The later addresses might be computed after the first read, so rebuild
+  // them from the first address.
+  llvm::IRBuilder<> ir(first);
+  auto addr = run.front().address;
+  for (size_t i = 1; i < run.size(); ++i) {
+    run[i].call->setArgOperand(1, ir.CreateAdd(
+        addr, llvm::ConstantInt::get(addr->getType(), i * elem_size)));
+  }
+
+  auto cond = IsOnOnePage(ir, addr, size);
+  TerminatorInst *then_term = nullptr;
+  TerminatorInst *else_term = nullptr;
+  llvm::SplitBlockAndInsertIfThenElse(cond, first, &then_term, &else_term);
+
+  llvm::IRBuilder<> then_ir(then_term);
+  auto wide_val = EmitWideRead(
+      then_ir, wide_func, run.front().memory, addr, size);
+
+  // Keep the original reads on the slow path.
+  for (const auto &access : run) {
+    access.call->moveBefore(else_term);
+  }
+
+  const auto num_bits = elem_size * 8;
+  llvm::IRBuilder<> join_ir(&*else_term->getSuccessor(0)->begin());
+  for (size_t i = 0; i < run.size(); ++i) {
+    auto narrow = run[i].call;
+    auto narrow_type = narrow->getType();
+    auto part = wide_val;
+    if (i) {
+      part = then_ir.CreateLShr(part, i * num_bits);
+    }
+    part = then_ir.CreateTrunc(part, then_ir.getIntNTy(num_bits));
+    if (!narrow_type->isIntegerTy()) {
+      part = then_ir.CreateBitCast(part, narrow_type);
+    }
+
+    auto phi = join_ir.CreatePHI(narrow_type, 2);
+    narrow->replaceAllUsesWith(phi);
+    phi->addIncoming(part, then_term->getParent());
+    phi->addIncoming(narrow, else_term->getParent());
+  }
+  return true;
+}
+
+// Replace a run of adjacent writes by a single wide write, guarded by a check
+// that the wide write stays on one page. If the check fails then the original
+// narrow writes are performed.
+static bool CoalesceWrites(const AccessRun &run) {
+  auto last = run.back().call;
+  const auto elem_size = run.front().size;
+  const auto size = static_cast<unsigned>(elem_size * run.size());
+  auto wide_func = GetMemoryIntrinsic(last->getModule(), true, size);
+  if (!wide_func) {
+    return false;
+  }
+
+  // Everything is available at the last write.
+  llvm::IRBuilder<> ir(last);
+  auto addr = run.front().address;
+  auto cond = IsOnOnePage(ir, addr, size);
+
+  const auto num_bits = elem_size * 8;
+  auto wide_type = ir.getIntNTy(size * 8);
+  llvm::Value *wide_val = nullptr;
+  for (size_t i = 0; i < run.size(); ++i) {
+    auto part = run[i].value;
+    if (!part->getType()->isIntegerTy()) {
+      part = ir.CreateBitCast(part, ir.getIntNTy(num_bits));
+    }
+    part = ir.CreateZExt(part, wide_type);
+    if (i) {
+      part = ir.CreateShl(part, i * num_bits);
+      wide_val = ir.CreateOr(wide_val, part);
+    } else {
+      wide_val = part;
+    }
+  }
+
+  TerminatorInst *then_term = nullptr;
+  TerminatorInst *else_term = nullptr;
+  llvm::SplitBlockAndInsertIfThenElse(cond, last, &then_term, &else_term);
+
+  llvm::IRBuilder<> then_ir(then_term);
+  auto wide_mem = EmitWideWrite(
+      then_ir, wide_func, run.front().memory, addr, wide_val, size);
+
+  // Keep the original writes on the slow path.
+  for (const auto &access : run) {
+    access.call->moveBefore(else_term);
+  }
+
+  llvm::IRBuilder<> join_ir(&*else_term->getSuccessor(0)->begin());
+  auto mem_phi = join_ir.CreatePHI(last->getType(), 2);
+  last->replaceAllUsesWith(mem_phi);
+  mem_phi->addIncoming(wide_mem, then_term->getParent());
+  mem_phi->addIncoming(last, else_term->getParent());
+  return true;
+}
+
+// Coalesce runs of adjacent, same-page reads or writes into wider accesses,
+// up to the size of an AVX vector. Remill's semantics access vectors one
+// element at a time, so this is what turns them back into vector-width
+// accesses.
+//
+// This preserves fault behavior up to the size of the access: the narrow
+// accesses are all on the same page, so they either all fault or all succeed.
+// The lowest access executes first, and no other access executes between the
+// accesses of a run, so when the wide access faults, the recorded fault has
+// the same address as the first faulting narrow access would have had, but
+// its `access_size` is the combined size of the coalesced access.
+static unsigned CoalesceMemoryAccesses(llvm::Function *func) {
+  std::vector<AccessRun> runs;
+  for (auto &block : *func) {
+    FindAccessRuns(block, runs);
+  }
+
+  unsigned num_changed = 0;
+  for (const auto &run : runs) {
+    if (run.front().is_write ? CoalesceWrites(run) : CoalesceReads(run)) {
+      num_changed++;
+    }
+  }
+  return num_changed;
+}
+
+}  // namespace
+
+// Optimize the guest memory accesses of a lifted trace. Returns `true` if the
+// function was changed.
+bool OptimizeMemoryAccesses(llvm::Function *func, bool coalesce) {
+  if (func->isDeclaration()) {
+    return false;
+  }
+  auto num_changed = ForwardMemoryValues(func);
+  if (coalesce) {
+    num_changed += CoalesceMemoryAccesses(func);
+  }
+  return 0 != num_changed;
+}
+
+}  // namespace vmill
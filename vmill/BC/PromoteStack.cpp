@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+
+#include "remill/BC/Version.h"
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
+
+namespace vmill {
+namespace {
+
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(8, 0)
+using TerminatorInst = llvm::Instruction;
+#else
+using TerminatorInst = llvm::TerminatorInst;
+#endif
+
+// Upper bound on the number of stack slots promoted within a single trace.
+// Every slot adds code to each flush point.
+static constexpr size_t kMaxStackSlots = 16;
+
+// A fixed-size region of the guest stack at a constant offset from the value
+// of the stack pointer on entry to the trace.
+struct StackSlot {
+  int64_t offset;
+  unsigned size;
+  llvm::IntegerType *type;
+  llvm::AllocaInst *value;  // Cached value of the slot.
+  llvm::AllocaInst *valid;  // Does `value` hold the slot's contents?
+  llvm::AllocaInst *dirty;  // Is `value` newer than guest memory?
+};
+
+class StackPromoter {
+ public:
+  StackPromoter(llvm::Function *func_, uint64_t sp_offset_);
+
+  bool Run(void);
+
+ private:
+  bool FindStackPointer(void);
+  bool FindAccesses(void);
+  void CreateSlots(void);
+
+  llvm::Value *SlotAddress(llvm::IRBuilder<> &ir, const StackSlot &slot);
+
+  llvm::Value *EmitFlush(llvm::Instruction *before, llvm::Value *memory);
+  void EmitInvalidate(llvm::IRBuilder<> &ir, llvm::Value *keep_valid);
+
+  void PromoteRead(const MemoryAccess &access);
+  void PromoteWrite(const MemoryAccess &access);
+  void GuardUnknownAccess(const MemoryAccess &access);
+  void GuardCall(llvm::CallInst *call, unsigned memory_arg);
+  void GuardReturn(llvm::ReturnInst *ret);
+
+  llvm::Function * const func;
+  const uint64_t sp_offset;
+  const llvm::DataLayout dl;
+
+  // Value of the stack pointer on entry to the trace.
+  llvm::LoadInst *entry_sp;
+
+  // Bounds of the promoted region of the stack frame.
+  llvm::Value *frame_begin;
+  llvm::Value *frame_end;
+
+  std::map<int64_t, StackSlot> slots;
+  std::vector<MemoryAccess> stack_accesses;
+  std::vector<MemoryAccess> unknown_accesses;
+  std::vector<std::pair<llvm::CallInst *, unsigned>> calls;
+  std::vector<llvm::ReturnInst *> rets;
+};
+
+StackPromoter::StackPromoter(llvm::Function *func_, uint64_t sp_offset_)
+    : func(func_),
+      sp_offset(sp_offset_),
+      dl(func->getParent()),
+      entry_sp(nullptr),
+      frame_begin(nullptr),
+      frame_end(nullptr) {}
+
+// Find the load of the stack pointer register at the beginning of the trace.
+// After state promotion, every stack pointer-relative address in the trace
+// is derived from this one load.
+bool StackPromoter::FindStackPointer(void) {
+  auto state = &*func->arg_begin();  // `State *` is the first argument.
+  for (auto &inst : func->getEntryBlock()) {
+    int64_t offset = 0;
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(&inst)) {
+      if (GetConstantOffsetFrom(load->getPointerOperand(), state, dl,
+                                &offset) &&
+          static_cast<uint64_t>(offset) == sp_offset &&
+          load->getType()->isIntegerTy()) {
+        entry_sp = load;
+        return true;
+      }
+    } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&inst)) {
+      if (GetConstantOffsetFrom(store->getPointerOperand(), state, dl,
+                                &offset) &&
+          static_cast<uint64_t>(offset) == sp_offset) {
+        return false;
+      }
+    } else if (llvm::isa<llvm::CallInst>(&inst)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Classify every guest memory access and every exit from the trace.
+bool StackPromoter::FindAccesses(void) {
+  auto memory_type = std::next(func->arg_begin(), 2)->getType();
+  auto after_entry_sp = false;
+
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      if (&inst == entry_sp) {
+        after_entry_sp = true;
+        continue;
+      }
+
+      // Nothing before the stack pointer load can touch a promoted slot.
+      if (&block == &func->getEntryBlock() && !after_entry_sp) {
+        continue;
+      }
+
+      MemoryAccess access;
+      if (GetMemoryAccess(&inst, &access)) {
+        const auto addr = DecomposeGuestAddress(access.address);
+        if (addr.base == entry_sp && 1 <= access.size && 8 >= access.size) {
+          stack_accesses.push_back(access);
+        } else {
+          unknown_accesses.push_back(access);
+        }
+
+      } else if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+        auto callee = call->getCalledFunction();
+        if ((callee && callee->isIntrinsic()) ||
+            (IsStateInvariantIntrinsic(callee) &&
+             !IsMemoryIntrinsic(callee))) {
+          continue;
+        }
+
+        // Anything else might read or write guest memory, so it needs to
+        // see the up-to-date stack, and we can't trust the cached slots
+        // afterward. This includes the memory intrinsics that pass their
+        // values by reference.
+        auto memory_arg = call->getNumArgOperands();
+        for (auto i = 0U; i < call->getNumArgOperands(); ++i) {
+          if (call->getArgOperand(i)->getType() == memory_type) {
+            memory_arg = i;
+            break;
+          }
+        }
+        if (memory_arg == call->getNumArgOperands()) {
+          return false;
+        }
+        calls.push_back({call, memory_arg});
+
+      } else if (auto ret = llvm::dyn_cast<llvm::ReturnInst>(&inst)) {
+        if (!ret->getReturnValue() ||
+            ret->getReturnValue()->getType() != memory_type) {
+          return false;
+        }
+        rets.push_back(ret);
+
+      } else if (llvm::isa<llvm::InvokeInst>(&inst)) {
+        return false;
+      }
+    }
+  }
+
+  if (stack_accesses.empty()) {
+    return false;
+  }
+
+  // Group the accesses into slots. Every access to a slot must have the same
+  // size, and slots must not partially overlap.
+  for (const auto &access : stack_accesses) {
+    const auto offset = DecomposeGuestAddress(access.address).offset;
+    auto &slot = slots[offset];
+    if (!slot.size) {
+      slot.offset = offset;
+      slot.size = access.size;
+    } else if (slot.size != access.size) {
+      return false;
+    }
+  }
+
+  auto prev_end = std::numeric_limits<int64_t>::min();
+  for (const auto &entry : slots) {
+    if (entry.first < prev_end) {
+      return false;
+    }
+    prev_end = entry.first + static_cast<int64_t>(entry.second.size);
+  }
+
+  // Only bother if some slot is accessed more than once.
+  return slots.size() <= kMaxStackSlots &&
+         stack_accesses.size() > slots.size();
+}
+
+// Create the allocas for each slot, and compute the bounds of the frame.
+void StackPromoter::CreateSlots(void) {
+  auto &entry_block = func->getEntryBlock();
+  llvm::IRBuilder<> ir(&entry_block, entry_block.getFirstInsertionPt());
+  for (auto &entry : slots) {
+    auto &slot = entry.second;
+    slot.type = ir.getIntNTy(slot.size * 8);
+    slot.value = ir.CreateAlloca(slot.type);
+    slot.valid = ir.CreateAlloca(ir.getInt1Ty());
+    slot.dirty = ir.CreateAlloca(ir.getInt1Ty());
+    ir.CreateStore(ir.getFalse(), slot.valid);
+    ir.CreateStore(ir.getFalse(), slot.dirty);
+  }
+
+  llvm::IRBuilder<> sp_ir(&*++entry_sp->getIterator());
+  auto addr_type = entry_sp->getType();
+  const auto &first = slots.begin()->second;
+  const auto &last = slots.rbegin()->second;
+  frame_begin = sp_ir.CreateAdd(
+      entry_sp,
+      llvm::ConstantInt::get(addr_type, static_cast<uint64_t>(first.offset)));
+  frame_end = sp_ir.CreateAdd(
+      entry_sp,
+      llvm::ConstantInt::get(
+          addr_type, static_cast<uint64_t>(last.offset + last.size)));
+}
+
+llvm::Value *StackPromoter::SlotAddress(llvm::IRBuilder<> &ir,
+                                        const StackSlot &slot) {
+  return ir.CreateAdd(
+      entry_sp,
+      llvm::ConstantInt::get(entry_sp->getType(),
+                             static_cast<uint64_t>(slot.offset)));
+}
+
+// Write every dirty slot back to guest memory, just before `before`. Returns
+// the memory pointer resulting from the write-backs.
+llvm::Value *StackPromoter::EmitFlush(llvm::Instruction *before,
+                                      llvm::Value *memory) {
+  auto module = func->getParent();
+  for (auto &entry : slots) {
+    auto &slot = entry.second;
+    auto write_func = GetMemoryIntrinsic(module, true, slot.size);
+
+    llvm::IRBuilder<> ir(before);
+    auto head_block = before->getParent();
+    auto is_dirty = ir.CreateLoad(slot.dirty);
+    auto then_term = llvm::SplitBlockAndInsertIfThen(is_dirty, before, false);
+
+    llvm::IRBuilder<> then_ir(then_term);
+    auto new_memory = then_ir.CreateCall(
+        write_func,
+        {memory, SlotAddress(then_ir, slot), then_ir.CreateLoad(slot.value)});
+    then_ir.CreateStore(then_ir.getFalse(), slot.dirty);
+
+    auto phi = llvm::PHINode::Create(
+        memory->getType(), 2, "", &*before->getParent()->begin());
+    phi->addIncoming(new_memory, then_term->getParent());
+    phi->addIncoming(memory, head_block);
+    memory = phi;
+  }
+  return memory;
+}
+
+// Mark the slots as no longer holding the contents of guest memory. If
+// `keep_valid` is non-null, then the slots keep their validity when it is
+// true.
+void StackPromoter::EmitInvalidate(llvm::IRBuilder<> &ir,
+                                   llvm::Value *keep_valid) {
+  for (auto &entry : slots) {
+    auto &slot = entry.second;
+    llvm::Value *valid = ir.getFalse();
+    if (keep_valid) {
+      valid = ir.CreateAnd(ir.CreateLoad(slot.valid), keep_valid);
+    }
+    ir.CreateStore(valid, slot.valid);
+  }
+}
+
+// Replace a read of a slot with a read of its cached value, falling back to
+// reading guest memory if the cached value is not valid.
+void StackPromoter::PromoteRead(const MemoryAccess &access) {
+  auto read = access.call;
+  const auto offset = DecomposeGuestAddress(read->getArgOperand(1)).offset;
+  auto &slot = slots[offset];
+  auto read_type = read->getType();
+
+  llvm::IRBuilder<> ir(read);
+  auto is_valid = ir.CreateLoad(slot.valid);
+  TerminatorInst *then_term = nullptr;
+  TerminatorInst *else_term = nullptr;
+  llvm::SplitBlockAndInsertIfThenElse(is_valid, read, &then_term, &else_term);
+
+  llvm::IRBuilder<> then_ir(then_term);
+  auto cached_val = then_ir.CreateBitCast(
+      then_ir.CreateLoad(slot.value), read_type);
+
+  read->moveBefore(else_term);
+  llvm::IRBuilder<> else_ir(else_term);
+  else_ir.CreateStore(else_ir.CreateBitCast(read, slot.type), slot.value);
+  else_ir.CreateStore(else_ir.getTrue(), slot.valid);
+
+  auto join_block = else_term->getSuccessor(0);
+  auto phi = llvm::PHINode::Create(read_type, 2, "", &*join_block->begin());
+  read->replaceAllUsesWith(phi);
+  phi->addIncoming(cached_val, then_term->getParent());
+  phi->addIncoming(read, else_term->getParent());
+}
+
+// Replace a write to a slot with an update of its cached value. The value is
+// written back to guest memory at the next flush point.
+//
+// NOTE(pag): Earlier promotions may have replaced the operands of this write,
+//            so they are re-read from the call rather than from `access`.
+void StackPromoter::PromoteWrite(const MemoryAccess &access) {
+  auto write = access.call;
+  const auto offset = DecomposeGuestAddress(write->getArgOperand(1)).offset;
+  auto &slot = slots[offset];
+
+  llvm::IRBuilder<> ir(write);
+  ir.CreateStore(ir.CreateBitCast(write->getArgOperand(2), slot.type),
+                 slot.value);
+  ir.CreateStore(ir.getTrue(), slot.valid);
+  ir.CreateStore(ir.getTrue(), slot.dirty);
+
+  write->replaceAllUsesWith(write->getArgOperand(0));
+  write->eraseFromParent();
+}
+
+// An access through some pointer other than the stack pointer might still
+// point into the stack frame. Check at runtime whether it overlaps the
+// promoted slots, and if so, flush the dirty slots beforehand, and (for
+// writes) invalidate the cached slots afterward.
+void StackPromoter::GuardUnknownAccess(const MemoryAccess &access) {
+  auto call = access.call;
+  auto memory = call->getArgOperand(0);
+  auto addr = call->getArgOperand(1);
+  llvm::IRBuilder<> ir(call);
+  auto access_end = ir.CreateAdd(
+      addr, llvm::ConstantInt::get(addr->getType(), access.size));
+  auto overlaps = ir.CreateAnd(ir.CreateICmpULT(addr, frame_end),
+                               ir.CreateICmpUGT(access_end, frame_begin));
+
+  auto head_block = call->getParent();
+  auto then_term = llvm::SplitBlockAndInsertIfThen(overlaps, call, false);
+  auto flushed_memory = EmitFlush(then_term, memory);
+  auto phi = llvm::PHINode::Create(
+      memory->getType(), 2, "", &*call->getParent()->begin());
+  phi->addIncoming(flushed_memory, then_term->getParent());
+  phi->addIncoming(memory, head_block);
+  call->setArgOperand(0, phi);
+
+  if (access.is_write) {
+    llvm::IRBuilder<> after_ir(&*++call->getIterator());
+    EmitInvalidate(after_ir, after_ir.CreateNot(overlaps));
+  }
+}
+
+// Flush the dirty slots before a call that might observe guest memory, and
+// invalidate them afterward.
+void StackPromoter::GuardCall(llvm::CallInst *call, unsigned memory_arg) {
+  call->setArgOperand(
+      memory_arg, EmitFlush(call, call->getArgOperand(memory_arg)));
+
+  auto next_inst = &*++call->getIterator();
+  if (!llvm::isa<llvm::ReturnInst>(next_inst)) {
+    llvm::IRBuilder<> ir(next_inst);
+    EmitInvalidate(ir, nullptr);
+  }
+}
+
+// Flush the dirty slots before leaving the trace. Returns that immediately
+// follow a call have already been handled by `GuardCall`.
+void StackPromoter::GuardReturn(llvm::ReturnInst *ret) {
+  auto &block = *ret->getParent();
+  if (&block.front() != ret) {
+    auto prev_inst = &*--ret->getIterator();
+    for (const auto &entry : calls) {
+      if (entry.first == prev_inst) {
+        return;
+      }
+    }
+  }
+  ret->setOperand(0, EmitFlush(ret, ret->getReturnValue()));
+}
+
+bool StackPromoter::Run(void) {
+  if (func->isDeclaration() || func->arg_size() < 3 ||
+      !FindStackPointer() || !FindAccesses()) {
+    return false;
+  }
+
+  auto module = func->getParent();
+  for (const auto &entry : slots) {
+    if (!GetMemoryIntrinsic(module, true, entry.second.size)) {
+      return false;
+    }
+  }
+
+  CreateSlots();
+
+  for (const auto &access : stack_accesses) {
+    if (access.is_write) {
+      PromoteWrite(access);
+    } else {
+      PromoteRead(access);
+    }
+  }
+
+  for (const auto &access : unknown_accesses) {
+    GuardUnknownAccess(access);
+  }
+
+  for (auto ret : rets) {
+    GuardReturn(ret);
+  }
+
+  for (const auto &entry : calls) {
+    GuardCall(entry.first, entry.second);
+  }
+
+  return true;
+}
+
+}  // namespace
+
+// Promote the slots of the guest stack frame that a lifted trace accesses
+// relative to its entry stack pointer into allocas. Dirty slots are written
+// back to guest memory before the trace exits, before calls that might
+// observe guest memory, and before accesses through other pointers that
+// overlap the frame at runtime. Returns `true` if anything was promoted.
+bool PromoteStackSlots(llvm::Function *func, uint64_t sp_offset) {
+  return StackPromoter(func, sp_offset).Run();
+}
+
+}  // namespace vmill
@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
+
+#include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
+
+namespace vmill {
+namespace {
+
+// A fixed-size, fixed-type region of the `State` structure that is accessed
+// by the loads and stores of a lifted trace. A vector slot covers a whole
+// vector register, and its loads and stores access lanes of it.
+struct StateSlot {
+  llvm::Type *type;
+  uint64_t size;
+  bool is_stored;
+  bool is_promotable;
+  bool is_vector;
+  std::vector<llvm::LoadInst *> loads;
+  std::vector<llvm::StoreInst *> stores;
+  llvm::Value *state_ptr;
+  llvm::AllocaInst *alloca;
+};
+
+using StateSlotMap = std::map<int64_t, StateSlot>;
+
+// Returns `true` if `call` can neither read nor write the `State` structure.
+static bool IsStateInvariantCall(llvm::CallInst *call) {
+  auto func = call->getCalledFunction();
+  if (!func) {
+    return false;
+  }
+  return func->isIntrinsic() || IsStateInvariantIntrinsic(func);
+}
+
+// Find all loads and stores of the `State` structure at constant offsets. This
+// returns `false` if the state pointer escapes in some way that we can't
+// account for, e.g. by being stored to memory or passed into a call as
+// something other than the `State *` argument.
+static bool FindStateSlots(llvm::Argument *state, const llvm::DataLayout &dl,
+                           StateSlotMap &slots) {
+  std::vector<llvm::Value *> work_list;
+  work_list.push_back(state);
+
+  while (!work_list.empty()) {
+    auto ptr = work_list.back();
+    work_list.pop_back();
+
+    for (auto user : ptr->users()) {
+      if (llvm::isa<llvm::BitCastOperator>(user) ||
+          llvm::isa<llvm::GEPOperator>(user)) {
+        int64_t offset = 0;
+        if (!GetConstantOffsetFrom(user, state, dl, &offset)) {
+          return false;
+        }
+        work_list.push_back(user);
+        continue;
+      }
+
+      int64_t offset = 0;
+      llvm::Type *type = nullptr;
+
+      if (auto load = llvm::dyn_cast<llvm::LoadInst>(user)) {
+        if (load->isVolatile() || !load->isUnordered()) {
+          return false;
+        }
+        type = load->getType();
+
+      } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+        if (store->getValueOperand() == ptr || store->isVolatile() ||
+            !store->isUnordered()) {
+          return false;
+        }
+        type = store->getValueOperand()->getType();
+
+      // Passing the state pointer itself into a call is fine, that's how
+      // control flows out of a lifted trace. Passing a pointer into the
+      // middle of the state structure is not.
+      } else if (auto call = llvm::dyn_cast<llvm::CallInst>(user)) {
+        if (ptr != state) {
+          return false;
+        }
+        for (auto &arg : call->arg_operands()) {
+          if (arg.get() == state && IsStateInvariantCall(call)) {
+            return false;
+          }
+        }
+        continue;
+
+      } else {
+        return false;
+      }
+
+      CHECK(GetConstantOffsetFrom(ptr, state, dl, &offset));
+
+      auto &slot = slots[offset];
+      if (!slot.type) {
+        slot.type = type;
+        slot.size = dl.getTypeStoreSize(type);
+        slot.is_stored = false;
+        slot.is_promotable = type->isSingleValueType();
+        slot.is_vector = false;
+        slot.state_ptr = nullptr;
+        slot.alloca = nullptr;
+      } else if (slot.type != type) {
+        slot.is_promotable = false;
+      }
+
+      if (auto load = llvm::dyn_cast<llvm::LoadInst>(user)) {
+        slot.loads.push_back(load);
+      } else {
+        slot.is_stored = true;
+        slot.stores.push_back(llvm::dyn_cast<llvm::StoreInst>(user));
+      }
+    }
+  }
+
+  // Don't promote slots that partially overlap with other slots, e.g. `AL`
+  // and `RAX`; their values need to stay coherent through memory.
+  auto prev = slots.end();
+  auto prev_end = INT64_MIN;
+  for (auto it = slots.begin(); it != slots.end(); ++it) {
+    const auto end = it->first + static_cast<int64_t>(it->second.size);
+    if (prev != slots.end() && prev_end > it->first) {
+      prev->second.is_promotable = false;
+      it->second.is_promotable = false;
+    }
+    if (end > prev_end) {
+      prev = it;
+      prev_end = end;
+    }
+  }
+
+  return true;
+}
+
+// Returns the type of the lanes accessed by a load or store of `type` from a
+// vector register, or `nullptr` if `type` doesn't split into whole lanes, e.g.
+// because it's an `x86_fp80`.
+static llvm::Type *GetLaneType(llvm::Type *type, const llvm::DataLayout &dl) {
+  auto lane_type = type->getScalarType();
+  if (!lane_type->isIntegerTy() && !lane_type->isFloatingPointTy()) {
+    return nullptr;
+  }
+  const uint64_t size = dl.getTypeStoreSize(lane_type);
+  if (dl.getTypeSizeInBits(lane_type) != (size * 8) || (size & (size - 1))) {
+    return nullptr;
+  }
+  return lane_type;
+}
+
+// Replaces the slots within each vector register in `vector_regs` by one
+// vector slot covering the register, so that the register's lanes are kept
+// together in one vector value. This is what lets the element-wise code of
+// guest vector instructions be vectorized again, and it also promotes the
+// registers that are accessed as overlapping pieces, e.g. `XMM0` as both
+// `<4 x float>` and `i64`. A register isn't promoted if any of its accesses
+// don't line up with lanes, or if a slot straddles its bounds.
+static void FindVectorSlots(
+    const std::vector<std::pair<uint64_t, uint64_t>> &vector_regs,
+    const llvm::DataLayout &dl, StateSlotMap &slots) {
+  for (const auto &reg : vector_regs) {
+    const auto reg_begin = static_cast<int64_t>(reg.first);
+    const auto reg_end = reg_begin + static_cast<int64_t>(reg.second);
+
+    auto first = slots.lower_bound(reg_begin);
+    if (first != slots.begin()) {
+      auto prev = std::prev(first);
+      if (prev->first + static_cast<int64_t>(prev->second.size) > reg_begin) {
+        continue;
+      }
+    }
+
+    auto last = first;
+    llvm::Type *lane_type = nullptr;
+    bool is_stored = false;
+    int64_t max_end = reg_begin;
+    for (; last != slots.end() && last->first < reg_end; ++last) {
+      const auto &slot = last->second;
+      const auto end = last->first + static_cast<int64_t>(slot.size);
+      if (end > reg_end) {
+        lane_type = nullptr;
+        break;
+      }
+
+      // Every access, not only the first, has to line up with its lanes.
+      std::vector<llvm::Type *> types;
+      for (auto load : slot.loads) {
+        types.push_back(load->getType());
+      }
+      for (auto store : slot.stores) {
+        types.push_back(store->getValueOperand()->getType());
+      }
+
+      const auto offset = static_cast<uint64_t>(last->first - reg_begin);
+      auto is_lanes = true;
+      for (auto type : types) {
+        auto type_lane = GetLaneType(type, dl);
+        if (!type_lane || (offset % dl.getTypeStoreSize(type_lane))) {
+          is_lanes = false;
+          break;
+        }
+        if (!lane_type) {
+          lane_type = type_lane;
+        }
+      }
+
+      if (!is_lanes) {
+        lane_type = nullptr;
+        break;
+      }
+
+      is_stored = is_stored || slot.is_stored;
+      max_end = std::max(max_end, end);
+    }
+
+    if (!lane_type) {
+      continue;
+    }
+
+    // Only keep as much of the register as is used, e.g. just the `XMM` part
+    // of a `ZMM` register.
+    uint64_t size = 16;
+    while (size < reg.second &&
+           static_cast<int64_t>(size) < (max_end - reg_begin)) {
+      size *= 2;
+    }
+    if (static_cast<int64_t>(size) < (max_end - reg_begin)) {
+      continue;
+    }
+
+    const auto num_lanes = size / dl.getTypeStoreSize(lane_type);
+    StateSlot vec_slot;
+    vec_slot.type = llvm::VectorType::get(
+        lane_type, static_cast<unsigned>(num_lanes));
+    vec_slot.size = size;
+    vec_slot.is_stored = is_stored;
+    vec_slot.is_promotable = true;
+    vec_slot.is_vector = true;
+    vec_slot.state_ptr = nullptr;
+    vec_slot.alloca = nullptr;
+    for (auto it = first; it != last; ++it) {
+      vec_slot.loads.insert(vec_slot.loads.end(), it->second.loads.begin(),
+                            it->second.loads.end());
+      vec_slot.stores.insert(vec_slot.stores.end(), it->second.stores.begin(),
+                             it->second.stores.end());
+    }
+
+    slots.erase(first, last);
+    slots[reg_begin] = std::move(vec_slot);
+  }
+}
+
+// Returns the vector `vec` viewed as `lane_type` lanes.
+static llvm::Value *CastToLanes(llvm::IRBuilder<> &ir, llvm::Value *vec,
+                                llvm::Type *lane_type, uint64_t size,
+                                const llvm::DataLayout &dl) {
+  const auto num_lanes = size / dl.getTypeStoreSize(lane_type);
+  return ir.CreateBitCast(
+      vec, llvm::VectorType::get(lane_type, static_cast<unsigned>(num_lanes)));
+}
+
+// Returns a shuffle mask whose `i`th lane selects the `lanes[i]`th input lane.
+// Negative lanes are undefined.
+static llvm::Value *ShuffleMask(llvm::LLVMContext &context,
+                                const std::vector<int> &lanes) {
+  auto i32_type = llvm::Type::getInt32Ty(context);
+  std::vector<llvm::Constant *> mask;
+  for (auto lane : lanes) {
+    if (0 > lane) {
+      mask.push_back(llvm::UndefValue::get(i32_type));
+    } else {
+      mask.push_back(llvm::ConstantInt::get(i32_type, lane));
+    }
+  }
+  return llvm::ConstantVector::get(mask);
+}
+
+// Replaces a load from the vector register of `slot`, at byte `offset` within
+// the register, by a read of the lanes that it accesses.
+static void ReplaceVectorLoad(llvm::LoadInst *load, const StateSlot &slot,
+                              uint64_t offset, const llvm::DataLayout &dl) {
+  auto type = load->getType();
+  auto lane_type = GetLaneType(type, dl);
+  const auto lane_size = dl.getTypeStoreSize(lane_type);
+  const auto first_lane = static_cast<int>(offset / lane_size);
+
+  llvm::IRBuilder<> ir(load);
+  auto lanes = CastToLanes(ir, ir.CreateLoad(slot.alloca), lane_type,
+                           slot.size, dl);
+  llvm::Value *val = nullptr;
+  if (type->isVectorTy()) {
+    std::vector<int> mask;
+    for (auto i = 0U; i < dl.getTypeStoreSize(type) / lane_size; ++i) {
+      mask.push_back(first_lane + static_cast<int>(i));
+    }
+    val = ir.CreateShuffleVector(
+        lanes, llvm::UndefValue::get(lanes->getType()),
+        ShuffleMask(load->getContext(), mask));
+  } else {
+    val = ir.CreateExtractElement(lanes, ir.getInt32(first_lane));
+  }
+
+  load->replaceAllUsesWith(val);
+  load->eraseFromParent();
+}
+
+// Replaces a store to the vector register of `slot`, at byte `offset` within
+// the register, by an update of the lanes that it accesses.
+static void ReplaceVectorStore(llvm::StoreInst *store, const StateSlot &slot,
+                               uint64_t offset, const llvm::DataLayout &dl) {
+  auto val = store->getValueOperand();
+  auto type = val->getType();
+  auto lane_type = GetLaneType(type, dl);
+  const auto lane_size = dl.getTypeStoreSize(lane_type);
+  const auto first_lane = static_cast<int>(offset / lane_size);
+
+  llvm::IRBuilder<> ir(store);
+  auto lanes = CastToLanes(ir, ir.CreateLoad(slot.alloca), lane_type,
+                           slot.size, dl);
+  llvm::Value *new_lanes = nullptr;
+  if (type->isVectorTy()) {
+    const auto num_lanes = static_cast<int>(slot.size / lane_size);
+    const auto num_stored = static_cast<int>(
+        dl.getTypeStoreSize(type) / lane_size);
+
+    // Widen the stored vector to the register's size, then merge it in.
+    std::vector<int> widen_mask;
+    std::vector<int> merge_mask;
+    for (auto i = 0; i < num_lanes; ++i) {
+      if (i >= first_lane && i < (first_lane + num_stored)) {
+        widen_mask.push_back(i - first_lane);
+        merge_mask.push_back(num_lanes + i);
+      } else {
+        widen_mask.push_back(-1);
+        merge_mask.push_back(i);
+      }
+    }
+    auto wide_val = ir.CreateShuffleVector(
+        val, llvm::UndefValue::get(type),
+        ShuffleMask(store->getContext(), widen_mask));
+    new_lanes = ir.CreateShuffleVector(
+        lanes, wide_val, ShuffleMask(store->getContext(), merge_mask));
+  } else {
+    new_lanes = ir.CreateInsertElement(lanes, val, ir.getInt32(first_lane));
+  }
+
+  ir.CreateStore(ir.CreateBitCast(new_lanes, slot.type), slot.alloca);
+  store->eraseFromParent();
+}
+
+// Write back the dirty promoted slots into the `State` structure.
+static void WriteBackSlots(llvm::Instruction *before, StateSlotMap &slots) {
+  llvm::IRBuilder<> ir(before);
+  for (auto &entry : slots) {
+    auto &slot = entry.second;
+    if (slot.alloca && slot.is_stored) {
+      ir.CreateStore(ir.CreateLoad(slot.alloca), slot.state_ptr);
+    }
+  }
+}
+
+// Reload the promoted slots from the `State` structure.
+static void ReloadSlots(llvm::Instruction *before, StateSlotMap &slots) {
+  llvm::IRBuilder<> ir(before);
+  for (auto &entry : slots) {
+    auto &slot = entry.second;
+    if (slot.alloca) {
+      ir.CreateStore(ir.CreateLoad(slot.state_ptr), slot.alloca);
+    }
+  }
+}
+
+}  // namespace
+
+// Promote the fixed-offset slots of the `State` structure that are accessed
+// by a lifted trace into virtual registers. Promoted slots are written back
+// to the `State` structure before any call that might observe them, and on
+// every return from the trace, and are reloaded after such calls.
+bool PromoteStateToRegisters(
+    llvm::Function *func,
+    const std::vector<std::pair<uint64_t, uint64_t>> &vector_regs) {
+  if (func->isDeclaration() || func->arg_empty()) {
+    return false;
+  }
+
+  llvm::DataLayout dl(func->getParent());
+  auto state = &*func->arg_begin();  // `State *` is the first argument.
+
+  StateSlotMap slots;
+  if (!FindStateSlots(state, dl, slots)) {
+    return false;
+  }
+  FindVectorSlots(vector_regs, dl, slots);
+
+  std::vector<llvm::CallInst *> calls;
+  std::vector<llvm::ReturnInst *> rets;
+  for (auto &block : *func) {
+    for (auto &inst : block) {
+      if (auto call = llvm::dyn_cast<llvm::CallInst>(&inst)) {
+        if (!IsStateInvariantCall(call)) {
+          calls.push_back(call);
+        }
+      } else if (auto ret = llvm::dyn_cast<llvm::ReturnInst>(&inst)) {
+        rets.push_back(ret);
+      } else if (llvm::isa<llvm::InvokeInst>(&inst)) {
+        return false;
+      }
+    }
+  }
+
+  auto &entry_block = func->getEntryBlock();
+  llvm::IRBuilder<> ir(&entry_block, entry_block.getFirstInsertionPt());
+  auto byte_ptr = ir.CreateBitCast(state, ir.getInt8PtrTy());
+
+  auto num_promoted = 0U;
+  for (auto &entry : slots) {
+    auto &slot = entry.second;
+    if (!slot.is_promotable) {
+      continue;
+    }
+
+    num_promoted++;
+    slot.alloca = ir.CreateAlloca(slot.type);
+    slot.state_ptr = ir.CreateBitCast(
+        ir.CreateConstGEP1_64(byte_ptr, static_cast<uint64_t>(entry.first)),
+        llvm::PointerType::get(slot.type, 0));
+    ir.CreateStore(ir.CreateLoad(slot.state_ptr), slot.alloca);
+
+    if (slot.is_vector) {
+      for (auto load : slot.loads) {
+        int64_t offset = 0;
+        CHECK(GetConstantOffsetFrom(load->getPointerOperand(), state, dl,
+                                    &offset));
+        ReplaceVectorLoad(load, slot,
+                          static_cast<uint64_t>(offset - entry.first), dl);
+      }
+      for (auto store : slot.stores) {
+        int64_t offset = 0;
+        CHECK(GetConstantOffsetFrom(store->getPointerOperand(), state, dl,
+                                    &offset));
+        ReplaceVectorStore(store, slot,
+                           static_cast<uint64_t>(offset - entry.first), dl);
+      }
+      continue;
+    }
+
+    for (auto load : slot.loads) {
+      load->setOperand(load->getPointerOperandIndex(), slot.alloca);
+    }
+    for (auto store : slot.stores) {
+      store->setOperand(store->getPointerOperandIndex(), slot.alloca);
+    }
+  }
+
+  if (!num_promoted) {
+    return false;
+  }
+
+  // Calls get the real state. If the call is a tail call then the state that
+  // it leaves behind is the state that we return.
+  std::vector<llvm::ReturnInst *> tail_rets;
+  for (auto call : calls) {
+    WriteBackSlots(call, slots);
+    auto next_inst = &*++call->getIterator();
+    if (auto ret = llvm::dyn_cast<llvm::ReturnInst>(next_inst)) {
+      tail_rets.push_back(ret);
+    } else {
+      ReloadSlots(next_inst, slots);
+    }
+  }
+
+  for (auto ret : rets) {
+    if (std::find(tail_rets.begin(), tail_rets.end(), ret) == tail_rets.end()) {
+      WriteBackSlots(ret, slots);
+    }
+  }
+
+  return true;
+}
+
+}  // namespace vmill
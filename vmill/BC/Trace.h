@@ -18,6 +18,9 @@
 #define VMILL_BC_TRACE_H_
 
 #include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
 
 namespace llvm {
 class Module;
@@ -29,6 +32,9 @@ enum class TraceHash : TraceHashBaseType;
 enum class PC : uint64_t;
 enum class CodeVersion : uint64_t;
 
+// Maps guest addresses to the bytes of read-only memory at those addresses.
+using ReadOnlyDataMap = std::map<uint64_t, std::string>;
+
 // Hash of the bytes of the machine code in the trace.
 struct TraceId {
  public:
@@ -56,6 +62,17 @@ struct LiveTraceId {
   }
 };
 
+// Number of times that the lifted basic block of the instruction at `pc` has
+// executed. Instrumented lifted code places these in the `.vprofile` section.
+struct BlockCount {
+ public:
+  PC pc;
+  uint64_t count;
+} __attribute__((packed));
+
+// Execution counts of lifted basic blocks, keyed by the block PC.
+using BlockProfile = std::unordered_map<uint64_t, uint64_t>;
+
 }  // namespace vmill
 
 namespace std {
@@ -17,18 +17,234 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+#include <llvm/ADT/APInt.h>
+
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DataLayout.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instruction.h>
+#include <llvm/IR/Instructions.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/Operator.h>
 
 #include "remill/BC/Version.h"
 #include "remill/BC/Util.h"
 #include "vmill/BC/Util.h"
 
 namespace vmill {
+namespace {
+
+static const char kCallStubPrefix[] = "__vmill_call_stub_";
+
+// Returns `true` if `name` begins with `prefix`.
+static bool StartsWith(llvm::StringRef name, const char *prefix) {
+  return name.startswith(prefix);
+}
+
+}  // namespace
+
+// Returns the name of the patchable call stub through which lifted code calls
+// the trace whose entry PC is `pc`.
+std::string CallStubName(PC pc) {
+  std::stringstream ss;
+  ss << kCallStubPrefix << std::hex << static_cast<uint64_t>(pc);
+  return ss.str();
+}
+
+// Returns `true` if `name` is the name of a patchable call stub, and if so,
+// stores the entry PC of the called trace into `pc`.
+bool IsCallStubName(const std::string &name, PC *pc) {
+  const auto prefix_len = sizeof(kCallStubPrefix) - 1;
+  if (name.size() <= prefix_len ||
+      name.compare(0, prefix_len, kCallStubPrefix)) {
+    return false;
+  }
+
+  char *end = nullptr;
+  const auto hex = name.c_str() + prefix_len;
+  const auto pc_uint = strtoull(hex, &end, 16);
+  if (!end || *end) {
+    return false;
+  }
+
+  *pc = static_cast<PC>(pc_uint);
+  return true;
+}
+
+// Returns `true` if `ptr` is `base` plus some constant number of bytes, and
+// if so, stores that number into `offset`.
+bool GetConstantOffsetFrom(llvm::Value *ptr, llvm::Value *base,
+                           const llvm::DataLayout &dl, int64_t *offset) {
+  const auto ptr_size = dl.getPointerSizeInBits(0);
+  llvm::APInt total(ptr_size, 0, true);
+  while (ptr != base) {
+    if (auto cast = llvm::dyn_cast<llvm::BitCastOperator>(ptr)) {
+      ptr = cast->getOperand(0);
+
+    } else if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(ptr)) {
+      llvm::APInt gep_offset(ptr_size, 0, true);
+      if (!gep->accumulateConstantOffset(dl, gep_offset)) {
+        return false;
+      }
+      total += gep_offset;
+      ptr = gep->getPointerOperand();
+
+    } else {
+      return false;
+    }
+  }
+  *offset = total.getSExtValue();
+  return true;
+}
+
+// Returns `true` if `inst` is a call to one of Remill's scalar memory read
+// or write intrinsics, and if so, fills in `access`.
+bool GetMemoryAccess(llvm::Instruction *inst, MemoryAccess *access) {
+  auto call = llvm::dyn_cast<llvm::CallInst>(inst);
+  if (!call) {
+    return false;
+  }
+
+  auto func = call->getCalledFunction();
+  if (!func) {
+    return false;
+  }
+
+  const auto name = func->getName();
+  llvm::Type *val_type = nullptr;
+
+  // The 80-bit float intrinsics pass a `double` by value, but read or write
+  // 10 bytes of guest memory, so their value type says nothing about their
+  // size.
+  if (name.endswith("_f80")) {
+    return false;
+  }
+
+  // E.g. `uint32_t __remill_read_memory_32(Memory *, addr_t)`.
+  if (StartsWith(name, "__remill_read_memory_") &&
+      2 == call->getNumArgOperands()) {
+    access->value = nullptr;
+    access->is_write = false;
+    val_type = call->getType();
+
+  // E.g. `Memory *__remill_write_memory_32(Memory *, addr_t, uint32_t)`.
+  } else if (StartsWith(name, "__remill_write_memory_") &&
+             3 == call->getNumArgOperands()) {
+    access->value = call->getArgOperand(2);
+    access->is_write = true;
+    val_type = access->value->getType();
+
+  } else {
+    return false;
+  }
+
+  // The 256-bit intrinsics pass their values by reference.
+  if (!val_type->isIntegerTy() && !val_type->isFloatTy() &&
+      !val_type->isDoubleTy()) {
+    return false;
+  }
+
+  access->call = call;
+  access->memory = call->getArgOperand(0);
+  access->address = call->getArgOperand(1);
+  access->size = val_type->getPrimitiveSizeInBits() / 8;
+  return true;
+}
+
+// Returns the scalar integer memory read or write intrinsic for accesses of
+// `size` bytes.
+llvm::Function *GetMemoryIntrinsic(llvm::Module *module, bool is_write,
+                                   unsigned size) {
+  std::stringstream ss;
+  ss << (is_write ? "__remill_write_memory_" : "__remill_read_memory_")
+     << (size * 8);
+
+  auto func = module->getFunction(ss.str());
+  if (func || 8 >= size || (16 != size && 32 != size)) {
+    return func;
+  }
+
+  // Model the vector-width intrinsics on the 64-bit ones.
+  auto base_func = GetMemoryIntrinsic(module, is_write, 8);
+  if (!base_func) {
+    return nullptr;
+  }
+
+  auto base_type = base_func->getFunctionType();
+  auto memory_type = base_type->getParamType(0);
+  auto addr_type = base_type->getParamType(1);
+  auto val_type = llvm::Type::getIntNTy(module->getContext(), size * 8);
+
+  std::vector<llvm::Type *> param_types;
+  param_types.push_back(memory_type);
+  param_types.push_back(addr_type);
+
+  llvm::Type *ret_type = nullptr;
+  if (16 == size) {
+    if (is_write) {
+      param_types.push_back(val_type);
+      ret_type = memory_type;
+    } else {
+      ret_type = val_type;
+    }
+  } else {
+    param_types.push_back(llvm::PointerType::get(val_type, 0));
+    ret_type = is_write ? memory_type : llvm::Type::getVoidTy(
+        module->getContext());
+  }
+
+  return llvm::Function::Create(
+      llvm::FunctionType::get(ret_type, param_types, false),
+      llvm::GlobalValue::ExternalLinkage, ss.str(), module);
+}
+
+// Returns `true` if `func` is one of the memory read or write intrinsics.
+bool IsMemoryIntrinsic(llvm::Function *func) {
+  if (!func) {
+    return false;
+  }
+  const auto name = func->getName();
+  return StartsWith(name, "__remill_read_memory_") ||
+         StartsWith(name, "__remill_write_memory_");
+}
 
+// Split the guest address `addr` into `base + offset`.
+GuestAddress DecomposeGuestAddress(llvm::Value *addr) {
+  GuestAddress ret = {addr, 0};
+  while (auto op = llvm::dyn_cast<llvm::BinaryOperator>(ret.base)) {
+    auto disp = llvm::dyn_cast<llvm::ConstantInt>(op->getOperand(1));
+    if (!disp) {
+      break;
+    }
+    if (op->getOpcode() == llvm::Instruction::Add) {
+      ret.offset += disp->getSExtValue();
+    } else if (op->getOpcode() == llvm::Instruction::Sub) {
+      ret.offset -= disp->getSExtValue();
+    } else {
+      break;
+    }
+    ret.base = op->getOperand(0);
+  }
+  return ret;
+}
 
+// Returns `true` if `func` is one of Remill's intrinsics that neither reads
+// nor writes the `State` structure.
+bool IsStateInvariantIntrinsic(llvm::Function *func) {
+  if (!func) {
+    return false;
+  }
+  const auto name = func->getName();
+  return StartsWith(name, "__remill_read_memory_") ||
+         StartsWith(name, "__remill_write_memory_") ||
+         StartsWith(name, "__remill_undefined_") ||
+         StartsWith(name, "__remill_barrier_") ||
+         StartsWith(name, "__remill_atomic_");
+}
 
 }  // namespace vmill
@@ -21,12 +21,73 @@
 #include <memory>
 #include <string>
 
+#include "vmill/BC/Trace.h"
+
 namespace llvm {
+class CallInst;
+class DataLayout;
 class Function;
+class Instruction;
 class Module;
+class Value;
 }  // namespace llvm
 namespace vmill {
 
+// Returns the name of the patchable call stub through which lifted code calls
+// the trace whose entry PC is `pc`.
+std::string CallStubName(PC pc);
+
+// Returns `true` if `name` is the name of a patchable call stub, and if so,
+// stores the entry PC of the called trace into `pc`.
+bool IsCallStubName(const std::string &name, PC *pc);
+
+// Returns `true` if `ptr` is `base` plus some constant number of bytes, and
+// if so, stores that number into `offset`. This looks through bitcasts and
+// constant-indexed `getelementptr`s.
+bool GetConstantOffsetFrom(llvm::Value *ptr, llvm::Value *base,
+                           const llvm::DataLayout &dl, int64_t *offset);
+
+// A call to one of Remill's scalar memory read or write intrinsics, e.g.
+// `__remill_read_memory_32` or `__remill_write_memory_f64`.
+struct MemoryAccess {
+  llvm::CallInst *call;
+  llvm::Value *memory;  // Memory pointer operand.
+  llvm::Value *address;  // Address operand.
+  llvm::Value *value;  // Value written, or `nullptr` for reads.
+  unsigned size;  // Number of bytes accessed.
+  bool is_write;
+};
+
+// Returns `true` if `inst` is a call to one of Remill's scalar memory read
+// or write intrinsics, and if so, fills in `access`. The 80-bit float
+// intrinsics are not included, because they access 10 bytes.
+bool GetMemoryAccess(llvm::Instruction *inst, MemoryAccess *access);
+
+// Returns the integer memory read or write intrinsic for accesses of `size`
+// bytes, or `nullptr` if there is none. The 16- and 32-byte intrinsics are
+// vmill's own, and are declared on demand. The 32-byte values are passed by
+// reference, i.e. `void __remill_read_memory_256(Memory *, addr_t, i256 *)`
+// and `Memory *__remill_write_memory_256(Memory *, addr_t, i256 *)`.
+llvm::Function *GetMemoryIntrinsic(llvm::Module *module, bool is_write,
+                                   unsigned size);
+
+// Returns `true` if `func` is one of the memory read or write intrinsics,
+// including those that `GetMemoryAccess` doesn't understand.
+bool IsMemoryIntrinsic(llvm::Function *func);
+
+// A guest address, split into a base value and a constant displacement.
+struct GuestAddress {
+  llvm::Value *base;
+  int64_t offset;
+};
+
+// Split the guest address `addr` into `base + offset`, looking through
+// additions and subtractions of constants.
+GuestAddress DecomposeGuestAddress(llvm::Value *addr);
+
+// Returns `true` if `func` is one of Remill's intrinsics that neither reads
+// nor writes the `State` structure, e.g. the memory access intrinsics.
+bool IsStateInvariantIntrinsic(llvm::Function *func);
 
 }  // namespace vmill
 
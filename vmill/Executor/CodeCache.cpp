@@ -17,12 +17,15 @@
 #include <glog/logging.h>
 
 #include <cerrno>
+#include <cstring>
+#include <dlfcn.h>
 #include <map>
 #include <vector>
 #include <sstream>
 #include <string>
 #include <sys/mman.h>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/IR/Constant.h>
@@ -32,14 +35,24 @@
 #include <llvm/Object/ObjectFile.h>
 #include <llvm/Support/MemoryBuffer.h>
 
+#include "remill/BC/Version.h"
+
+#if LLVM_VERSION_NUMBER >= LLVM_VERSION(5, 0)
+# include <llvm/BinaryFormat/ELF.h>
+#else
+# include <llvm/Support/ELF.h>
+#endif
+
 #include "remill/BC/Compat/Error.h"
 #include "remill/BC/Compat/RuntimeDyld.h"
 #include "remill/BC/Compat/JITSymbol.h"
+#include "remill/Arch/Name.h"
 #include "remill/BC/Util.h"
 #include "remill/OS/FileSystem.h"
 
 #include "vmill/BC/Compiler.h"
 #include "vmill/BC/Optimize.h"
+#include "vmill/BC/Util.h"
 #include "vmill/Executor/CodeCache.h"
 #include "vmill/Program/AddressSpace.h"
 #include "vmill/Util/AreaAllocator.h"
@@ -49,6 +62,8 @@
 
 #include <gflags/gflags.h>
 
+DECLARE_bool(vectorize);
+
 extern "C" {
 // Used to register exception handling frames with the JIT.
 __attribute__((weak))
@@ -64,6 +79,115 @@ struct CacheIndexEntry {
   Memory *(*lifted_function)(ArchState *, PC, Memory *);
 } __attribute__((packed));
 
+// A patchable trampoline that lifted code calls instead of calling a trace
+// in another module. The stub jumps through `target`, which is updated in
+// place when the called trace becomes live.
+struct alignas(16) CallStub {
+  uint8_t code[8];
+  LiftedFunction * volatile target;
+};
+
+static_assert(16 == sizeof(CallStub),
+              "Invalid packing of `struct CallStub`.");
+
+static const uint8_t kCallStubCode[sizeof(CallStub::code)] = {
+#if REMILL_ON_AMD64
+    0xFF, 0x25, 0x02, 0x00, 0x00, 0x00,  // `JMP QWORD PTR [RIP + 2]`.
+    0xCC, 0xCC  // `INT3` padding.
+#elif REMILL_ON_AARCH64
+    0x50, 0x00, 0x00, 0x58,  // `LDR X16, #8`.
+    0x00, 0x02, 0x1F, 0xD6  // `BR X16`.
+#else
+# error "Unsupported architecture for call stubs."
+#endif
+};
+
+// Write the code of a new call stub or trampoline. Some hosts (e.g. AArch64)
+// don't keep the instruction cache coherent with stores, so the new code is
+// flushed out of the data cache before anything can jump to it. The stub's
+// target is loaded as data, so changing it later needs no flush.
+static void WriteCallStubCode(CallStub *stub) {
+  memcpy(stub->code, kCallStubCode, sizeof(kCallStubCode));
+  auto begin = reinterpret_cast<char *>(stub->code);
+  __builtin___clear_cache(begin, begin + sizeof(kCallStubCode));
+}
+
+// Under the small and medium code models, all code compiled into the code
+// cache must be able to reach all other code and data in the code cache, as
+// well as any called function, with a signed 32-bit displacement.
+static constexpr uint64_t kNearDistance = 0x80000000ULL;  // 2 GiB.
+static constexpr uint64_t kNearCodeEnd = kAreaCodeCacheData;
+static constexpr uint64_t kNearDataEnd = kAreaCodeCacheCode + kNearDistance;
+static constexpr uint64_t kNearTargetBegin = kNearCodeEnd - kNearDistance;
+static constexpr uint64_t kNearTargetEnd = kNearDataEnd;
+
+// Make sure that an allocation made for JITed code or data respects the
+// code model.
+static void CheckIsNear(const uint8_t *base, uintptr_t size, uint64_t end) {
+  const auto addr = reinterpret_cast<uintptr_t>(base);
+  LOG_IF(FATAL, addr < kAreaCodeCacheCode || (addr + size) > end)
+      << "JIT allocation at " << reinterpret_cast<const void *>(base)
+      << " of size " << size << " is not reachable from the code cache "
+      << "under the current code model; use --code_model=large";
+}
+
+// Kinds of ELF relocations that need their targets to be near the code
+// cache, i.e. within reach of a 32-bit displacement.
+enum class NearRelocation {
+  kNone,
+  kCall,  // The displacement of a direct call or jump.
+  kOther
+};
+
+static NearRelocation ClassifyRelocation(uint64_t type) {
+  switch (type) {
+#if REMILL_ON_AMD64
+    case llvm::ELF::R_X86_64_PLT32:
+      return NearRelocation::kCall;
+    case llvm::ELF::R_X86_64_PC32:
+      return NearRelocation::kOther;
+#elif REMILL_ON_AARCH64
+    case llvm::ELF::R_AARCH64_CALL26:
+    case llvm::ELF::R_AARCH64_JUMP26:
+      return NearRelocation::kCall;
+#endif
+    default:
+      return NearRelocation::kNone;
+  }
+}
+
+// Collects the names of the symbols that the code in `obj` calls or jumps to
+// directly into `call_names`, and those that it otherwise references with a
+// 32-bit displacement into `other_names`.
+static void FindNearSymbols(const llvm::object::ObjectFile &obj,
+                            std::unordered_set<std::string> &call_names,
+                            std::unordered_set<std::string> &other_names) {
+  if (!obj.isELF()) {
+    return;
+  }
+  for (const auto &section : obj.sections()) {
+    for (const auto &reloc : section.relocations()) {
+      const auto kind = ClassifyRelocation(reloc.getType());
+      auto sym = reloc.getSymbol();
+      if (NearRelocation::kNone == kind || sym == obj.symbol_end()) {
+        continue;
+      }
+      auto maybe_name = sym->getName();
+      if (remill::IsError(maybe_name)) {
+        LOG(FATAL)
+            << "Unable to get the name of a relocated symbol: "
+            << remill::GetErrorString(maybe_name);
+      }
+      auto name = remill::GetReference(maybe_name).str();
+      if (NearRelocation::kCall == kind) {
+        call_names.insert(name);
+      } else {
+        other_names.insert(name);
+      }
+    }
+  }
+}
+
 // Memory mapped for JITed code or data.
 struct MemoryMap {
   uint8_t *base;
@@ -74,6 +198,7 @@ struct MemoryMap {
   bool can_exec;
   bool is_index;
   bool is_ctors;
+  bool is_profile;
   std::string source_file;
 
   inline bool operator<(const MemoryMap &that) const {
@@ -94,6 +219,16 @@ class CodeCacheImpl : public CodeCache,
 
   uintptr_t Lookup(const char *symbol) final;
 
+  LiftedFunction *GetCallStub(PC pc) final;
+
+  // Returns the address of a trampoline in the code cache that jumps to the
+  // far-away function at `addr`.
+  uintptr_t GetTrampoline(uintptr_t addr);
+
+  void BindCallStub(PC pc, LiftedFunction *func) final;
+
+  void GetBlockCounts(std::vector<BlockCount> &counts) const final;
+
   // Called to run constructors in the runtime.
   void RunConstructors(void) final {
     if (constructors.empty()) {
@@ -189,9 +324,18 @@ class CodeCacheImpl : public CodeCache,
   std::map<uint8_t *, MemoryMap> jit_ranges;
   std::unordered_map<unsigned, MemoryMap> pending_jit_ranges;
   std::unique_ptr<llvm::RuntimeDyld> pending_loader;
+
+  // Names of the symbols that the code loaded by `pending_loader` calls or
+  // jumps to directly, and of the symbols that it otherwise references with
+  // 32-bit displacements. All of them must be near the code cache.
+  std::unordered_set<std::string> pending_call_symbols;
+  std::unordered_set<std::string> pending_near_symbols;
   std::unique_ptr<llvm::RuntimeDyld> runtime_loader;
   std::string pending_source_file;
   std::unordered_map<TraceId, LiftedFunction *> lifted_functions;
+  std::unordered_map<uint64_t, CallStub *> call_stubs;
+  std::unordered_map<uintptr_t, CallStub *> trampolines;
+  LiftedFunction *call_dispatcher;
   std::vector<void(*)(void)> constructors;
 };
 
@@ -205,9 +349,18 @@ CodeCacheImpl::CodeCacheImpl(std::unique_ptr<Tool> tool_,
       data_allocator(kAreaRW, kAreaCodeCacheData),
       index_allocator(kAreaRW, kAreaCodeCacheIndex),
       ctor_allocator(kAreaRW),
-      event_listener(llvm::JITEventListener::createGDBRegistrationListener()) {
+      event_listener(llvm::JITEventListener::createGDBRegistrationListener()),
+      call_dispatcher(nullptr) {
   LoadRuntimeLibrary();
-  if (!LoadLibraries()) {
+
+  call_dispatcher = reinterpret_cast<LiftedFunction *>(
+      Lookup("__remill_function_call"));
+  CHECK(call_dispatcher != nullptr)
+      << "Could not locate __remill_function_call for use by call stubs.";
+
+  // Already lifted bitcode was lifted without the block profile, so don't
+  // reuse it when the profile matters.
+  if (!LoadLibraries() && !Workspace::UsesBlockProfile()) {
     ReloadLibraries();
   }
 }
@@ -219,8 +372,11 @@ uint8_t *CodeCacheImpl::allocateCodeSection(
     uintptr_t size, unsigned alignment, unsigned section_id,
     llvm::StringRef name) {
   MemoryMap map = {code_allocator.Allocate(size, alignment), size,
-                   section_id, true, false, true, false, false,
+                   section_id, true, false, true, false, false, false,
                    pending_source_file};
+  if (Compiler::HasNearCodeModel()) {
+    CheckIsNear(map.base, size, kNearCodeEnd);
+  }
   pending_jit_ranges[section_id] = map;
   return map.base;
 }
@@ -232,6 +388,7 @@ uint8_t *CodeCacheImpl::allocateDataSection(
   uint8_t *base = nullptr;
   bool is_index = false;
   bool is_ctors = false;
+  bool is_profile = false;
 
   // If we're allocating translations then we want all entries across all
   // translation segments to be contiguous.
@@ -245,9 +402,17 @@ uint8_t *CodeCacheImpl::allocateDataSection(
 
   } else {
     base = data_allocator.Allocate(size, alignment);
+    if (Compiler::HasNearCodeModel()) {
+      CheckIsNear(base, size, kNearDataEnd);
+    }
+
+    // Block counters are updated by lifted code, so they live alongside the
+    // other data, but we remember where they are so that we can save them.
+    is_profile = name == ".vprofile";
   }
   MemoryMap map = {base, size, section_id, true, !is_read_only,
-                   false, is_index, is_ctors, pending_source_file};
+                   false, is_index, is_ctors, is_profile,
+                   pending_source_file};
   pending_jit_ranges[section_id] = map;
   return map.base;
 }
@@ -327,6 +492,13 @@ bool CodeCacheImpl::finalizeMemory(std::string *error_message) {
     const auto &range = entry.second;
     jit_ranges[range.base] = range;
 
+    // Relocations have been applied to the code, so it too must be flushed
+    // out of the data cache (see `WriteCallStubCode`).
+    if (range.can_exec) {
+      auto begin = reinterpret_cast<char *>(range.base);
+      __builtin___clear_cache(begin, begin + range.size);
+    }
+
     if (range.is_ctors) {
       LoadConstructors(range);
     } else if (range.is_index) {
@@ -352,6 +524,12 @@ llvm::JITSymbol CodeCacheImpl::findSymbolInLogicalDylib(
 
 // Resolve external/exported symbols during linking.
 llvm::JITSymbol CodeCacheImpl::findSymbol(const std::string &name) {
+  PC stub_pc;
+  if (IsCallStubName(name, &stub_pc)) {
+    auto stub_addr = reinterpret_cast<uintptr_t>(GetCallStub(stub_pc));
+    return llvm::JITSymbol(stub_addr, llvm::JITSymbolFlags::None);
+  }
+
   auto addr = llvm::RTDyldMemoryManager::getSymbolAddressInProcess(name);
   auto resolved_addr = tool->FindSymbolForLinking(name, addr);
   if (!resolved_addr) {
@@ -376,6 +554,22 @@ llvm::JITSymbol CodeCacheImpl::findSymbol(const std::string &name) {
 #endif
     }
   }
+
+  // Direct calls to far-away symbols go through trampolines. References
+  // through the GOT can reach anything, but other displacements can't be
+  // fixed up.
+  if (resolved_addr && Compiler::HasNearCodeModel() &&
+      (resolved_addr < kNearTargetBegin || resolved_addr >= kNearTargetEnd)) {
+    if (pending_call_symbols.count(name)) {
+      resolved_addr = GetTrampoline(resolved_addr);
+    } else {
+      LOG_IF(FATAL, pending_near_symbols.count(name))
+          << "Symbol " << name << " at " << std::hex << resolved_addr
+          << std::dec << " is not reachable from the code cache under the "
+          << "current code model; use --code_model=large";
+    }
+  }
+
   return llvm::JITSymbol(resolved_addr, llvm::JITSymbolFlags::None);
 }
 
@@ -441,6 +635,13 @@ void CodeCacheImpl::LoadLibrary(const std::string &path, bool is_runtime) {
   }
 
   auto &object_file_ptr = remill::GetReference(maybe_obj_file_ptr);
+  pending_call_symbols.clear();
+  pending_near_symbols.clear();
+  if (Compiler::HasNearCodeModel()) {
+    FindNearSymbols(*object_file_ptr, pending_call_symbols,
+                    pending_near_symbols);
+  }
+
   auto info = pending_loader->loadObject(*object_file_ptr);
   if (!info) {
     if (pending_loader->hasError()) {
@@ -528,7 +729,8 @@ void CodeCacheImpl::ReoptimizeModule(
     }
   };
 
-  OptimizeModule(module.get(), func_generator);
+  OptimizeModule(module.get(), func_generator,
+                 FLAGS_vectorize ? compiler.HostMachine() : nullptr);
 //  auto undef_taint = llvm::UndefValue::get(llvm::Type::getInt1Ty(module->getContext()));
 //  for (auto user : undef_taint->users()) {
 //    if (auto inst = llvm::dyn_cast<llvm::Instruction>(user)) {
@@ -602,6 +804,57 @@ LiftedFunction *CodeCacheImpl::Lookup(TraceId trace_id) const {
   }
 }
 
+LiftedFunction *CodeCacheImpl::GetCallStub(PC pc) {
+  auto &stub = call_stubs[static_cast<uint64_t>(pc)];
+  if (!stub) {
+    stub = reinterpret_cast<CallStub *>(
+        code_allocator.Allocate(sizeof(CallStub), alignof(CallStub)));
+    WriteCallStubCode(stub);
+    stub->target = call_dispatcher;
+  }
+  return reinterpret_cast<LiftedFunction *>(stub->code);
+}
+
+// Trampolines are call stubs whose target never changes.
+uintptr_t CodeCacheImpl::GetTrampoline(uintptr_t addr) {
+  auto &trampoline = trampolines[addr];
+  if (!trampoline) {
+    trampoline = reinterpret_cast<CallStub *>(
+        code_allocator.Allocate(sizeof(CallStub), alignof(CallStub)));
+    WriteCallStubCode(trampoline);
+    trampoline->target = reinterpret_cast<LiftedFunction *>(addr);
+  }
+  return reinterpret_cast<uintptr_t>(trampoline->code);
+}
+
+// Binding creates the stub if it doesn't yet exist, so that code linked later
+// against the stub goes directly to `func`.
+void CodeCacheImpl::BindCallStub(PC pc, LiftedFunction *func) {
+  auto stub = reinterpret_cast<CallStub *>(GetCallStub(pc));
+
+  // The target is naturally aligned, so this store is atomic with respect
+  // to lifted code concurrently executing the stub.
+  stub->target = func ? func : call_dispatcher;
+}
+
+// Collect the non-zero block counters of all instrumented lifted code.
+void CodeCacheImpl::GetBlockCounts(std::vector<BlockCount> &counts) const {
+  for (const auto &entry : jit_ranges) {
+    const auto &range = entry.second;
+    if (!range.is_profile) {
+      continue;
+    }
+
+    auto base = reinterpret_cast<const BlockCount *>(range.base);
+    auto limit = &(base[range.size / sizeof(BlockCount)]);
+    for (; base < limit; ++base) {
+      if (base->count) {
+        counts.push_back(*base);
+      }
+    }
+  }
+}
+
 uintptr_t CodeCacheImpl::Lookup(const char *symbol) {
   std::string name(symbol);
   llvm::JITSymbol sym = findSymbolInLogicalDylib(name);
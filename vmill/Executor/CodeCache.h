@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "vmill/BC/Trace.h"
 
@@ -51,6 +52,19 @@ class CodeCache {
 
   virtual uintptr_t Lookup(const char *symbol) = 0;
 
+  // Returns the patchable call stub used by lifted code to call the trace
+  // whose entry PC is `pc`. New stubs dispatch via `__remill_function_call`.
+  virtual LiftedFunction *GetCallStub(PC pc) = 0;
+
+  // Binds the call stub for the trace at `pc` so that it goes directly to
+  // `func`. If `func` is `nullptr` then the stub goes back to dispatching
+  // through `__remill_function_call`.
+  virtual void BindCallStub(PC pc, LiftedFunction *func) = 0;
+
+  // Appends the execution counts of the blocks of instrumented lifted code
+  // to `counts`. Blocks that never executed are left out.
+  virtual void GetBlockCounts(std::vector<BlockCount> &counts) const = 0;
+
   // Called to run constructors in the runtime.
   virtual void RunConstructors(void) = 0;
 
@@ -47,7 +47,8 @@ Coroutine::Coroutine(void)
     : stack_end(nullptr),
       fpu_rounding_mode(0),
       on_stack(0),
-      stack(gAllocator.Allocate(FLAGS_coroutine_stack_size)) {
+      stack(gAllocator.Allocate(FLAGS_coroutine_stack_size,
+                                false /* zeroed */)) {
 
   // TODO(pag): Add redzone to the coroutine stack.
   stack_end = stack.base + FLAGS_coroutine_stack_size;
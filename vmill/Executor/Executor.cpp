@@ -19,6 +19,9 @@
 
 #include <cfenv>
 #include <setjmp.h>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
@@ -42,6 +45,9 @@
 
 DECLARE_uint64(num_io_threads);
 DECLARE_string(tool);
+DECLARE_bool(version_code);
+DECLARE_bool(profile_blocks);
+DECLARE_bool(use_profile);
 
 DEFINE_uint64(num_lift_threads, 1,
               "Number of threads that can be used for lifting.");
@@ -58,9 +64,10 @@ static thread_local std::unique_ptr<Lifter> gLifter;
 
 // Returns a thread-specific lifter object.
 static const std::unique_ptr<Lifter> &GetLifter(
-    const std::shared_ptr<llvm::LLVMContext> &context) {
+    const std::shared_ptr<llvm::LLVMContext> &context,
+    const BlockProfile *profile) {
   if (unlikely(!gLifter)) {
-    Lifter::Create(context).swap(gLifter);
+    Lifter::Create(context, profile).swap(gLifter);
   }
   return gLifter;
 }
@@ -92,7 +99,9 @@ Executor::Executor(void)
       fini_intrinsic(reinterpret_cast<decltype(fini_intrinsic)>(
           code_cache->Lookup("__vmill_fini"))),
       error_intrinsic(reinterpret_cast<LiftedFunction *>(
-          code_cache->Lookup("__remill_error"))) {
+          code_cache->Lookup("__remill_error"))),
+      hook_intrinsic(reinterpret_cast<LiftedFunction *>(
+          code_cache->Lookup("__vmill_run_hook"))) {
 
   CHECK(init_intrinsic != nullptr)
       << "Could not locate __vmill_init";
@@ -109,6 +118,9 @@ Executor::Executor(void)
   CHECK(error_intrinsic != nullptr)
       << "Could not locate __remill_error";
 
+  CHECK(hook_intrinsic != nullptr)
+      << "Could not locate __vmill_run_hook";
+
   LOG(INFO)
       << std::hex << "__vmill_init = "
       << reinterpret_cast<void *>(init_intrinsic) << std::dec;
@@ -129,12 +141,14 @@ Executor::Executor(void)
       << std::hex << "__remill_error = "
       << reinterpret_cast<void *>(error_intrinsic) << std::dec;
 
+  LoadBlockProfile();
+
   // Load the code cache index from the disk.
   for (const auto &entry : *index) {
     const auto &trace_id = entry.trace_id;
     const auto &live_id = entry.live_trace_id;
     if (auto lifted_func = code_cache->Lookup(trace_id)) {
-      live_traces[live_id] = lifted_func;
+      AddLiveTrace(live_id, lifted_func);
     }
   }
 
@@ -177,8 +191,7 @@ void Executor::DecodeTracesFromTask(Task *task) {
     // Already lifted, but not in our live cache.
     auto lifted_func = code_cache->Lookup(trace_id);
     if (lifted_func) {
-      index->Append({trace_id, live_id});
-      live_traces[live_id] = lifted_func;
+      AddLiveTraceEntries(*it, lifted_func, true);
 
       traces.erase(it);
       continue;
@@ -189,10 +202,17 @@ void Executor::DecodeTracesFromTask(Task *task) {
       << "Decoded trace list does not include originally requested PC "
       << std::hex << task_pc_uint;
 
+  // Hooks are added on this thread, so give the lifter its own copy of the
+  // hooked PCs.
+  std::unordered_set<uint64_t> hooked_pcs;
+  for (const auto &entry : hooks) {
+    hooked_pcs.insert(entry.first);
+  }
+
   std::future<std::unique_ptr<llvm::Module>> future_module = lifters->Submit(
-      [this, &traces] (void) {
-        auto &lifter = GetLifter(context);
-        return lifter->Lift(traces);
+      [this, &traces, &hooked_pcs] (void) {
+        auto &lifter = GetLifter(context, &block_profile);
+        return lifter->Lift(traces, hooked_pcs);
       });
 
   auto coro = task->async_routine;
@@ -224,26 +244,95 @@ void Executor::DecodeTracesFromTask(Task *task) {
 
   // Save a copy of the lifted module into the bitcode directory. This is so
   // that other tools can benefit from existing lifted code, but apply their
-  // own instrumentation.
-  std::stringstream ss;
-  ss << Workspace::BitcodeDir() << remill::PathSeparator()
-     << remill::ModuleName(module);
-
-  auto file_name = ss.str();
-  remill::StoreModuleToFile(module.get(), file_name);
+  // own instrumentation. Code with profiling counters isn't worth sharing.
+  if (!FLAGS_profile_blocks) {
+    std::stringstream ss;
+    ss << Workspace::BitcodeDir() << remill::PathSeparator()
+       << remill::ModuleName(module);
+
+    auto file_name = ss.str();
+    remill::StoreModuleToFile(module.get(), file_name);
+  }
 
   code_cache->AddModuleToCache(module);
   code_cache->RunConstructors();
 
   // Add the now lifted traces into the live trace cache.
   for (const auto &trace : traces) {
-    LiveTraceId live_id = {trace.pc, trace.code_version};
     if (auto lifted_func = code_cache->Lookup(trace.id)) {
-      live_traces[live_id] = lifted_func;
+      AddLiveTraceEntries(trace, lifted_func, false);
     }
   }
 }
 
+void Executor::AddLiveTraceEntries(const DecodedTrace &trace,
+                                   LiftedFunction *lifted_func,
+                                   bool add_to_index) {
+  std::vector<PC> entry_pcs(1, trace.pc);
+  entry_pcs.insert(entry_pcs.end(), trace.entry_pcs.begin(),
+                   trace.entry_pcs.end());
+
+  // Traces that fold read-only data are left out of the index, as the data
+  // may differ in later runs.
+  const auto is_folded = !trace.read_only_data.empty();
+  for (auto entry_pc : entry_pcs) {
+    const LiveTraceId live_id = {entry_pc, trace.code_version};
+    if (add_to_index && !is_folded) {
+      index->Append({trace.id, live_id});
+    }
+    AddLiveTrace(live_id, lifted_func, !is_folded);
+  }
+}
+
+void Executor::AddLiveTrace(const LiveTraceId &live_id,
+                            LiftedFunction *lifted_func, bool can_bind_stub) {
+
+  // Hooked functions are entered through the hook, which falls back on the
+  // lifted function.
+  if (unlikely(hooks.count(static_cast<uint64_t>(live_id.pc)))) {
+    hook_fallbacks[live_id] = lifted_func;
+    lifted_func = hook_intrinsic;
+    can_bind_stub = true;
+  }
+
+  live_traces[live_id] = lifted_func;
+
+  // Call stubs are keyed only by PC, so they can only be bound when there is
+  // at most one live version of the code at any given PC.
+  if (!FLAGS_version_code && can_bind_stub) {
+    code_cache->BindCallStub(live_id.pc, lifted_func);
+  }
+}
+
+void Executor::LoadBlockProfile(void) {
+  const auto &path = Workspace::ProfilePath();
+  if (!FLAGS_use_profile || FLAGS_profile_blocks || !remill::FileExists(path)) {
+    return;
+  }
+
+  // The profile accumulates the counts of every profiling run.
+  auto profile = BlockProfileCache::Open(path);
+  for (const auto &entry : *profile) {
+    block_profile[static_cast<uint64_t>(entry.pc)] += entry.count;
+  }
+
+  LOG(INFO)
+      << "Loaded execution counts of " << block_profile.size()
+      << " blocks from the block profile " << path;
+}
+
+void Executor::SaveBlockProfile(void) {
+  std::vector<BlockCount> counts;
+  code_cache->GetBlockCounts(counts);
+
+  auto profile = BlockProfileCache::Open(Workspace::ProfilePath());
+  profile->Extend(counts);
+
+  LOG(INFO)
+      << "Saved execution counts of " << counts.size()
+      << " blocks into the block profile " << Workspace::ProfilePath();
+}
+
 void Executor::SetUp(void) {
   CHECK(!gExecutor)
       << "`Executor::Run` should not be recursively invoked.";
@@ -271,6 +360,9 @@ void Executor::Run(void) {
         << "Creating initial task starting at "
         << std::hex << static_cast<uint64_t>(info.pc) << std::dec;
 
+    // The clone shares the snapshotted memory until it writes to it. The
+    // snapshotted ranges are backed by memory files, so a write only maps the
+    // file privately again, and the host kernel copies the written pages.
     auto &memory = memories[info.memory.get()];
     if (!memory) {
       LOG(INFO)
@@ -297,6 +389,10 @@ void Executor::TearDown(void) {
       << "Finalizing the runtime.";
   fini_intrinsic();
 
+  if (FLAGS_profile_blocks) {
+    SaveBlockProfile();
+  }
+
   code_cache->TearDown();
 
   gExecutor = nullptr;
@@ -341,6 +437,55 @@ LiftedFunction *Executor::FindLiftedFunctionForTask(Task *task) {
   return live_id_it->second;
 }
 
+void Executor::AddHook(PC pc, HookFunction *hook) {
+  hooks[static_cast<uint64_t>(pc)] = hook;
+
+  // Redirect the traces of this function that were loaded from the index.
+  std::vector<std::pair<LiveTraceId, LiftedFunction *>> hooked_traces;
+  for (const auto &entry : live_traces) {
+    if (entry.first.pc == pc && entry.second != hook_intrinsic) {
+      hooked_traces.push_back(entry);
+    }
+  }
+  for (const auto &entry : hooked_traces) {
+    AddLiveTrace(entry.first, entry.second);
+  }
+}
+
+LiftedFunction *Executor::RunHook(Task *task, PC pc) {
+  const auto memory = task->memory;
+  const auto hook = hooks[static_cast<uint64_t>(pc)];
+
+  uint64_t args[kMaxNumHookArgs] = {};
+  uint64_t ret_val = 0;
+  PC ret_pc;
+  if (hook && ReadFunctionCall(task->state, memory, args, kMaxNumHookArgs,
+                               &ret_pc) &&
+      hook(memory, args, &ret_val)) {
+    ReturnFromFunction(task->state, ret_val, ret_pc);
+    task->pc = ret_pc;
+    return nullptr;
+  }
+
+  // Fall back on the lifted function, which must be decoded again if the
+  // code version has changed since it was lifted.
+  const LiveTraceId live_id = {pc, memory->ComputeCodeVersion(pc)};
+  auto fallback_it = hook_fallbacks.find(live_id);
+  if (unlikely(fallback_it == hook_fallbacks.end())) {
+    DecodeTracesFromTask(task);
+    fallback_it = hook_fallbacks.find(live_id);
+  }
+
+  if (likely(fallback_it != hook_fallbacks.end())) {
+    return fallback_it->second;
+  }
+
+  LOG(ERROR)
+      << "Could not locate lifted function for hooked function at "
+      << std::hex << static_cast<uint64_t>(pc) << std::dec;
+  return error_intrinsic;
+}
+
 void Executor::AddInitialTask(const std::string &state_bytes, PC pc,
                               std::shared_ptr<AddressSpace> memory) {
   InitialTaskInfo info = {state_bytes, pc, memory};
@@ -21,6 +21,7 @@
 #include <unordered_map>
 
 #include "vmill/BC/Trace.h"
+#include "vmill/Executor/Hooks.h"
 #include "vmill/Runtime/Task.h"
 #include "vmill/Util/FileBackedCache.h"
 
@@ -40,6 +41,7 @@ namespace vmill {
 class AddressSpace;
 class CodeCache;
 class DecodedTraceList;
+struct DecodedTrace;
 class Lifter;
 
 // A compiled lifted trace.
@@ -57,6 +59,7 @@ struct CachedIndexEntry {
 };
 
 using IndexCache = FileBackedCache<CachedIndexEntry>;
+using BlockProfileCache = FileBackedCache<BlockCount>;
 
 // Task executor. This manages things like the code cache, and can lift and
 // compile code on request.
@@ -71,6 +74,14 @@ class Executor {
 
   LiftedFunction *FindLiftedFunctionForTask(Task *task);
 
+  // Replace the guest function at `pc` with the native `hook`.
+  void AddHook(PC pc, HookFunction *hook);
+
+  // Try to run the hook of the guest function at `pc`, which `task` is
+  // calling. Returns `nullptr` if the hook handled the call, otherwise returns
+  // the lifted guest function.
+  LiftedFunction *RunHook(Task *task, PC pc);
+
  private:
   void SetUp(void);
   void TearDown(void);
@@ -78,6 +89,23 @@ class Executor {
   __attribute__((noinline))
   void DecodeTracesFromTask(Task *task);
 
+  // Make `lifted_func` the live implementation of the trace `live_id`.
+  // Traces that fold read-only data are only valid for some code versions,
+  // and so `can_bind_stub` should be `false` for them.
+  void AddLiveTrace(const LiveTraceId &live_id, LiftedFunction *lifted_func,
+                    bool can_bind_stub=true);
+
+  // Make `lifted_func` the live implementation of `trace` at all of its
+  // entry points, recording them in the index if `add_to_index` is `true`.
+  void AddLiveTraceEntries(const DecodedTrace &trace,
+                           LiftedFunction *lifted_func, bool add_to_index);
+
+  // Load the block profile that guides lifting.
+  void LoadBlockProfile(void);
+
+  // Add the block counts of this run to the workspace's block profile.
+  void SaveBlockProfile(void);
+
   std::shared_ptr<llvm::LLVMContext> context;
   std::unique_ptr<ThreadPool> lifters;
   std::unique_ptr<CodeCache> code_cache;
@@ -85,6 +113,9 @@ class Executor {
   // File-backed index of all translations for all code versions.
   std::unique_ptr<IndexCache> index;
 
+  // Block execution counts from prior profiling runs.
+  BlockProfile block_profile;
+
   // List of initial tasks.
   std::vector<InitialTaskInfo> initial_tasks;
 
@@ -93,6 +124,11 @@ class Executor {
   // permit multiple address spaces to be simultaneously live.
   std::unordered_map<LiveTraceId, LiftedFunction *> live_traces;
 
+  // Native hooks of guest functions. The live traces of hooked functions
+  // are `hook_intrinsic`, and their lifted code is kept in `hook_fallbacks`.
+  HookMap hooks;
+  std::unordered_map<LiveTraceId, LiftedFunction *> hook_fallbacks;
+
   // Pointer to the compiled `__vmill_init` function. This initializes
   // the OS that is emulated by the runtime.
   void (*init_intrinsic)(void);
@@ -111,6 +147,9 @@ class Executor {
 
   // Pointer to the compiled `__remill_error`.
   LiftedFunction *error_intrinsic;
+
+  // Pointer to the compiled `__vmill_run_hook`.
+  LiftedFunction *hook_intrinsic;
 };
 
 }  // namespace vmill
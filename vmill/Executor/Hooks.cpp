@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <elfio/elfio.hpp>
+
+#include "remill/Arch/Arch.h"
+
+#include "vmill/Executor/Hooks.h"
+#include "vmill/Program/AddressSpace.h"
+#include "vmill/Util/Util.h"
+
+DEFINE_string(hooks, "",
+              "Comma-separated list of groups of guest libc functions to "
+              "replace with native implementations. By default, no functions "
+              "are hooked. The groups are: `memcpy`, `memset`, `strlen`, and "
+              "`memcmp`, which each hook the function of that name and its "
+              "CPU-specific glibc variants, e.g. `__memcpy_avx_unaligned`; "
+              "and `malloc`, which hooks `malloc`, `calloc`, `realloc`, and "
+              "`free` together, as they share one heap. Calls that a hook "
+              "can't handle fall back to the lifted guest function.");
+
+namespace vmill {
+
+// Allocation state of the `malloc` hook within one address space.
+struct GuestHeap {
+  uint64_t arena_next;
+  uint64_t arena_limit;
+  std::unordered_map<uint64_t, std::vector<uint64_t>> free_chunks;
+};
+
+namespace {
+
+enum : uint64_t {
+  kPageSize = 4096ULL,
+  kPageMask = ~(kPageSize - 1ULL),
+
+  // Every allocation of the `malloc` hook is preceded by a `HeapHeader`.
+  kHeapHeaderSize = 16ULL,
+  kMinChunkSize = 32ULL,
+
+  // Small chunks are carved out of arenas. Bigger ones get their own maps.
+  kArenaSize = 1ULL << 20ULL,
+  kMaxArenaChunkSize = kArenaSize / 4ULL,
+
+  k1GiB = 1ULL << 30ULL,
+  k4GiB = k1GiB * 4ULL
+};
+
+// Lives in guest memory, immediately before each allocation. Keeping this in
+// guest memory means that copies of an address space, e.g. made by `fork`,
+// still recognize the allocations made before the copy.
+struct HeapHeader {
+  uint64_t size;
+  uint64_t cookie;
+};
+
+// Distinguishes the headers of live and freed allocations from other data.
+static uint64_t GetHeapCookie(void) {
+  static uint64_t cookie = 0;
+  if (!cookie) {
+    std::random_device rand;
+    cookie = ((static_cast<uint64_t>(rand()) << 32) | rand()) & ~1ULL;
+  }
+  return cookie;
+}
+
+static uint64_t GetFreedHeapCookie(void) {
+  return GetHeapCookie() | 1ULL;
+}
+
+// Returns the size of the chunk, including its header, that holds an
+// allocation of `size` bytes.
+static uint64_t ChunkSize(uint64_t size) {
+  const auto min_size = size + kHeapHeaderSize;
+  if (min_size > kMaxArenaChunkSize) {
+    return (min_size + kPageSize - 1) & kPageMask;
+  }
+  uint64_t chunk_size = kMinChunkSize;
+  while (chunk_size < min_size) {
+    chunk_size *= 2;
+  }
+  return chunk_size;
+}
+
+// Returns the heap of `memory`, which is about to be changed.
+static GuestHeap &MutableHeap(AddressSpace *memory) {
+  auto &heap = memory->HookedHeap();
+  if (!heap) {
+    heap = std::make_shared<GuestHeap>();
+  } else if (heap.use_count() > 1) {
+    heap = std::make_shared<GuestHeap>(*heap);
+  }
+  return *heap;
+}
+
+// Map `size` bytes of new read/write memory into `memory`, placed where the
+// emulated `mmap` would place it.
+static uint64_t MapHeapMemory(AddressSpace *memory, uint64_t size) {
+  const auto is_64_bit = 64 == remill::GetTargetArch()->address_size;
+  const auto min_addr = is_64_bit ? k4GiB : k1GiB;
+  const auto max_addr = is_64_bit ? (1ULL << 47ULL) : 0xf7000000ULL;
+  uint64_t addr = 0;
+  if (!memory->FindHole(min_addr, max_addr, size, &addr)) {
+    return 0;
+  }
+  memory->AddMap(addr, size, "[vmill-heap]");
+  memory->SetPermissions(addr, size, true, true, false);
+  return addr;
+}
+
+// Returns the header of `ptr` if it was allocated by the `malloc` hook.
+static bool ReadHeapHeader(AddressSpace *memory, uint64_t ptr,
+                           HeapHeader *header) {
+  return ptr >= kHeapHeaderSize &&
+         memory->TryRead(ptr - kHeapHeaderSize, header, sizeof(HeapHeader)) &&
+         (GetHeapCookie() == header->cookie ||
+          GetFreedHeapCookie() == header->cookie);
+}
+
+// Allocate `size` bytes of guest memory. Returns `0` on failure.
+static uint64_t HeapAllocate(AddressSpace *memory, uint64_t size) {
+  if (size > k1GiB) {
+    return 0;
+  }
+
+  const auto chunk_size = ChunkSize(size);
+  auto &heap = MutableHeap(memory);
+  auto &free_chunks = heap.free_chunks[chunk_size];
+  uint64_t chunk = 0;
+
+  if (chunk_size > kMaxArenaChunkSize) {
+    chunk = MapHeapMemory(memory, chunk_size);
+
+  } else if (!free_chunks.empty()) {
+    chunk = free_chunks.back();
+    free_chunks.pop_back();
+
+  } else {
+    if ((heap.arena_next + chunk_size) > heap.arena_limit) {
+      heap.arena_next = MapHeapMemory(memory, kArenaSize);
+      heap.arena_limit = heap.arena_next + kArenaSize;
+    }
+    if (heap.arena_next) {
+      chunk = heap.arena_next;
+      heap.arena_next += chunk_size;
+    }
+  }
+
+  const HeapHeader header = {size, GetHeapCookie()};
+  if (!chunk || !memory->TryWrite(chunk, &header, sizeof(header))) {
+    return 0;
+  }
+  return chunk + kHeapHeaderSize;
+}
+
+// Free an allocation of the `malloc` hook, described by `header`.
+static void HeapFree(AddressSpace *memory, uint64_t ptr,
+                     const HeapHeader &header) {
+
+  // Double free; let it slide.
+  if (GetFreedHeapCookie() == header.cookie) {
+    return;
+  }
+
+  const auto chunk = ptr - kHeapHeaderSize;
+  const auto chunk_size = ChunkSize(header.size);
+  if (chunk_size > kMaxArenaChunkSize) {
+    memory->RemoveMap(chunk, chunk_size);
+    return;
+  }
+
+  const HeapHeader freed_header = {header.size, GetFreedHeapCookie()};
+  if (memory->TryWrite(chunk, &freed_header, sizeof(freed_header))) {
+    MutableHeap(memory).free_chunks[chunk_size].push_back(chunk);
+  }
+}
+
+// Returns `true` if all `size` bytes at `addr` are readable, or writable if
+// `is_write` is `true`.
+static bool CanAccessAll(AddressSpace *memory, uint64_t addr, uint64_t size,
+                         bool is_write) {
+  if (!size) {
+    return true;
+  }
+  const auto last_page = (addr + size - 1) & kPageMask;
+  for (auto page = addr & kPageMask; ; page += kPageSize) {
+    if (is_write ? !memory->CanWrite(page) : !memory->CanRead(page)) {
+      return false;
+    }
+    if (page == last_page) {
+      return true;
+    }
+  }
+}
+
+// The `memcpy` hook. glibc's `__memcpy_*` variants are often aliases of the
+// `__memmove_*` ones, so this has `memmove` semantics. Re-running the lifted
+// function after a partial copy of disjoint buffers redoes the same copy,
+// and faults at the same place. A partial copy of overlapping buffers would
+// have clobbered some of the source, so those are only copied if they can't
+// fault.
+static bool HookMemcpy(AddressSpace *memory, const uint64_t *args,
+                       uint64_t *ret_val) {
+  const auto dst = args[0];
+  const auto src = args[1];
+  const auto size = args[2];
+  const auto overlaps = (src < dst ? dst - src : src - dst) < size;
+  if (overlaps && (!CanAccessAll(memory, src, size, false) ||
+                   !CanAccessAll(memory, dst, size, true))) {
+    return false;
+  }
+
+  // Copy backward if the end of the source is in the way.
+  const auto num_copied = overlaps && src < dst ?
+      memory->TryCopy(dst + size - 1, src + size - 1, size, 1, true) :
+      memory->TryCopy(dst, src, size, 1, false);
+  if (num_copied != size) {
+    return false;
+  }
+  *ret_val = dst;
+  return true;
+}
+
+static bool HookMemset(AddressSpace *memory, const uint64_t *args,
+                       uint64_t *ret_val) {
+  const auto dst = args[0];
+  const auto val = args[1] & 0xFFULL;
+  const auto size = args[2];
+  if (memory->TryFill(dst, val, size, 1, false) != size) {
+    return false;
+  }
+  *ret_val = dst;
+  return true;
+}
+
+static bool HookStrlen(AddressSpace *memory, const uint64_t *args,
+                       uint64_t *ret_val) {
+  const auto str = args[0];
+  for (auto addr = str; ; ) {
+    if (!memory->CanRead(addr)) {
+      return false;
+    }
+    auto ptr = reinterpret_cast<const uint8_t *>(
+        memory->ToReadOnlyVirtualAddress(addr));
+    if (!ptr) {
+      return false;
+    }
+    const auto num_bytes = kPageSize - (addr & ~kPageMask);
+    if (auto nul = memchr(ptr, 0, num_bytes)) {
+      *ret_val = (addr - str) + static_cast<uint64_t>(
+          reinterpret_cast<const uint8_t *>(nul) - ptr);
+      return true;
+    }
+    addr += num_bytes;
+  }
+}
+
+static bool HookMemcmp(AddressSpace *memory, const uint64_t *args,
+                       uint64_t *ret_val) {
+  const auto addr1 = args[0];
+  const auto addr2 = args[1];
+  const auto size = args[2];
+  const auto num_equal = memory->TryCompare(addr1, addr2, size, 1, false, true);
+  if (num_equal == size) {
+    *ret_val = 0;
+    return true;
+  }
+
+  uint8_t byte1 = 0;
+  uint8_t byte2 = 0;
+  if (!memory->TryRead(addr1 + num_equal, &byte1) ||
+      !memory->TryRead(addr2 + num_equal, &byte2)) {
+    return false;
+  }
+  *ret_val = static_cast<uint64_t>(
+      static_cast<int64_t>(byte1) - static_cast<int64_t>(byte2));
+  return true;
+}
+
+static bool HookMalloc(AddressSpace *memory, const uint64_t *args,
+                       uint64_t *ret_val) {
+  *ret_val = HeapAllocate(memory, args[0]);
+  return 0 != *ret_val;
+}
+
+static bool HookCalloc(AddressSpace *memory, const uint64_t *args,
+                       uint64_t *ret_val) {
+  uint64_t size = 0;
+  if (__builtin_mul_overflow(args[0], args[1], &size)) {
+    return false;
+  }
+  const auto ptr = HeapAllocate(memory, size);
+  if (!ptr || memory->TryFill(ptr, 0, size, 1, false) != size) {
+    return false;
+  }
+  *ret_val = ptr;
+  return true;
+}
+
+// Pointers that weren't allocated by the `malloc` hook are left to the
+// lifted `realloc` and `free`.
+static bool HookRealloc(AddressSpace *memory, const uint64_t *args,
+                        uint64_t *ret_val) {
+  const auto ptr = args[0];
+  const auto size = args[1];
+  if (!ptr) {
+    return HookMalloc(memory, &(args[1]), ret_val);
+  }
+
+  HeapHeader header = {};
+  if (!ReadHeapHeader(memory, ptr, &header) ||
+      GetHeapCookie() != header.cookie) {
+    return false;
+  }
+
+  if (!size) {
+    HeapFree(memory, ptr, header);
+    *ret_val = 0;
+    return true;
+  }
+
+  // Grow or shrink in place.
+  if (ChunkSize(size) == ChunkSize(header.size)) {
+    header.size = size;
+    if (!memory->TryWrite(ptr - kHeapHeaderSize, &header, sizeof(header))) {
+      return false;
+    }
+    *ret_val = ptr;
+    return true;
+  }
+
+  const auto new_ptr = HeapAllocate(memory, size);
+  const auto copy_size = std::min(size, header.size);
+  if (!new_ptr ||
+      memory->TryCopy(new_ptr, ptr, copy_size, 1, false) != copy_size) {
+    return false;
+  }
+  HeapFree(memory, ptr, header);
+  *ret_val = new_ptr;
+  return true;
+}
+
+static bool HookFree(AddressSpace *memory, const uint64_t *args,
+                     uint64_t *ret_val) {
+  const auto ptr = args[0];
+  *ret_val = 0;
+  if (!ptr) {
+    return true;
+  }
+
+  HeapHeader header = {};
+  if (!ReadHeapHeader(memory, ptr, &header)) {
+    return false;
+  }
+  HeapFree(memory, ptr, header);
+  return true;
+}
+
+struct HookInfo {
+  const char *name;  // Name of the guest function.
+  const char *group;  // Name by which the hook is enabled.
+  HookFunction *hook;
+};
+
+static const HookInfo kHooks[] = {
+  {"memcpy", "memcpy", HookMemcpy},
+  {"memset", "memset", HookMemset},
+  {"strlen", "strlen", HookStrlen},
+  {"memcmp", "memcmp", HookMemcmp},
+  {"malloc", "malloc", HookMalloc},
+  {"calloc", "malloc", HookCalloc},
+  {"realloc", "malloc", HookRealloc},
+  {"free", "malloc", HookFree},
+};
+
+// Returns `true` if the symbol `sym_name` names the guest function
+// `func_name`. This includes the CPU-specific variants that glibc selects
+// among with indirect functions, e.g. `__memcpy_avx_unaligned`, but not the
+// fortified variants, e.g. `__memcpy_chk`, which take different arguments.
+static bool IsSymbolOfFunction(const std::string &sym_name,
+                               const std::string &func_name) {
+  if (sym_name == func_name) {
+    return true;
+  }
+  const auto prefix = "__" + func_name + "_";
+  return !sym_name.compare(0, prefix.size(), prefix) &&
+         std::string::npos == sym_name.find("_chk");
+}
+
+// Returns the enabled hook for the symbol `sym_name`, if any.
+static HookFunction *FindHook(const std::string &sym_name) {
+  static std::unordered_set<std::string> enabled_groups;
+  static bool parsed_flag = false;
+  if (!parsed_flag) {
+    for (const auto &group : SplitPathList(FLAGS_hooks, ',')) {
+      enabled_groups.insert(group);
+    }
+    parsed_flag = true;
+  }
+
+  for (const auto &info : kHooks) {
+    if (enabled_groups.count(info.group) &&
+        IsSymbolOfFunction(sym_name, info.name)) {
+      return info.hook;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+// The symbol values are virtual addresses in the ELF file, which are biased
+// by wherever the file's segments were loaded. The bias is recovered from the
+// segment containing `offset`.
+void FindHookedFunctions(const std::string &path, uint64_t base,
+                         uint64_t limit, uint64_t offset, HookMap &hooks) {
+  if (FLAGS_hooks.empty()) {
+    return;
+  }
+
+  ELFIO::elfio elf;
+  if (!elf.load(path)) {
+    LOG(WARNING)
+        << "Unable to load ELF file " << path << " to look for hooked "
+        << "functions";
+    return;
+  }
+
+  auto found_bias = false;
+  uint64_t bias = 0;
+  for (auto segment : elf.segments) {
+    const auto seg_offset = static_cast<uint64_t>(segment->get_offset());
+    const auto seg_size = static_cast<uint64_t>(segment->get_file_size());
+    if (PT_LOAD == segment->get_type() && seg_offset <= offset &&
+        offset < (seg_offset + seg_size)) {
+      bias = base - (segment->get_virtual_address() + (offset - seg_offset));
+      found_bias = true;
+      break;
+    }
+  }
+
+  if (!found_bias) {
+    return;
+  }
+
+  for (auto section : elf.sections) {
+    if (SHT_SYMTAB != section->get_type() &&
+        SHT_DYNSYM != section->get_type()) {
+      continue;
+    }
+
+    ELFIO::symbol_section_accessor symbols(elf, section);
+    for (ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); ++i) {
+      std::string name;
+      ELFIO::Elf64_Addr value = 0;
+      ELFIO::Elf_Xword size = 0;
+      unsigned char bind = 0;
+      unsigned char type = 0;
+      ELFIO::Elf_Half section_index = 0;
+      unsigned char other = 0;
+      if (!symbols.get_symbol(i, name, value, size, bind, type,
+                              section_index, other) ||
+          STT_FUNC != type || SHN_UNDEF == section_index) {
+        continue;
+      }
+
+      const auto addr = static_cast<uint64_t>(value) + bias;
+      if (addr < base || addr >= limit) {
+        continue;
+      }
+
+      if (auto hook = FindHook(name)) {
+        LOG(INFO)
+            << "Hooking " << name << " at " << std::hex << addr << std::dec
+            << " in " << path;
+        hooks[addr] = hook;
+      }
+    }
+  }
+}
+
+}  // namespace vmill
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_EXECUTOR_HOOKS_H_
+#define VMILL_EXECUTOR_HOOKS_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace vmill {
+
+class AddressSpace;
+
+enum : size_t {
+  kMaxNumHookArgs = 3
+};
+
+// A native implementation of a guest function, e.g. `memcpy`. Hooks are
+// given the integer arguments of the call, and return `false` if they can't
+// handle the call, in which case the guest function runs as lifted code.
+// A hook that returns `false` may only leave behind side effects that the
+// guest function would have had anyway.
+using HookFunction = bool(AddressSpace *memory, const uint64_t *args,
+                          uint64_t *ret_val);
+
+// Maps the entry PCs of hooked guest functions to their hooks.
+using HookMap = std::unordered_map<uint64_t, HookFunction *>;
+
+// Find the functions with enabled hooks among the ELF symbols of the file
+// `path`, whose bytes at `offset` are mapped into guest memory in
+// `[base, limit)`.
+void FindHookedFunctions(const std::string &path, uint64_t base,
+                         uint64_t limit, uint64_t offset, HookMap &hooks);
+
+}  // namespace vmill
+
+#endif  // VMILL_EXECUTOR_HOOKS_H_
@@ -43,7 +43,8 @@ int liballoc_unlock() {
 }
 
 void *liballoc_alloc(int num_pages) {
-  auto alloc = gRuntimeHeap.Allocate(static_cast<size_t>(num_pages * 4096));
+  auto alloc = gRuntimeHeap.Allocate(static_cast<size_t>(num_pages * 4096),
+                                     false /* zeroed */);
   return alloc.base;
 }
 
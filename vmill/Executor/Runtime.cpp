@@ -20,6 +20,7 @@
 #include <cfenv>
 #include <cstdarg>
 #include <cstdio>
+#include <cstring>
 #include <ostream>
 
 #include "remill/Arch/Name.h"
@@ -199,6 +200,10 @@ MAKE_MEM_FAULT(read, f32, 4, kMemoryAccessFaultOnRead,
                kMemoryValueTypeFloatingPoint)
 MAKE_MEM_FAULT(read, f64, 8, kMemoryAccessFaultOnRead,
                kMemoryValueTypeFloatingPoint)
+MAKE_MEM_FAULT(read, 128, 16, kMemoryAccessFaultOnRead,
+               kMemoryValueTypeVector)
+MAKE_MEM_FAULT(read, 256, 32, kMemoryAccessFaultOnRead,
+               kMemoryValueTypeVector)
 
 MAKE_MEM_FAULT(write, 8, 1, kMemoryAccessFaultOnWrite,
                kMemoryValueTypeInteger)
@@ -212,8 +217,28 @@ MAKE_MEM_FAULT(write, f32, 4, kMemoryAccessFaultOnWrite,
                kMemoryValueTypeFloatingPoint)
 MAKE_MEM_FAULT(write, f64, 8, kMemoryAccessFaultOnWrite,
                kMemoryValueTypeFloatingPoint)
+MAKE_MEM_FAULT(write, 128, 16, kMemoryAccessFaultOnWrite,
+               kMemoryValueTypeVector)
+MAKE_MEM_FAULT(write, 256, 32, kMemoryAccessFaultOnWrite,
+               kMemoryValueTypeVector)
 #undef MAKE_MEM_FAULT
 
+// Records the first fault of lifted code that directly accessed host-mapped
+// memory, if any. Returns `true` if there was such a fault. The size of the
+// faulting access isn't known, so it's recorded as a 1-byte access.
+bool __vmill_record_host_fault(AddressSpace *memory) {
+  uint64_t addr = 0;
+  bool is_write = false;
+  if (likely(!memory->TakeHostFault(&addr, &is_write))) {
+    return false;
+  }
+  if (is_write) {
+    __vmill_record_write_fault_8(addr);
+  } else {
+    __vmill_record_read_fault_8(addr);
+  }
+  return true;
+}
 
 #define MAKE_MEM_READ(ret_type, read_type, suffix, read_size, vtype) \
     __attribute__((hot)) \
@@ -243,8 +268,20 @@ extern uint8_t __remill_read_memory_64(AddressSpace *, uint64_t);
 
 MAKE_MEM_READ(float, float, f32, 4, kMemoryValueTypeFloatingPoint)
 MAKE_MEM_READ(double, double, f64, 8, kMemoryValueTypeFloatingPoint)
+MAKE_MEM_READ(uint128_t, uint128_t, 128, 16, kMemoryValueTypeVector)
 #undef MAKE_MEM_READ
 
+// There is no calling convention for 32-byte integers, so these values are
+// passed by reference.
+__attribute__((hot))
+void __remill_read_memory_256(
+    AddressSpace *memory, uint64_t addr, uint256_t *val) {
+  if (unlikely(!memory->TryRead(addr, val))) {
+    memset(val, 0, sizeof(uint256_t));
+    __vmill_record_read_fault_256(addr);
+  }
+}
+
 double __remill_read_memory_f80(
     AddressSpace *memory, uint64_t addr) {
   uint8_t data[sizeof(long double)] = {};
@@ -312,9 +349,19 @@ void __make_asm_funcs_used__(void) {
 
 MAKE_MEM_WRITE(float, float, f32, 4, kMemoryValueTypeFloatingPoint)
 MAKE_MEM_WRITE(double, double, f64, 8, kMemoryValueTypeFloatingPoint)
+MAKE_MEM_WRITE(uint128_t, uint128_t, 128, 16, kMemoryValueTypeVector)
 
 #undef MAKE_MEM_WRITE
 
+__attribute__((hot))
+AddressSpace *__remill_write_memory_256(
+    AddressSpace *memory, uint64_t addr, const uint256_t *val) {
+  if (unlikely(!memory->TryWrite(addr, *val))) {
+    __vmill_record_write_fault_256(addr);
+  }
+  return memory;
+}
+
 AddressSpace *__remill_write_memory_f80(
     AddressSpace *memory, uint64_t addr, double val) {
   auto long_val = static_cast<long double>(val);
@@ -335,6 +382,37 @@ AddressSpace *__remill_write_memory_f80(
   return memory;
 }
 
+// Bulk versions of repeated string instructions, e.g. x86's `rep movsb`.
+// These store the number of elements processed into `num_done`, and stop
+// before the first element that would fault. Lifted code then runs the
+// instruction's own semantics on the remaining elements, so that faults and
+// partially completed instructions are handled exactly as before.
+__attribute__((hot))
+AddressSpace *__vmill_memory_copy(
+    AddressSpace *memory, uint64_t dst, uint64_t src, uint64_t count,
+    uint64_t size, uint32_t backward, uint64_t *num_done) {
+  *num_done = memory->TryCopy(dst, src, count, size, !!backward);
+  return memory;
+}
+
+__attribute__((hot))
+AddressSpace *__vmill_memory_fill(
+    AddressSpace *memory, uint64_t dst, uint64_t val, uint64_t count,
+    uint64_t size, uint32_t backward, uint64_t *num_done) {
+  *num_done = memory->TryFill(dst, val, count, size, !!backward);
+  return memory;
+}
+
+__attribute__((hot))
+AddressSpace *__vmill_memory_compare(
+    AddressSpace *memory, uint64_t addr1, uint64_t addr2, uint64_t count,
+    uint64_t size, uint32_t backward, uint32_t while_equal,
+    uint64_t *num_done) {
+  *num_done = memory->TryCompare(
+      addr1, addr2, count, size, !!backward, !!while_equal);
+  return memory;
+}
+
 void __vmill_set_location(PC pc, vmill::TaskStopLocation loc) {
   gTask->pc = pc;
   gTask->location = loc;
@@ -407,6 +485,18 @@ Memory *__remill_function_return(ArchState *, PC pc, Memory *memory) {
   return memory;
 }
 
+// Stands in for the lifted code of a guest function that has a native hook.
+// If the hook handles the call then this returns to the caller as if the
+// guest function had run, otherwise it runs the lifted guest function.
+Memory *__vmill_run_hook(ArchState *state, PC pc, Memory *memory) {
+  gTask->pc = pc;
+  if (auto lifted_func = gExecutor->RunHook(gTask, pc)) {
+    return lifted_func(state, pc, memory);
+  }
+  gTask->location = kTaskStoppedAtReturnTarget;
+  return memory;
+}
+
 uint8_t __remill_undefined_8(void) {
   return 0;
 }
@@ -500,6 +590,8 @@ void __vmill_execute(Task *task, LiftedFunction *lifted_func) {
   task->fpu_rounding_mode = std::fegetround();
   std::fesetround(native_rounding);
 
+  __vmill_record_host_fault(memory);
+
   task->last_pc = pc;
 
   const auto &fault = task->mem_access_fault;
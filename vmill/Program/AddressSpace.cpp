@@ -18,6 +18,7 @@
 #include <glog/logging.h>
 
 #include <algorithm>
+#include <cstring>
 #include <iomanip>
 #include <limits>
 #include <new>
@@ -36,6 +37,15 @@ DECLARE_bool(verbose);
 DEFINE_bool(version_code, false,
             "Use code versioning to track self-modifying code.");
 
+DEFINE_bool(host_mapped_memory, false,
+            "Map the memory of 32-bit guests into the host address space, so "
+            "that lifted code accesses guest memory with plain host loads and "
+            "stores. Ignored with --version_code.");
+
+DEFINE_bool(inline_tlb, true,
+            "Check a software TLB inline in lifted code before calling into "
+            "the runtime to access guest memory.");
+
 // static FILE *OpenReadAddrs(void) {
 //   return fopen("/tmp/read_addrs", "w");
 // }
@@ -48,7 +58,10 @@ namespace {
 enum : uint64_t {
   kPageSize = 4096ULL,
   kPageShift = (kPageSize - 1ULL),
-  kPageMask = ~kPageShift
+  kPageMask = ~kPageShift,
+
+  // Never matches, as the page of an access has its low bits clear.
+  kInvalidTLBTag = ~0ULL
 };
 
 static constexpr inline uint64_t AlignDownToPage(uint64_t addr) {
@@ -59,6 +72,37 @@ static constexpr inline uint64_t RoundUpToPage(uint64_t size) {
   return (size + kPageShift) & kPageMask;
 }
 
+// Returns the number of whole `size`-byte elements, starting with the one at
+// `addr`, that are on the same page as `addr`. Successive elements go down in
+// memory if `backward` is `true`.
+static uint64_t NumElementsOnPage(uint64_t addr, uint64_t size,
+                                  bool backward) {
+  const auto page_addr = AlignDownToPage(addr);
+  if (AlignDownToPage(addr + size - 1) != page_addr) {
+    return 0;
+  } else if (backward) {
+    return (addr - page_addr) / size + 1;
+  } else {
+    return (page_addr + kPageSize - addr) / size;
+  }
+}
+
+// Returns the lowest address of `num_elems` elements starting at `addr`.
+static uint64_t LowestAddress(uint64_t addr, uint64_t num_elems,
+                              uint64_t size, bool backward) {
+  return backward ? addr - ((num_elems - 1) * size) : addr;
+}
+
+// The first address space gets the default data version, which keeps the
+// code versions in the index of prior runs meaningful.
+static uint64_t gNextDataVersion = 0;
+
+// Tags given to the ranges that an address space has made private. Zero is
+// the tag of ranges that no address space has claimed.
+static uint64_t gNextOwnerId = 1;
+
+static constexpr uint64_t kUnknownNumSharedRanges = ~0ULL;
+
 static uint64_t GetAddressMask(void) {
   const auto arch = remill::GetTargetArch();
   if (arch->address_size == 32) {
@@ -71,56 +115,285 @@ static uint64_t GetAddressMask(void) {
 }  // namespace
 
 AddressSpace::AddressSpace(void)
-    : page_to_map(256),
-      wnx_page_to_map(256),
+    : window(HostMappingEnabled() ? HostWindow::Create() : nullptr),
       min_addr(std::numeric_limits<uint64_t>::max()),
       addr_mask(GetAddressMask()),
       invalid(MappedRange::CreateInvalid(0, addr_mask)),
+      pages(addr_mask),
+      trace_heads(std::make_shared<TraceHeadSet>()),
+      data_version(gNextDataVersion++),
+      trace_data_versions(std::make_shared<TraceVersionMap>()),
+      folded_data(std::make_shared<FoldedData>()),
+      owner_id(gNextOwnerId++),
+      num_shared_ranges(0),
+      ranges_are_shared(false),
+      layout_changed(false),
       is_dead(false) {
-  maps.push_back(invalid);
-  CreatePageToRangeMap();
+  host_base = window ? window->GuestView() : nullptr;
+  maps = std::make_shared<RangeMap>();
+  (*maps)[0] = invalid;
+  gaps.Release(0, addr_mask);
+  MapsChanged();
+  FlushTLB();
 }
 
 AddressSpace::AddressSpace(const AddressSpace &parent)
-    : maps(parent.maps.size()),
-      page_to_map(parent.page_to_map.size()),
-      wnx_page_to_map(parent.wnx_page_to_map.size()),
-      min_addr(parent.min_addr),
+    : gaps(parent.gaps),
       addr_mask(parent.addr_mask),
       invalid(parent.invalid),
-      page_is_readable(parent.page_is_readable),
-      page_is_writable(parent.page_is_writable),
-      page_is_executable(parent.page_is_executable),
-      trace_heads(parent.trace_heads),
-      is_dead(parent.is_dead) {
-
-  unsigned i = 0;
-  for (const auto &range : parent.maps) {
-    if (range->IsValid()) {
-      maps[i++] = range->Clone();
-    } else {
-      maps[i++] = range;
+      pages(parent.pages) {
+  CloneFrom(parent);
+}
+
+void AddressSpace::CloneFrom(const AddressSpace &parent) {
+  gaps = parent.gaps;
+  min_addr = parent.min_addr;
+  pages = parent.pages;
+  trace_heads = parent.trace_heads;
+  heap = parent.heap;
+  data_version = parent.data_version;
+  trace_data_versions = parent.trace_data_versions;
+  folded_data = parent.folded_data;
+  dirty_pages.clear();
+  protection_changes.clear();
+  layout_changed = false;
+  is_dead = parent.is_dead;
+
+  // The parent's TLB might point to memory that is now shared with us.
+  parent.FlushTLB();
+
+  // Host-mapped memory can't be shared copy-on-write, so copy it eagerly.
+  // Our old window, if any, goes first, as the number of windows is limited.
+  window.reset();
+  if (parent.window) {
+    window = HostWindow::Create();
+    host_base = window->GuestView();
+    window->CopyFrom(*(parent.window));
+  } else {
+    host_base = nullptr;
+  }
+
+  owner_id = gNextOwnerId++;
+  num_shared_ranges = window ? 0 : kUnknownNumSharedRanges;
+  ranges_are_shared = !window;
+
+  // The ranges themselves are shared until one of us writes to them, at
+  // which point the writer clones the range (see `PrepareToWrite`).
+  if (!window) {
+    maps = parent.maps;
+    parent.ranges_are_shared = true;
+    parent.owner_id = gNextOwnerId++;
+    parent.num_shared_ranges = kUnknownNumSharedRanges;
+
+  } else {
+    maps = std::make_shared<RangeMap>();
+    for (const auto &entry : *(parent.maps)) {
+      const auto &range = entry.second;
+      if (!range->IsValid()) {
+        maps->emplace_hint(maps->end(), entry.first, range);
+
+      } else {
+        const auto base = range->BaseAddress();
+        const auto limit = range->LimitAddress();
+        maps->emplace_hint(
+            maps->end(), entry.first,
+            MappedRange::CreateHostMapped(base, limit, range->Name(),
+                                          range->Offset(),
+                                          window->RuntimeView()));
+        ProtectHostPages(base, limit);
+      }
     }
   }
 
-  CreatePageToRangeMap();
+  MapsChanged();
+  FlushTLB();
 }
 
 void AddressSpace::MarkAsTraceHead(PC pc) {
-  trace_heads.insert(static_cast<uint64_t>(pc));
+  if (trace_heads.use_count() > 1) {
+    trace_heads = std::make_shared<TraceHeadSet>(*trace_heads);
+  }
+  trace_heads->insert(static_cast<uint64_t>(pc));
 }
 
 bool AddressSpace::IsMarkedTraceHead(PC pc) const {
-  return 0 != trace_heads.count(static_cast<uint64_t>(pc));
+  return 0 != trace_heads->count(static_cast<uint64_t>(pc));
+}
+
+bool AddressSpace::CanFoldData(uint64_t addr) const {
+  const auto page_addr = AlignDownToPage(addr & addr_mask);
+  return CanReadAligned(page_addr) && !CanWriteAligned(page_addr) &&
+         !folded_data->unfoldable_pages.count(page_addr);
+}
+
+void AddressSpace::MarkAsFoldedData(uint64_t addr, PC pc) {
+  folded_data->folded_pages[AlignDownToPage(addr & addr_mask)].insert(
+      static_cast<uint64_t>(pc));
+}
+
+std::shared_ptr<GuestHeap> &AddressSpace::HookedHeap(void) {
+  return heap;
 }
 
 // Clear out the contents of this address space.
 void AddressSpace::Kill(void) {
-  maps.clear();
-  page_to_map.clear();
+  maps = std::make_shared<RangeMap>();
+  gaps.Clear();
+  pages.Clear();
+  window.reset();
+  heap.reset();
+  host_base = nullptr;
+  ranges_are_shared = false;
+  num_shared_ranges = 0;
   is_dead = true;
+  layout_changed = true;
   memset(last_map_cache, 0, sizeof(last_map_cache));
   memset(wnx_last_map_cache, 0, sizeof(wnx_last_map_cache));
+  FlushTLB();
+}
+
+// Sets every tag to `kInvalidTLBTag`.
+void AddressSpace::FlushTLB(void) const {
+  memset(tlb, 0xFF, sizeof(tlb));
+}
+
+// Invalidates the entries of the pages in `[base, limit)`.
+void AddressSpace::FlushTLB(uint64_t base, uint64_t limit) const {
+  for (auto &entry : tlb) {
+    if ((base <= entry.read_tag && entry.read_tag < limit) ||
+        (base <= entry.write_tag && entry.write_tag < limit)) {
+      entry.read_tag = kInvalidTLBTag;
+      entry.write_tag = kInvalidTLBTag;
+    }
+  }
+}
+
+// Copy-on-write ranges only copy the page being written to, but an empty
+// range replaces the memory behind all of its pages, so we flush the entries
+// of the whole range either way.
+MappedRange &AddressSpace::PrepareToWrite(MappedRange &range_,
+                                          uint64_t addr) {
+  auto &range = unlikely(ranges_are_shared) ? PrivateRange(range_) : range_;
+  if (unlikely(range.IsCopyOnWrite(addr))) {
+    FlushTLB(range.BaseAddress(), range.LimitAddress());
+  }
+  if (unlikely(checkpoint != nullptr)) {
+    dirty_pages.insert(AlignDownToPage(addr));
+  }
+  return range;
+}
+
+// Ranges that are still shared with another address space are cloned, and
+// the clone replaces the range in our maps. Either way, the range is tagged
+// with our `owner_id`, so only the first write to each range after a fork
+// looks it up, and once all of our ranges are tagged, writes stop checking.
+MappedRange &AddressSpace::PrivateRange(MappedRange &range) {
+  if (!ranges_are_shared || range.OwnerId() == owner_id ||
+      !range.IsValid()) {
+    return range;
+  }
+
+  auto &ranges = MutableMaps();
+  if (num_shared_ranges == kUnknownNumSharedRanges) {
+    num_shared_ranges = NumSharedRanges(
+        0, std::numeric_limits<uint64_t>::max());
+  }
+
+  auto &map = ranges[range.BaseAddress()];
+  DCHECK(map.get() == &range);
+  if (map.use_count() > 1) {
+    map = map->Clone();
+    MapsChanged();
+    FlushTLB(map->BaseAddress(), map->LimitAddress());
+  }
+
+  map->SetOwnerId(owner_id);
+  DCHECK(num_shared_ranges != 0);
+  if (!--num_shared_ranges) {
+    ranges_are_shared = false;
+  }
+  return *map;
+}
+
+uint64_t AddressSpace::NumSharedRanges(uint64_t base, uint64_t limit) const {
+  if (!ranges_are_shared) {
+    return 0;
+  }
+  uint64_t num_ranges = 0;
+  for (auto it = maps->lower_bound(base);
+       it != maps->end() && it->first < limit; ++it) {
+    if (it->second->IsValid() && it->second->OwnerId() != owner_id) {
+      num_ranges++;
+    }
+  }
+  return num_ranges;
+}
+
+// The new ranges were created by us, so they aren't shared, but we must tag
+// them so that `PrivateRange` doesn't count them again.
+void AddressSpace::ClaimNewRanges(uint64_t base, uint64_t limit,
+                                  uint64_t num_replaced) {
+  if (!ranges_are_shared) {
+    return;
+  }
+  for (auto it = maps->lower_bound(base);
+       it != maps->end() && it->first < limit; ++it) {
+    it->second->SetOwnerId(owner_id);
+  }
+  if (num_shared_ranges != kUnknownNumSharedRanges) {
+    num_shared_ranges -= num_replaced;
+    if (!num_shared_ranges) {
+      ranges_are_shared = false;
+    }
+  }
+}
+
+// Our maps are shared with the address spaces we were cloned from or into,
+// until one of them changes its maps.
+AddressSpace::RangeMap &AddressSpace::MutableMaps(void) {
+  if (maps.use_count() > 1) {
+    maps = std::make_shared<RangeMap>(*maps);
+  }
+  return *maps;
+}
+
+void AddressSpace::FillReadTLB(uint64_t addr, MappedRange &range) {
+  const auto page_addr = AlignDownToPage(addr);
+  if (!FLAGS_inline_tlb || !CanReadAligned(page_addr)) {
+    return;
+  }
+
+  // E.g. the pages of an `EmptyMemoryMap` all share one small zero buffer.
+  auto page = reinterpret_cast<const uint8_t *>(
+      range.ToReadOnlyVirtualAddress(page_addr));
+  auto page_end = reinterpret_cast<const uint8_t *>(
+      range.ToReadOnlyVirtualAddress(page_addr + kPageShift));
+  if (!page || (page + kPageShift) != page_end) {
+    return;
+  }
+
+  auto &entry = tlb[(page_addr >> kTLBPageShift) & kTLBIndexMask];
+  if (entry.write_tag != page_addr) {
+    entry.write_tag = kInvalidTLBTag;
+  }
+  entry.read_tag = page_addr;
+  entry.host_delta = reinterpret_cast<uintptr_t>(page) - page_addr;
+}
+
+// Only called after a successful write, which will have made the memory of
+// the written range private to this address space.
+void AddressSpace::FillWriteTLB(uint64_t addr, void *host_addr) {
+  const auto page_addr = AlignDownToPage(addr);
+  if (!FLAGS_inline_tlb || !CanWriteAligned(page_addr) ||
+      CanExecuteAligned(page_addr)) {
+    return;
+  }
+
+  auto &entry = tlb[(page_addr >> kTLBPageShift) & kTLBIndexMask];
+  entry.read_tag = CanReadAligned(page_addr) ? page_addr :
+                                                kInvalidTLBTag;
+  entry.write_tag = page_addr;
+  entry.host_delta = reinterpret_cast<uintptr_t>(host_addr) - addr;
 }
 
 // Returns `true` if this address space is "dead".
@@ -128,28 +401,130 @@ bool AddressSpace::IsDead(void) const {
   return is_dead;
 }
 
+// The checkpoint is a clone, so taking it is cheap, and our ranges are shared
+// with it until we write to them. Cloning also flushes our TLB, so every page
+// that is written to from now on goes through `PrepareToWrite` at least once.
+void AddressSpace::Checkpoint(void) {
+  checkpoint.reset(new AddressSpace(*this));
+  dirty_pages.clear();
+  protection_changes.clear();
+  layout_changed = false;
+}
+
+// Lifted code writes straight into host-mapped memory, so those writes can't
+// be tracked, and changes to the maps can't be undone page by page. In both
+// cases, this address space is rebuilt as a new clone of the checkpoint.
+// Otherwise, the written pages and the changed page permissions are restored
+// in place, along with the state derived from them.
+void AddressSpace::RestoreCheckpoint(void) {
+  CHECK(checkpoint != nullptr)
+      << "Trying to restore an address space that has no checkpoint.";
+
+  if (unlikely(window || layout_changed)) {
+    CloneFrom(*checkpoint);
+    return;
+  }
+
+  // Only code lifted from executable pages can depend on the restored bytes.
+  for (auto page_addr : dirty_pages) {
+    auto &saved_range = checkpoint->RangeContaining(page_addr);
+    auto &range = PrivateRange(RangeContaining(page_addr));
+    auto saved_page = saved_range.ToReadOnlyVirtualAddress(page_addr);
+    if (!saved_page || !range.IsValid()) {
+      continue;
+    }
+    memcpy(range.ToReadWriteVirtualAddress(page_addr), saved_page, kPageSize);
+    if (CanExecuteAligned(page_addr) ||
+        checkpoint->CanExecuteAligned(page_addr)) {
+      range.InvalidateCodeVersion();
+    }
+  }
+
+  for (const auto &change : protection_changes) {
+    for (auto page_addr = change.first; page_addr < change.second;
+         page_addr += kPageSize) {
+      pages.SetPermissions(page_addr, page_addr + kPageSize,
+                           checkpoint->pages.Find(page_addr));
+    }
+  }
+
+  dirty_pages.clear();
+  protection_changes.clear();
+  data_version = checkpoint->data_version;
+  trace_data_versions = checkpoint->trace_data_versions;
+  folded_data = checkpoint->folded_data;
+  trace_heads = checkpoint->trace_heads;
+  heap = checkpoint->heap;
+
+  // Write entries of the TLB would let writes to the restored pages go
+  // untracked.
+  FlushTLB();
+  memset(last_map_cache, 0, sizeof(last_map_cache));
+  memset(wnx_last_map_cache, 0, sizeof(wnx_last_map_cache));
+}
+
+// Writes through the host mapping don't invalidate code versions.
+bool AddressSpace::HostMappingEnabled(void) {
+  return FLAGS_host_mapped_memory && !FLAGS_version_code &&
+         GetAddressMask() == 0xFFFFFFFFULL;
+}
+
+bool AddressSpace::TakeHostFault(uint64_t *addr, bool *is_write) {
+  if (likely(!window)) {
+    return false;
+  }
+
+  std::vector<uint64_t> pages;
+  if (likely(!window->TakeFault(addr, is_write, &pages))) {
+    return false;
+  }
+
+  for (auto page_addr : pages) {
+    ProtectHostPages(page_addr, page_addr + kPageSize);
+  }
+  return true;
+}
+
+void AddressSpace::ProtectHostPages(uint64_t base, uint64_t limit) {
+  auto run_base = base;
+  for (auto addr = base; addr < limit; addr += kPageSize) {
+    const auto next_addr = addr + kPageSize;
+    const auto can_read = CanReadAligned(addr);
+    const auto can_write = CanWriteAligned(addr);
+    if (next_addr == limit || can_read != CanReadAligned(next_addr) ||
+        can_write != CanWriteAligned(next_addr)) {
+      window->Protect(run_base, next_addr - run_base, can_read, can_write);
+      run_base = next_addr;
+    }
+  }
+}
+
 bool AddressSpace::CanRead(uint64_t addr) const {
-  return page_is_readable.count(AlignDownToPage(addr & addr_mask));
+  return CanReadAligned(AlignDownToPage(addr & addr_mask));
 }
 
 bool AddressSpace::CanWrite(uint64_t addr) const {
-  return page_is_writable.count(AlignDownToPage(addr & addr_mask));
+  return CanWriteAligned(AlignDownToPage(addr & addr_mask));
 }
 
 bool AddressSpace::CanExecute(uint64_t addr) const {
-  return page_is_executable.count(AlignDownToPage(addr & addr_mask));
+  return CanExecuteAligned(AlignDownToPage(addr & addr_mask));
+}
+
+bool AddressSpace::CanWriteAll(uint64_t addr, uint64_t size) const {
+  return CanWrite(addr) && CanWrite(addr + size - 1);
 }
 
 bool AddressSpace::CanReadAligned(uint64_t addr) const {
-  return page_is_readable.count(addr);
+  return 0 != (pages.Find(addr) & kPageIsReadable);
 }
 
 bool AddressSpace::CanWriteAligned(uint64_t addr) const {
-  return page_is_writable.count(addr);
+  return 0 != (pages.Find(addr) & kPageIsWritable);
 }
 
 bool AddressSpace::CanExecuteAligned(uint64_t addr) const {
-  return page_is_executable.count(addr);
+  return 0 != (pages.Find(addr) & kPageIsExecutable);
 }
 
 bool AddressSpace::TryRead(uint64_t addr_, void *val_out, size_t size) {
@@ -184,14 +559,14 @@ bool AddressSpace::TryWrite(uint64_t addr_, const void *val, size_t size) {
       return false;
     }
 
-    auto &range = FindRangeAligned(page_addr);
+    auto &range = PrepareToWrite(FindRangeAligned(page_addr), page_addr);
     if (FLAGS_version_code && CanExecuteAligned(page_addr)) {
 
       // TODO(pag): remove cache entries associated with this range
       // TODO(pag): Split the range?
 
       range.InvalidateCodeVersion();
-      trace_heads.clear();
+      trace_heads = std::make_shared<TraceHeadSet>();
     }
 
     auto page_end_addr = page_addr + kPageSize;
@@ -209,15 +584,22 @@ bool AddressSpace::TryWrite(uint64_t addr_, const void *val, size_t size) {
 // Read/write a byte to memory.
 bool AddressSpace::TryRead(uint64_t addr_, uint8_t *val_out) {
   const auto addr = addr_ & addr_mask;
-  return FindRange(addr).Read(addr, val_out);
+  auto &range = FindRange(addr);
+  if (unlikely(!range.Read(addr, val_out))) {
+    return false;
+  }
+  FillReadTLB(addr, range);
+  return true;
 }
 
+// The values are copied with `memcpy` because guest addresses need not be
+// aligned, and the vector-width types would otherwise be accessed with
+// aligned vector instructions.
 #define MAKE_TRY_READ(type) \
     bool AddressSpace::TryRead(uint64_t addr_, type *val_out) { \
       const auto addr = addr_ & addr_mask; \
       auto &range = FindRange(addr); \
-      auto ptr = reinterpret_cast<const type *>( \
-          range.ToReadOnlyVirtualAddress(addr)); \
+      auto ptr = range.ToReadOnlyVirtualAddress(addr); \
       if (unlikely(ptr == nullptr)) { \
         return false; \
       } \
@@ -225,7 +607,8 @@ bool AddressSpace::TryRead(uint64_t addr_, uint8_t *val_out) {
       if (likely(range.BaseAddress() <= addr && \
                  end_addr < range.LimitAddress())) { \
         if (likely(AlignDownToPage(addr) == AlignDownToPage(end_addr))) { \
-          *val_out = *ptr; \
+          memcpy(val_out, ptr, sizeof(type)); \
+          FillReadTLB(addr, range); \
           return true; \
         } \
       } \
@@ -237,12 +620,16 @@ MAKE_TRY_READ(uint32_t)
 MAKE_TRY_READ(uint64_t)
 MAKE_TRY_READ(float)
 MAKE_TRY_READ(double)
+MAKE_TRY_READ(uint128_t)
+MAKE_TRY_READ(uint256_t)
 
 #undef MAKE_TRY_READ
 
 bool AddressSpace::TryWrite(uint64_t addr_, uint8_t val) {
   const auto addr = addr_ & addr_mask;
-  if (likely(FindWNXRange(addr).Write(addr, val))) {
+  auto &range = PrepareToWrite(FindWNXRange(addr), addr);
+  if (likely(range.Write(addr, val))) {
+    FillWriteTLB(addr, range.ToReadWriteVirtualAddress(addr));
     return true;
   } else {
     return TryWrite(addr, &val, sizeof(val));
@@ -252,15 +639,15 @@ bool AddressSpace::TryWrite(uint64_t addr_, uint8_t val) {
 #define MAKE_TRY_WRITE(type) \
     bool AddressSpace::TryWrite(uint64_t addr_, type val) { \
       const auto addr = addr_ & addr_mask; \
-      auto &range = FindWNXRange(addr); \
-      auto ptr = reinterpret_cast<type *>( \
-          range.ToReadWriteVirtualAddress(addr)); \
+      auto &range = PrepareToWrite(FindWNXRange(addr), addr); \
+      auto ptr = range.ToReadWriteVirtualAddress(addr); \
       if (likely(ptr != nullptr)) { \
         const auto end_addr = addr + sizeof(type) - 1; \
         if (likely(range.BaseAddress() <= addr && \
                    end_addr < range.LimitAddress())) { \
           if (likely(AlignDownToPage(addr) == AlignDownToPage(end_addr))) { \
-            *ptr = val; \
+            memcpy(ptr, &val, sizeof(type)); \
+            FillWriteTLB(addr, ptr); \
             return true; \
           } \
         } \
@@ -275,12 +662,193 @@ MAKE_TRY_WRITE(uint32_t)
 MAKE_TRY_WRITE(uint64_t)
 MAKE_TRY_WRITE(float)
 MAKE_TRY_WRITE(double)
+MAKE_TRY_WRITE(uint128_t)
+MAKE_TRY_WRITE(uint256_t)
 #undef MAKE_TRY_WRITE
 
+const uint8_t *AddressSpace::ToReadOnlyChunk(uint64_t addr, uint64_t size) {
+  auto &range = FindRange(addr);
+  const auto end_addr = addr + size - 1;
+  if (range.BaseAddress() <= addr && end_addr < range.LimitAddress() &&
+      AlignDownToPage(addr) == AlignDownToPage(end_addr)) {
+    return reinterpret_cast<const uint8_t *>(
+        range.ToReadOnlyVirtualAddress(addr));
+  }
+  return nullptr;
+}
+
+uint8_t *AddressSpace::ToReadWriteChunk(uint64_t addr, uint64_t size) {
+  auto &range = PrepareToWrite(FindWNXRange(addr), addr);
+  const auto end_addr = addr + size - 1;
+  if (range.BaseAddress() <= addr && end_addr < range.LimitAddress() &&
+      AlignDownToPage(addr) == AlignDownToPage(end_addr)) {
+    return reinterpret_cast<uint8_t *>(range.ToReadWriteVirtualAddress(addr));
+  }
+  return nullptr;
+}
+
+// Elements that straddle pages, or that are on executable pages, go through
+// the slow path one at a time. Those writes are only attempted if the whole
+// element is writable, so that a faulting element is never partially written.
+uint64_t AddressSpace::TryCopy(uint64_t dst, uint64_t src, uint64_t count,
+                               uint64_t size, bool backward) {
+  uint8_t val[sizeof(uint64_t)];
+  if (!size || size > sizeof(val)) {
+    return 0;
+  }
+
+  dst &= addr_mask;
+  src &= addr_mask;
+
+  // The destination can overlap with source elements that have yet to be
+  // copied. Copying chunks no bigger than the distance between the two keeps
+  // the element-by-element behavior.
+  auto max_chunk = count;
+  if (backward ? dst < src : src < dst) {
+    const auto distance = backward ? src - dst : dst - src;
+    max_chunk = std::max<uint64_t>(1, distance / size);
+  }
+
+  const auto stride = backward ? 0 - size : size;
+  uint64_t num_done = 0;
+  while (num_done < count) {
+    dst &= addr_mask;
+    src &= addr_mask;
+
+    const auto num_elems = std::min(
+        std::min(count - num_done, max_chunk),
+        std::min(NumElementsOnPage(dst, size, backward),
+                 NumElementsOnPage(src, size, backward)));
+
+    if (num_elems) {
+      const auto num_bytes = num_elems * size;
+      auto src_ptr = ToReadOnlyChunk(
+          LowestAddress(src, num_elems, size, backward), num_bytes);
+      auto dst_ptr = ToReadWriteChunk(
+          LowestAddress(dst, num_elems, size, backward), num_bytes);
+      if (likely(src_ptr && dst_ptr)) {
+        memmove(dst_ptr, src_ptr, num_bytes);
+        num_done += num_elems;
+        src += num_elems * stride;
+        dst += num_elems * stride;
+        continue;
+      }
+    }
+
+    if (!TryRead(src, val, size) || !CanWriteAll(dst, size) ||
+        !TryWrite(dst, val, size)) {
+      break;
+    }
+    num_done += 1;
+    src += stride;
+    dst += stride;
+  }
+  return num_done;
+}
+
+uint64_t AddressSpace::TryFill(uint64_t dst, uint64_t val, uint64_t count,
+                               uint64_t size, bool backward) {
+  if (!size || size > sizeof(val)) {
+    return 0;
+  }
+
+  const auto stride = backward ? 0 - size : size;
+  uint64_t num_done = 0;
+  while (num_done < count) {
+    dst &= addr_mask;
+
+    const auto num_elems = std::min(
+        count - num_done, NumElementsOnPage(dst, size, backward));
+
+    if (num_elems) {
+      const auto num_bytes = num_elems * size;
+      auto dst_ptr = ToReadWriteChunk(
+          LowestAddress(dst, num_elems, size, backward), num_bytes);
+      if (likely(dst_ptr != nullptr)) {
+        if (1 == size) {
+          memset(dst_ptr, static_cast<uint8_t>(val), num_bytes);
+        } else {
+          for (uint64_t i = 0; i < num_bytes; i += size) {
+            memcpy(&(dst_ptr[i]), &val, size);
+          }
+        }
+        num_done += num_elems;
+        dst += num_elems * stride;
+        continue;
+      }
+    }
+
+    if (!CanWriteAll(dst, size) || !TryWrite(dst, &val, size)) {
+      break;
+    }
+    num_done += 1;
+    dst += stride;
+  }
+  return num_done;
+}
+
+uint64_t AddressSpace::TryCompare(uint64_t addr1, uint64_t addr2,
+                                  uint64_t count, uint64_t size,
+                                  bool backward, bool while_equal) {
+  uint8_t val1[sizeof(uint64_t)];
+  uint8_t val2[sizeof(uint64_t)];
+  if (!size || size > sizeof(val1)) {
+    return 0;
+  }
+
+  const auto stride = backward ? 0 - size : size;
+  uint64_t num_done = 0;
+  while (num_done < count) {
+    addr1 &= addr_mask;
+    addr2 &= addr_mask;
+
+    const auto num_elems = std::min(
+        count - num_done,
+        std::min(NumElementsOnPage(addr1, size, backward),
+                 NumElementsOnPage(addr2, size, backward)));
+
+    if (num_elems) {
+      const auto num_bytes = num_elems * size;
+      auto ptr1 = ToReadOnlyChunk(
+          LowestAddress(addr1, num_elems, size, backward), num_bytes);
+      auto ptr2 = ToReadOnlyChunk(
+          LowestAddress(addr2, num_elems, size, backward), num_bytes);
+      if (likely(ptr1 && ptr2)) {
+        uint64_t i = 0;
+        for (; i < num_elems; ++i) {
+          const auto offset = (backward ? num_elems - i - 1 : i) * size;
+          const auto is_equal = !memcmp(&(ptr1[offset]), &(ptr2[offset]),
+                                        size);
+          if (is_equal != while_equal) {
+            break;
+          }
+        }
+        num_done += i;
+        if (i < num_elems) {
+          break;
+        }
+        addr1 += num_elems * stride;
+        addr2 += num_elems * stride;
+        continue;
+      }
+    }
+
+    if (!TryRead(addr1, val1, size) || !TryRead(addr2, val2, size) ||
+        (!memcmp(val1, val2, size)) != while_equal) {
+      break;
+    }
+    num_done += 1;
+    addr1 += stride;
+    addr2 += stride;
+  }
+  return num_done;
+}
+
 // Return the virtual address of the memory backing `addr`.
 void *AddressSpace::ToReadWriteVirtualAddress(uint64_t addr_) {
   const auto addr = addr_ & addr_mask;
-  return FindRange(addr).ToReadWriteVirtualAddress(addr);
+  auto &range = PrepareToWrite(FindRange(addr), addr);
+  return range.ToReadWriteVirtualAddress(addr);
 }
 
 // Return the virtual address of the memory backing `addr`.
@@ -302,38 +870,60 @@ bool AddressSpace::TryReadExecutable(PC pc, uint8_t *val) {
 
 namespace {
 
-// Return a vector of memory maps, where none of the maps overlap with the
-// range of memory `[base, limit)`.
-static std::vector<MemoryMapPtr> RemoveRange(
-    const std::vector<MemoryMapPtr> &ranges, uint64_t base, uint64_t limit) {
+// Extends `[*base, *limit)` to cover the maps in `ranges` that overlap it,
+// i.e. to cover everything that `RemoveRange` might split or remove.
+static void ExtendToRanges(const AddressSpace::RangeMap &ranges,
+                           uint64_t *base, uint64_t *limit) {
+  auto first = ranges.upper_bound(*base);
+  if (first != ranges.begin()) {
+    --first;
+    if (first->second->LimitAddress() > *base) {
+      *base = first->first;
+    }
+  }
+
+  auto last = ranges.lower_bound(*limit);
+  if (last != ranges.begin()) {
+    --last;
+    *limit = std::max(*limit, last->second->LimitAddress());
+  }
+}
 
-  std::vector<MemoryMapPtr> new_ranges;
-  new_ranges.reserve(ranges.size() + 1);
+// Remove the parts of the maps in `ranges` that overlap with the range of
+// memory `[base, limit)`, and return the number of maps that overlapped.
+// Only the overlapping maps are visited.
+static size_t RemoveRange(AddressSpace::RangeMap &ranges, uint64_t base,
+                          uint64_t limit) {
 
   DLOG_IF(INFO, FLAGS_verbose)
       << "  RemoveRange: [" << std::hex << base << ", "
       << std::hex << limit << ") from list of "
       << ranges.size() << " ranges";
 
-  for (auto &map : ranges) {
+  auto it = ranges.upper_bound(base);
+  if (it != ranges.begin()) {
+    --it;
+    if (it->second->LimitAddress() <= base) {
+      ++it;
+    }
+  }
+
+  // The pieces of split maps are re-inserted either below `base`, or at
+  // `limit`, so they are never visited by this loop.
+  size_t num_overlaps = 0;
+  while (it != ranges.end() && it->first < limit) {
+    auto map = it->second;
     auto map_base_address = map->BaseAddress();
     auto map_limit_address = map->LimitAddress();
-
-    // No overlap between `map` and the range to remove.
-    if (map_limit_address <= base || map_base_address >= limit) {
-      DLOG_IF(INFO, FLAGS_verbose)
-          << "    Keeping with no overlap ["
-          << std::hex << map_base_address << ", "
-          << std::hex << map_limit_address << ")";
-      new_ranges.push_back(map);
+    it = ranges.erase(it);
+    ++num_overlaps;
 
     // `map` is fully contained in the range to remove.
-    } else if (map_base_address >= base && map_limit_address <= limit) {
+    if (map_base_address >= base && map_limit_address <= limit) {
       DLOG_IF(INFO, FLAGS_verbose)
           << "    Removing with full containment ["
           << std::hex << map_base_address << ", "
           << std::hex << map_limit_address << ")";
-      continue;
 
     // The range to remove is fully contained in `map`.
     } else if (map_base_address < base && map_limit_address > limit) {
@@ -345,27 +935,29 @@ static std::vector<MemoryMapPtr> RemoveRange(
           << std::hex << base << ") and ["
           << std::hex << limit << ", " << std::hex << map_limit_address << ")";
 
-      new_ranges.push_back(map->Copy(map_base_address, base));
-      new_ranges.push_back(map->Copy(limit, map_limit_address));
+      ranges[map_base_address] = map->Copy(map_base_address, base);
+      it = ranges.emplace_hint(
+          it, limit, map->Copy(limit, map_limit_address));
 
-    // The range to remove is a prefix of `map`.
-    } else if (map_base_address == base) {
+    // The range to remove covers the beginning of `map`.
+    } else if (map_base_address >= base) {
       DLOG_IF(INFO, FLAGS_verbose)
           << "    Keeping prefix [" << std::hex << limit << ", "
           << std::hex << map_limit_address << ")";
-      new_ranges.push_back(map->Copy(limit, map_limit_address));
+      it = ranges.emplace_hint(
+          it, limit, map->Copy(limit, map_limit_address));
 
-    // The range to remove is a suffix of `map`.
+    // The range to remove covers the end of `map`.
     } else {
       DLOG_IF(INFO, FLAGS_verbose)
           << "    Keeping suffix ["
           << std::hex << map_base_address << ", "
           << std::hex << base << ")";
-      new_ranges.push_back(map->Copy(map_base_address, base));
+      ranges[map_base_address] = map->Copy(map_base_address, base);
     }
   }
 
-  return new_ranges;
+  return num_overlaps;
 }
 
 }  // namespace
@@ -375,30 +967,68 @@ void AddressSpace::SetPermissions(uint64_t base_, size_t size, bool can_read,
   const auto base = AlignDownToPage(base_);
   const auto limit = base + RoundUpToPage(size);
 
+  // Lifted code may have folded the values of read-only pages. If a folded
+  // page changes read-only-ness, then the code that folded it must be
+  // re-derived, under a new data version for its entry PCs. Any page that
+  // changes read-only-ness while our folded data is shared can no longer be
+  // folded, as the address spaces sharing it now disagree about the page.
+  const auto is_read_only = can_read && !can_write;
+  const auto is_shared = folded_data.use_count() > 1;
+  std::unordered_set<uint64_t> changed_pcs;
   for (auto addr = base; addr < limit; addr += kPageSize) {
-    if (can_read) {
-      page_is_readable.insert(addr);
-    } else {
-      page_is_readable.erase(addr);
+    const auto was_read_only = CanReadAligned(addr) && !CanWriteAligned(addr);
+    if (was_read_only == is_read_only) {
+      continue;
     }
 
-    if (can_write) {
-      page_is_writable.insert(addr);
-    } else {
-      page_is_writable.erase(addr);
+    auto folded_it = folded_data->folded_pages.find(addr);
+    if (folded_it != folded_data->folded_pages.end()) {
+      changed_pcs.insert(folded_it->second.begin(), folded_it->second.end());
+      if (!is_shared) {
+        folded_data->folded_pages.erase(folded_it);
+      }
     }
 
-    if (can_exec) {
-      page_is_executable.insert(addr);
-    } else {
-      page_is_executable.erase(addr);
+    if (is_shared) {
+      folded_data->unfoldable_pages.insert(addr);
+    }
+  }
+
+  if (!changed_pcs.empty()) {
+    if (trace_data_versions.use_count() > 1) {
+      trace_data_versions = std::make_shared<TraceVersionMap>(
+          *trace_data_versions);
+    }
+    if (trace_heads.use_count() > 1) {
+      trace_heads = std::make_shared<TraceHeadSet>(*trace_heads);
+    }
+    const auto new_version = gNextDataVersion++;
+    for (auto pc : changed_pcs) {
+      (*trace_data_versions)[pc] = new_version;
+      trace_heads->erase(pc);
     }
   }
-  CreatePageToRangeMap();
+
+  if (checkpoint) {
+    protection_changes.emplace_back(base, limit);
+  }
+  pages.SetPermissions(base, limit,
+                       (can_read ? kPageIsReadable : 0) |
+                       (can_write ? kPageIsWritable : 0) |
+                       (can_exec ? kPageIsExecutable : 0));
+
+  const auto host_limit = std::min<uint64_t>(limit, HostWindow::kWindowSize);
+  if (window && base < host_limit) {
+    window->Protect(base, host_limit - base, can_read, can_write);
+  }
+
+  FlushTLB(base, limit);
+  memset(last_map_cache, 0, sizeof(last_map_cache));
+  memset(wnx_last_map_cache, 0, sizeof(wnx_last_map_cache));
 }
 
 void AddressSpace::AddMap(uint64_t base_, size_t size, const char *name,
-                          uint64_t offset) {
+                          uint64_t offset, int fd, uint64_t fd_offset) {
   auto base = AlignDownToPage(base_);
   auto limit = std::min(base + RoundUpToPage(size), addr_mask);
 
@@ -418,19 +1048,42 @@ void AddressSpace::AddMap(uint64_t base_, size_t size, const char *name,
       << "Mapping range [" << std::hex << base << ", " << limit
       << ")" << std::dec;
 
-  auto new_map = MappedRange::Create(base, limit, name, offset);
+  MemoryMapPtr new_map;
+  if (window) {
+    window->Clear(base, limit - base);
+    if (-1 != fd) {
+      window->CopyFromFile(base, limit - base, fd, fd_offset);
+    }
+    new_map = MappedRange::CreateHostMapped(base, limit, name, offset,
+                                            window->RuntimeView());
+  } else if (-1 != fd) {
+    new_map = MappedRange::CreateFileBacked(base, limit, name, offset, fd,
+                                            fd_offset);
+  } else {
+    new_map = MappedRange::Create(base, limit, name, offset);
+  }
+
+  CHECK(!maps->empty());
 
-  CHECK(!maps.empty());
+  auto &ranges = MutableMaps();
+  auto remap_base = base;
+  auto remap_limit = limit;
+  ExtendToRanges(ranges, &remap_base, &remap_limit);
+  const auto num_replaced = NumSharedRanges(remap_base, remap_limit);
 
-  auto old_ranges = RemoveRange(maps, base, limit);
-  if (old_ranges.size() < maps.size()) {
+  const auto num_overlaps = RemoveRange(ranges, base, limit);
+  if (num_overlaps) {
     LOG(INFO)
         << "New map [" << std::hex << base << ", " << limit << ")"
-        << " overlapped with " << std::dec << (maps.size() - old_ranges.size())
+        << " overlapped with " << std::dec << num_overlaps
         << " existing maps";
   }
-  maps.swap(old_ranges);
-  maps.push_back(new_map);
+  ranges[base] = new_map;
+  gaps.Reserve(base, limit);
+  layout_changed = true;
+  MapsChanged();
+  ClaimNewRanges(remap_base, remap_limit, num_replaced);
+  FlushTLB(remap_base, remap_limit);
   SetPermissions(base, limit - base, true, true, false);
 }
 
@@ -454,17 +1107,32 @@ void AddressSpace::RemoveMap(uint64_t base_, size_t size) {
       << "Unmapping range [" << std::hex << base << ", " << limit
       << ")" << std::dec;
 
+  if (window) {
+    window->Clear(base, limit - base);
+  }
+
   auto new_map = MappedRange::CreateInvalid(base, limit);
-  CHECK(!maps.empty());
-  auto old_ranges = RemoveRange(maps, base, limit);
-  if (old_ranges.size() < maps.size()) {
+  CHECK(!maps->empty());
+
+  auto &ranges = MutableMaps();
+  auto remap_base = base;
+  auto remap_limit = limit;
+  ExtendToRanges(ranges, &remap_base, &remap_limit);
+  const auto num_replaced = NumSharedRanges(remap_base, remap_limit);
+
+  const auto num_overlaps = RemoveRange(ranges, base, limit);
+  if (num_overlaps) {
     LOG(INFO)
         << "New invalid map [" << std::hex << base << ", " << limit << ")"
-        << " overlapped with " << std::dec << (maps.size() - old_ranges.size())
+        << " overlapped with " << std::dec << num_overlaps
         << " existing maps";
   }
-  maps.swap(old_ranges);
-  maps.push_back(new_map);
+  ranges[base] = new_map;
+  gaps.Release(base, limit);
+  layout_changed = true;
+  MapsChanged();
+  ClaimNewRanges(remap_base, remap_limit, num_replaced);
+  FlushTLB(remap_base, remap_limit);
   SetPermissions(base, limit - base, false, false, false);
 }
 
@@ -474,13 +1142,8 @@ bool AddressSpace::IsMapped(uint64_t find) const {
     return false;
   }
 
-  auto it = page_to_map.find(AlignDownToPage(find));
-  if (it == page_to_map.end()) {
-    return false;
-  }
-
-  auto &range = it->second;
-  return range->IsValid();
+  const auto page_addr = AlignDownToPage(find & addr_mask);
+  return pages.Find(page_addr) && RangeContaining(page_addr).IsValid();
 }
 
 // Find a hole big enough to hold `size` bytes in the address space,
@@ -503,110 +1166,50 @@ bool AddressSpace::FindHole(uint64_t min, uint64_t max, uint64_t size,
     return false;
   }
 
-  // Note: There are tombstone ranges bracketing the other ranges.
-
-  auto it = maps.rbegin();
-  auto it_end = maps.rend();
-
-  while (it != it_end) {
-    const auto &range_high = *it++;
-    uint64_t high_base = 0;
-    uint64_t low_limit = 0;
-
-    // Might be able to find a hole in this invalid map.
-    if (!range_high->IsValid()) {
-      high_base = range_high->LimitAddress();
-      low_limit = range_high->BaseAddress();
-
-    } else if (it == it_end) {
-      break;
-
-    } else {
-      high_base = range_high->BaseAddress();
-
-      const auto &range_low = *it;
-      low_limit = range_low->LimitAddress();
-    }
-
-    if (high_base < min) {
-      break;
-    }
-
-    CHECK(low_limit <= high_base);
-
-    // No overlap in our range.
-    if (low_limit >= max) {
-      continue;
-    }
-
-    const auto alloc_max = std::min(max, high_base);
-    const auto alloc_min = std::max(min, low_limit);
-    const auto avail_size = alloc_max - alloc_min;
-    if (avail_size < size) {
-      continue;
-    }
-
-    *hole = alloc_max - size;
-    CHECK(*hole >= alloc_min);
-    return true;
-  }
-
-  return false;
+  return gaps.FindHighest(min, max, size, hole);
 }
 
-void AddressSpace::CreatePageToRangeMap(void) {
-  page_to_map.clear();
-  wnx_page_to_map.clear();
+void AddressSpace::MapsChanged(void) {
   memset(last_map_cache, 0, sizeof(last_map_cache));
   memset(wnx_last_map_cache, 0, sizeof(wnx_last_map_cache));
 
-  auto old_read_size = page_to_map.size();
-  auto old_write_size = wnx_page_to_map.size();
-
-  page_to_map.reserve(old_read_size);
-  wnx_page_to_map.reserve(old_write_size);
-
-  std::sort(maps.begin(), maps.end(),
-            [=] (const MemoryMapPtr &left, const MemoryMapPtr &right) {
-    return left->BaseAddress() < right->BaseAddress();
-  });
-
   min_addr = std::numeric_limits<uint64_t>::max();
-
-  for (const auto &map : maps) {
-    if (!map->IsValid()) {
-      continue;
+  for (const auto &entry : *maps) {
+    if (entry.second->IsValid()) {
+      min_addr = entry.first;
+      break;
     }
+  }
+}
 
-    const auto base_address = map->BaseAddress();
-    const auto limit_address = map->LimitAddress();
-
-    min_addr = std::min(min_addr, base_address);
-    for (auto addr = base_address; addr < limit_address; addr += kPageSize) {
-
-      auto can_read = CanReadAligned(addr);
-      auto can_write = CanWriteAligned(addr);
-      auto can_exec = CanExecuteAligned(addr);
-
-      if (can_read || can_write || can_exec) {
-        page_to_map[addr] = map;
-      }
-
-      if (can_write && !can_exec) {
-        wnx_page_to_map[addr] = map;
-      }
-    }
+// The maps cover the whole address space, so there is always a range
+// containing `addr`, though it might be invalid.
+MappedRange &AddressSpace::RangeContaining(uint64_t addr) const {
+  auto it = maps->upper_bound(addr);
+  if (unlikely(it == maps->begin())) {
+    return *invalid;
   }
+  --it;
+  return *(it->second);
 }
 
 // Get the code version associated with some program counter.
 CodeVersion AddressSpace::ComputeCodeVersion(PC pc) {
+  uint64_t code_version = 0;
   if (FLAGS_version_code) {
     auto masked_pc = static_cast<uint64_t>(pc) & addr_mask;
-    return FindRange(masked_pc).ComputeCodeVersion();
-  } else {
-    return static_cast<CodeVersion>(0);
+    code_version = static_cast<uint64_t>(
+        FindRange(masked_pc).ComputeCodeVersion());
+  }
+  auto pc_data_version = data_version;
+  if (unlikely(!trace_data_versions->empty())) {
+    auto version_it = trace_data_versions->find(static_cast<uint64_t>(pc));
+    if (version_it != trace_data_versions->end()) {
+      pc_data_version = version_it->second;
+    }
   }
+  return static_cast<CodeVersion>(
+      code_version ^ (pc_data_version * 0x9E3779B97F4A7C15ULL));
 }
 
 MappedRange &AddressSpace::FindRange(uint64_t addr) {
@@ -631,15 +1234,15 @@ MappedRange &AddressSpace::FindRangeAligned(uint64_t page_addr) {
     return *last_range;
   }
 
-  auto it = page_to_map.find(page_addr);
-  if (likely(it != page_to_map.end())) {
-    last_range = it->second.get();
-    last_map_cache[kRangeCacheSize] = last_range;
-    last_map_cache[cache_index] = last_range;
-    return *last_range;
-  } else {
-    return *invalid;
+  if (likely(pages.Find(page_addr))) {
+    last_range = &(RangeContaining(page_addr));
+    if (likely(last_range->IsValid())) {
+      last_map_cache[kRangeCacheSize] = last_range;
+      last_map_cache[cache_index] = last_range;
+      return *last_range;
+    }
   }
+  return *invalid;
 }
 
 MappedRange &AddressSpace::FindWNXRange(uint64_t addr) {
@@ -660,15 +1263,17 @@ MappedRange &AddressSpace::FindWNXRangeAligned(uint64_t page_addr) {
     return *last_range;
   }
 
-  auto it = wnx_page_to_map.find(page_addr);
-  if (likely(it != wnx_page_to_map.end())) {
-    last_range = it->second.get();
-    wnx_last_map_cache[kRangeCacheSize] = last_range;
-    wnx_last_map_cache[cache_index] = last_range;
-    return *last_range;
-  } else {
-    return *invalid;
+  const auto perms = pages.Find(page_addr);
+  if (likely((perms & (kPageIsWritable | kPageIsExecutable)) ==
+             kPageIsWritable)) {
+    last_range = &(RangeContaining(page_addr));
+    if (likely(last_range->IsValid())) {
+      wnx_last_map_cache[kRangeCacheSize] = last_range;
+      wnx_last_map_cache[cache_index] = last_range;
+      return *last_range;
+    }
   }
+  return *invalid;
 }
 
 // Log out the current state of the memory maps.
@@ -676,7 +1281,8 @@ void AddressSpace::LogMaps(std::ostream &os) const {
   auto arch = remill::GetTargetArch();
 
   os << "Memory maps:" << std::endl;
-  for (const auto &range : maps) {
+  for (const auto &entry : *maps) {
+    const auto &range = entry.second;
     if (!range->IsValid()) {
       continue;
     }
@@ -22,23 +22,69 @@
 #include <memory>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "vmill/Program/GapTree.h"
+#include "vmill/Program/HostWindow.h"
 #include "vmill/Program/MappedRange.h"
+#include "vmill/Program/PageTable.h"
 
-struct Memory {};
+namespace vmill {
+
+// An entry of the software TLB. A guest access of `size` bytes at `addr` hits
+// the entry at index `(addr >> 12) % kNumTLBEntries` if the page containing
+// `addr + size - 1` is its read or write tag, in which case the host address
+// of the access is `addr + host_delta`. Accesses that cross pages always miss.
+struct TLBEntry {
+  uint64_t read_tag;
+  uint64_t write_tag;
+  uint64_t host_delta;
+};
+
+enum : uint64_t {
+  kNumTLBEntries = 256ULL,
+  kTLBIndexMask = kNumTLBEntries - 1ULL,
+  kTLBPageShift = 12ULL
+};
+
+}  // namespace vmill
+
+// Lifted code is passed `Memory` pointers, which point to `AddressSpace`s.
+// The software TLB lives here so that lifted code can check it inline, at a
+// fixed offset from the memory pointer.
+struct Memory {
+  mutable vmill::TLBEntry tlb[vmill::kNumTLBEntries];
+
+  // Base of the host mapping of guest memory, if the address space is host
+  // mapped, otherwise `nullptr`. Lifted code accesses guest address `addr`
+  // at `host_base + addr`.
+  uint8_t *host_base;
+};
 
 namespace vmill {
 
 enum class CodeVersion : uint64_t;
 enum class PC : uint64_t;
+struct GuestHeap;
+
+// Values of vector-width memory accesses. 32-byte values have no natural
+// register representation, so they are passed around by reference.
+using uint128_t = unsigned __int128;
+struct uint256_t {
+  uint8_t bytes[32];
+};
 
 // Basic memory implementation.
 class AddressSpace : public Memory {
  public:
+  // Memory maps, keyed by their base addresses.
+  using RangeMap = std::map<uint64_t, MemoryMapPtr>;
+
   AddressSpace(void);
 
-  // Creates a copy/clone of another address space.
+  // Creates a copy/clone of another address space. The clone shares its
+  // memory with `parent` until either of them writes to it.
   explicit AddressSpace(const AddressSpace &);
 
   // Kill this address space. This prevents future allocations, and removes
@@ -48,6 +94,25 @@ class AddressSpace : public Memory {
   // Returns `true` if this address space is "dead".
   bool IsDead(void) const;
 
+  // Remember the current state of this address space, and start tracking the
+  // pages that are written to from now on.
+  void Checkpoint(void);
+
+  // Restore the state of this address space to what it was at the last
+  // checkpoint. If the maps haven't changed since, then only the pages
+  // written to, and the page permissions changed, since the checkpoint are
+  // restored, in place.
+  void RestoreCheckpoint(void);
+
+  // Returns `true` if new address spaces are host mapped, in which case
+  // lifted code must access guest memory through `Memory::host_base`.
+  static bool HostMappingEnabled(void);
+
+  // Returns `true` if lifted code faulted while directly accessing host-mapped
+  // guest memory, and if so, stores the address and kind of the first fault.
+  // This must be called once lifted code returns to the runtime.
+  bool TakeHostFault(uint64_t *addr, bool *is_write);
+
   // Returns `true` if the byte at address `addr` is readable,
   // writable, or executable, respectively.
   bool CanRead(uint64_t addr) const;
@@ -87,6 +152,28 @@ class AddressSpace : public Memory {
   __attribute__((hot)) bool TryRead(uint64_t addr, double *val);
   __attribute__((hot)) bool TryWrite(uint64_t addr, double val);
 
+  // Read/write 16 or 32 bytes to memory. Returns `false` if the read or write
+  // failed. These take one range lookup when the access is within one page.
+  __attribute__((hot)) bool TryRead(uint64_t addr, uint128_t *val);
+  __attribute__((hot)) bool TryWrite(uint64_t addr, uint128_t val);
+  __attribute__((hot)) bool TryRead(uint64_t addr, uint256_t *val);
+  __attribute__((hot)) bool TryWrite(uint64_t addr, uint256_t val);
+
+  // Bulk operations on `count` elements of `size` bytes each. The addresses
+  // of successive elements go down if `backward` is `true`. These behave like
+  // element-by-element loops, but work a page at a time. They return the
+  // number of leading elements that were processed, stopping before the
+  // first element that would fault.
+  uint64_t TryCopy(uint64_t dst, uint64_t src, uint64_t count, uint64_t size,
+                   bool backward);
+  uint64_t TryFill(uint64_t dst, uint64_t val, uint64_t count, uint64_t size,
+                   bool backward);
+
+  // Like the above, but only counts the leading elements of `addr1` and
+  // `addr2` that are equal (or unequal, if `while_equal` is `false`).
+  uint64_t TryCompare(uint64_t addr1, uint64_t addr2, uint64_t count,
+                      uint64_t size, bool backward, bool while_equal);
+
   // Return the virtual address of the memory backing `addr`.
   __attribute__((hot)) void *ToReadWriteVirtualAddress(uint64_t addr);
 
@@ -103,9 +190,13 @@ class AddressSpace : public Memory {
   void SetPermissions(uint64_t base, size_t size, bool can_read,
                       bool can_write, bool can_exec);
 
-  // Adds a new memory mapping with default read/write permissions.
+  // Adds a new memory mapping with default read/write permissions. If `fd` is
+  // not `-1`, then the initial contents of the mapping are the `size` bytes
+  // at `fd_offset` in the memory file `fd`, which is mapped copy-on-write
+  // rather than copied into the address space. `fd` still belongs to the
+  // caller.
   void AddMap(uint64_t base, size_t size, const char *name=nullptr,
-              uint64_t offset=0);
+              uint64_t offset=0, int fd=-1, uint64_t fd_offset=0);
 
   // Removes a memory mapping.
   void RemoveMap(uint64_t base, size_t size);
@@ -128,13 +219,69 @@ class AddressSpace : public Memory {
   // Check to see if a given program counter is a trace head.
   bool IsMarkedTraceHead(PC pc) const;
 
+  // Returns `true` if the read-only data at `addr` can be folded into lifted
+  // code.
+  bool CanFoldData(uint64_t addr) const;
+
+  // Mark the page containing `addr` as holding read-only data whose values
+  // have been folded into the lifted code entered at `pc`. Making the page
+  // writable or unmapping it changes the code version of `pc`.
+  void MarkAsFoldedData(uint64_t addr, PC pc);
+
+  // Returns the state of the `malloc` hook's heap in this address space, if
+  // any. This is shared with clones, so the hook copies it before changing
+  // it if it's shared. Restoring the checkpoint restores it too.
+  std::shared_ptr<GuestHeap> &HookedHeap(void);
+
  private:
   AddressSpace(AddressSpace &&) = delete;
   AddressSpace &operator=(const AddressSpace &) = delete;
   AddressSpace &operator=(const AddressSpace &&) = delete;
 
-  // Recreate the `range_base_to_index` and `range_limit_to_index` indices.
-  void CreatePageToRangeMap(void);
+  // Make this address space a clone of `parent`, replacing all of our state
+  // except for our checkpoint.
+  void CloneFrom(const AddressSpace &parent);
+
+  // Update `min_addr`, and forget about any cached ranges, after `maps` has
+  // changed.
+  void MapsChanged(void);
+
+  // Returns the range in `maps` containing `addr`.
+  MappedRange &RangeContaining(uint64_t addr) const;
+
+  // Returns `maps`, after making sure that it isn't shared with another
+  // address space.
+  RangeMap &MutableMaps(void);
+
+  // Returns the range to use in place of `range`, which is a clone of it if
+  // `range` was still shared with another address space.
+  MappedRange &PrivateRange(MappedRange &range);
+
+  // Returns the number of valid ranges starting in `[base, limit)` that might
+  // still be shared with another address space.
+  uint64_t NumSharedRanges(uint64_t base, uint64_t limit) const;
+
+  // Takes ownership of the ranges starting in `[base, limit)`, after they
+  // replaced `num_replaced` ranges that might have been shared.
+  void ClaimNewRanges(uint64_t base, uint64_t limit, uint64_t num_replaced);
+
+  // Invalidate every entry of the software TLB.
+  void FlushTLB(void) const;
+
+  // Invalidate the TLB entries of the pages in `[base, limit)`.
+  void FlushTLB(uint64_t base, uint64_t limit) const;
+
+  // Returns the range to write to at `addr` in place of `range`, after
+  // flushing its TLB entries if writing to `addr` can change the memory that
+  // backs it, i.e. if TLB entries might point into memory that the range is
+  // about to stop using.
+  MappedRange &PrepareToWrite(MappedRange &range, uint64_t addr);
+
+  // Fill the TLB entry for the page containing `addr`, which is in `range`.
+  // Read entries are only filled for pages backed by contiguous memory, and
+  // write entries only for writable, non-executable pages.
+  void FillReadTLB(uint64_t addr, MappedRange &range);
+  void FillWriteTLB(uint64_t addr, void *host_addr);
 
   // Permission checking on page-aligned `addr` values.
   bool CanReadAligned(uint64_t addr) const;
@@ -150,13 +297,30 @@ class AddressSpace : public Memory {
   __attribute__((hot)) MappedRange &FindRangeAligned(uint64_t addr);
   __attribute__((hot)) MappedRange &FindWNXRangeAligned(uint64_t addr);
 
-  // Sorted list of mapped memory page ranges.
-  std::vector<MemoryMapPtr> maps;
+  // Returns the host address of the `size` bytes at `addr`, or `nullptr` if
+  // they aren't all in one range, on one page. Writable chunks are never
+  // executable, so writes through them need not invalidate any code.
+  const uint8_t *ToReadOnlyChunk(uint64_t addr, uint64_t size);
+  uint8_t *ToReadWriteChunk(uint64_t addr, uint64_t size);
+
+  // Returns `true` if all of the `size` bytes at `addr` are writable.
+  bool CanWriteAll(uint64_t addr, uint64_t size) const;
 
-  // A cache mapping pages accessed to the range.
-  using PageCache = std::unordered_map<uint64_t, MemoryMapPtr>;
-  PageCache page_to_map;
-  PageCache wnx_page_to_map;
+  // Mirror the permissions of the pages in `[base, limit)` into the host
+  // mapping of guest memory.
+  void ProtectHostPages(uint64_t base, uint64_t limit);
+
+  // Host mapping of the whole guest address space, if any. This outlives the
+  // memory maps, which point into it.
+  std::unique_ptr<HostWindow> window;
+
+  // Mapped memory page ranges, including the invalid ranges that cover the
+  // holes between them. Cloned address spaces share their maps, and their
+  // ranges, until they change them.
+  std::shared_ptr<RangeMap> maps;
+
+  // Holes between the valid ranges, for placing new maps.
+  GapTree gaps;
 
   // Minimum allocated address.
   uint64_t min_addr;
@@ -175,13 +339,65 @@ class AddressSpace : public Memory {
   MappedRange *last_map_cache[kRangeCacheSize + 1];
   MappedRange *wnx_last_map_cache[kRangeCacheSize + 1];
 
-  // Sets of pages that are readable, writable, and executable.
-  std::unordered_set<uint64_t> page_is_readable;
-  std::unordered_set<uint64_t> page_is_writable;
-  std::unordered_set<uint64_t> page_is_executable;
+  // Permissions of every page.
+  PageTable pages;
+
+  // Set of lifted trace heads observed for this code version. This is shared
+  // with cloned address spaces until one of them changes it.
+  using TraceHeadSet = std::unordered_set<uint64_t>;
+  std::shared_ptr<TraceHeadSet> trace_heads;
+
+  // State of the `malloc` hook's heap.
+  std::shared_ptr<GuestHeap> heap;
+
+  // Version of the read-only data of this address space, which is mixed into
+  // the code versions. Address spaces share a version (and so share lifted
+  // code that folds read-only data) until one of them changes whether a
+  // folded page is read-only.
+  uint64_t data_version;
+
+  // Data versions of the entry PCs whose lifted code folded a page that has
+  // since changed read-only-ness in this address space. Every other PC uses
+  // `data_version`. This is shared with cloned address spaces until one of
+  // them changes it.
+  using TraceVersionMap = std::unordered_map<uint64_t, uint64_t>;
+  std::shared_ptr<TraceVersionMap> trace_data_versions;
+
+  // Entry PCs of the lifted code that folded each page, and pages that must
+  // not be folded because they changed read-only-ness in an address space
+  // sharing this. Like the lifted code, this is shared by every address space
+  // with the same data version, so it is updated in place.
+  struct FoldedData {
+    std::unordered_map<uint64_t, std::unordered_set<uint64_t>> folded_pages;
+    std::unordered_set<uint64_t> unfoldable_pages;
+  };
+  std::shared_ptr<FoldedData> folded_data;
+
+  // Tag that `PrivateRange` gives the ranges that only we use. It changes
+  // whenever our ranges might have become shared again, i.e. when we are
+  // cloned.
+  mutable uint64_t owner_id;
+
+  // Number of valid ranges in `maps` that aren't tagged with `owner_id`, or
+  // `kUnknownNumSharedRanges` if they haven't been counted since we were last
+  // cloned.
+  mutable uint64_t num_shared_ranges;
+
+  // Might some of our ranges be shared with another address space?
+  mutable bool ranges_are_shared;
+
+  // Clone of this address space taken by `Checkpoint`, if any.
+  std::unique_ptr<AddressSpace> checkpoint;
+
+  // Pages that might have been written to since `checkpoint` was taken.
+  std::unordered_set<uint64_t> dirty_pages;
+
+  // Ranges of pages, `[base, limit)`, whose permissions might have changed
+  // since `checkpoint` was taken.
+  std::vector<std::pair<uint64_t, uint64_t>> protection_changes;
 
-  // Set of lifted trace heads observed for this code version.
-  std::unordered_set<uint64_t> trace_heads;
+  // Have the maps changed since `checkpoint` was taken?
+  bool layout_changed;
 
   // Is the address space dead? This means that all operations on it
   // will be muted.
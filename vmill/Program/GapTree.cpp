@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <algorithm>
+
+#include "vmill/Program/GapTree.h"
+#include "vmill/Util/Hash.h"
+
+namespace vmill {
+
+GapTree::GapTree(void)
+    : root(nullptr) {}
+
+GapTree::GapTree(const GapTree &that)
+    : root(that.root) {
+  if (root) {
+    root->ref_count++;
+  }
+}
+
+GapTree &GapTree::operator=(const GapTree &that) {
+  if (that.root) {
+    that.root->ref_count++;
+  }
+  ReleaseNode(root);
+  root = that.root;
+  return *this;
+}
+
+GapTree::~GapTree(void) {
+  ReleaseNode(root);
+}
+
+// Priorities are derived from the base addresses, so that the shape of the
+// tree is random, but deterministic.
+GapTree::Node *GapTree::NewNode(uint64_t base, uint64_t limit) {
+  DCHECK(base < limit);
+  auto node = new Node;
+  node->base = base;
+  node->limit = limit;
+  node->priority = Hash(base);
+  node->max_size = limit - base;
+  node->ref_count = 1;
+  node->left = nullptr;
+  node->right = nullptr;
+  return node;
+}
+
+GapTree::Node *GapTree::MakePrivate(Node *node) {
+  if (node->ref_count == 1) {
+    return node;
+  }
+
+  auto copy = new Node(*node);
+  copy->ref_count = 1;
+  if (copy->left) {
+    copy->left->ref_count++;
+  }
+  if (copy->right) {
+    copy->right->ref_count++;
+  }
+  node->ref_count--;
+  return copy;
+}
+
+void GapTree::ReleaseNode(Node *node) {
+  if (node && !--(node->ref_count)) {
+    ReleaseNode(node->left);
+    ReleaseNode(node->right);
+    delete node;
+  }
+}
+
+void GapTree::Update(Node *node) {
+  node->max_size = node->limit - node->base;
+  if (node->left) {
+    node->max_size = std::max(node->max_size, node->left->max_size);
+  }
+  if (node->right) {
+    node->max_size = std::max(node->max_size, node->right->max_size);
+  }
+}
+
+void GapTree::Split(Node *node, uint64_t key, Node **below, Node **rest) {
+  if (!node) {
+    *below = nullptr;
+    *rest = nullptr;
+    return;
+  }
+
+  node = MakePrivate(node);
+  if (node->base < key) {
+    Split(node->right, key, &(node->right), rest);
+    Update(node);
+    *below = node;
+  } else {
+    Split(node->left, key, below, &(node->left));
+    Update(node);
+    *rest = node;
+  }
+}
+
+GapTree::Node *GapTree::Merge(Node *below, Node *above) {
+  if (!below) {
+    return above;
+  } else if (!above) {
+    return below;
+  } else if (below->priority > above->priority) {
+    below = MakePrivate(below);
+    below->right = Merge(below->right, above);
+    Update(below);
+    return below;
+  } else {
+    above = MakePrivate(above);
+    above->left = Merge(below, above->left);
+    Update(above);
+    return above;
+  }
+}
+
+GapTree::Node *GapTree::RemoveHighest(Node *node, Node **highest) {
+  node = MakePrivate(node);
+  if (!node->right) {
+    auto left = node->left;
+    node->left = nullptr;
+    Update(node);
+    *highest = node;
+    return left;
+  }
+  node->right = RemoveHighest(node->right, highest);
+  Update(node);
+  return node;
+}
+
+GapTree::Node *GapTree::RemoveLowest(Node *node, Node **lowest) {
+  node = MakePrivate(node);
+  if (!node->left) {
+    auto right = node->right;
+    node->right = nullptr;
+    Update(node);
+    *lowest = node;
+    return right;
+  }
+  node->left = RemoveLowest(node->left, lowest);
+  Update(node);
+  return node;
+}
+
+void GapTree::Reserve(uint64_t base, uint64_t limit) {
+  if (base >= limit) {
+    return;
+  }
+
+  Node *below = nullptr;
+  Node *middle = nullptr;
+  Node *above = nullptr;
+  Node *rest = nullptr;
+  Split(root, base, &below, &rest);
+  Split(rest, limit, &middle, &above);
+
+  // Gaps that start in `[base, limit)` are removed, except for whatever part
+  // of the highest one goes past `limit`.
+  uint64_t tail_limit = limit;
+  if (middle) {
+    Node *highest = nullptr;
+    middle = RemoveHighest(middle, &highest);
+    tail_limit = std::max(tail_limit, highest->limit);
+    ReleaseNode(highest);
+    ReleaseNode(middle);
+  }
+
+  // The highest gap below `base` might run into `[base, limit)`, or even
+  // past it.
+  if (below) {
+    Node *highest = nullptr;
+    below = RemoveHighest(below, &highest);
+    if (highest->limit > base) {
+      tail_limit = std::max(tail_limit, highest->limit);
+      highest->limit = base;
+    }
+    if (highest->base < highest->limit) {
+      Update(highest);
+      below = Merge(below, highest);
+    } else {
+      ReleaseNode(highest);
+    }
+  }
+
+  if (tail_limit > limit) {
+    above = Merge(NewNode(limit, tail_limit), above);
+  }
+
+  root = Merge(below, above);
+}
+
+void GapTree::Release(uint64_t base, uint64_t limit) {
+  if (base >= limit) {
+    return;
+  }
+
+  // Keep the gaps disjoint.
+  Reserve(base, limit);
+
+  Node *below = nullptr;
+  Node *above = nullptr;
+  Split(root, base, &below, &above);
+
+  if (below) {
+    Node *highest = nullptr;
+    below = RemoveHighest(below, &highest);
+    if (highest->limit == base) {
+      base = highest->base;
+      ReleaseNode(highest);
+    } else {
+      below = Merge(below, highest);
+    }
+  }
+
+  if (above) {
+    Node *lowest = nullptr;
+    above = RemoveLowest(above, &lowest);
+    if (lowest->base == limit) {
+      limit = lowest->limit;
+      ReleaseNode(lowest);
+    } else {
+      above = Merge(lowest, above);
+    }
+  }
+
+  root = Merge(Merge(below, NewNode(base, limit)), above);
+}
+
+void GapTree::Clear(void) {
+  ReleaseNode(root);
+  root = nullptr;
+}
+
+bool GapTree::FindHighest(uint64_t min, uint64_t max, uint64_t size,
+                          uint64_t *hole) const {
+  *hole = 0;
+  return size && min < max && FindHighest(root, min, max, size, hole);
+}
+
+// Subtrees whose biggest gap is too small are skipped, as are the subtrees
+// that are entirely outside of `[min, max)`.
+bool GapTree::FindHighest(const Node *node, uint64_t min, uint64_t max,
+                          uint64_t size, uint64_t *hole) {
+  if (!node || node->max_size < size) {
+    return false;
+  }
+
+  // This gap, and every gap above it, starts at or above `max`.
+  if (node->base >= max) {
+    return FindHighest(node->left, min, max, size, hole);
+  }
+
+  if (FindHighest(node->right, min, max, size, hole)) {
+    return true;
+  }
+
+  const auto alloc_min = std::max(min, node->base);
+  const auto alloc_max = std::min(max, node->limit);
+  if (alloc_min < alloc_max && (alloc_max - alloc_min) >= size) {
+    *hole = alloc_max - size;
+    return true;
+  }
+
+  // This gap, and every gap below it, ends at or below `min`.
+  if (node->limit <= min) {
+    return false;
+  }
+
+  return FindHighest(node->left, min, max, size, hole);
+}
+
+}  // namespace vmill
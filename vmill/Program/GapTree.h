@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_PROGRAM_GAPTREE_H_
+#define VMILL_PROGRAM_GAPTREE_H_
+
+#include <cstdint>
+
+namespace vmill {
+
+// Index of the unmapped parts of an address space, used to place new maps.
+//
+// The gaps are kept in a treap ordered by base address, where every node also
+// knows the size of the biggest gap in its subtree. This lets us find the
+// highest gap big enough for a new map in logarithmic time, without visiting
+// the many gaps that are too small.
+//
+// Copies of a tree share their nodes. Nodes are reference counted, and shared
+// nodes are copied just before they are changed, so copying a tree takes
+// constant time.
+class GapTree {
+ public:
+  GapTree(void);
+
+  GapTree(const GapTree &that);
+
+  // Make this tree share the nodes of `that`.
+  GapTree &operator=(const GapTree &that);
+
+  ~GapTree(void);
+
+  // Mark `[base, limit)` as unmapped, merging it with adjacent gaps.
+  void Release(uint64_t base, uint64_t limit);
+
+  // Mark `[base, limit)` as mapped, shrinking or splitting the gaps that
+  // overlap it.
+  void Reserve(uint64_t base, uint64_t limit);
+
+  // Forget about every gap.
+  void Clear(void);
+
+  // Find the highest `size`-byte hole that fits in a gap, such that the hole
+  // falls within the bounds `[min, max)`.
+  bool FindHighest(uint64_t min, uint64_t max, uint64_t size,
+                   uint64_t *hole) const;
+
+ private:
+  struct Node {
+    uint64_t base;
+    uint64_t limit;
+    uint64_t priority;
+    uint64_t max_size;
+    uint64_t ref_count;
+    Node *left;
+    Node *right;
+  };
+
+  static Node *NewNode(uint64_t base, uint64_t limit);
+
+  // Returns `node`, or a copy of it if it is shared with another tree. The
+  // caller's reference to `node` is transferred to the returned node.
+  static Node *MakePrivate(Node *node);
+
+  // Drops a reference to `node`, freeing it and its subtrees once they are no
+  // longer referenced.
+  static void ReleaseNode(Node *node);
+
+  static void Update(Node *node);
+
+  // The following take over the caller's references to the nodes passed in.
+
+  // Split `node` into the gaps with base addresses below `key`, and the rest.
+  static void Split(Node *node, uint64_t key, Node **below, Node **rest);
+
+  // Merge `below` and `above`, where every gap of `below` is lower than every
+  // gap of `above`.
+  static Node *Merge(Node *below, Node *above);
+
+  static Node *RemoveHighest(Node *node, Node **highest);
+  static Node *RemoveLowest(Node *node, Node **lowest);
+
+  static bool FindHighest(const Node *node, uint64_t min, uint64_t max,
+                          uint64_t size, uint64_t *hole);
+
+  Node *root;
+};
+
+}  // namespace vmill
+
+#endif  // VMILL_PROGRAM_GAPTREE_H_
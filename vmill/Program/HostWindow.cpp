@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "vmill/Program/HostWindow.h"
+#include "vmill/Util/AreaAllocator.h"
+#include "vmill/Util/Compiler.h"
+
+namespace vmill {
+namespace {
+
+enum : uint64_t {
+  kPageSize = 4096ULL,
+
+  // Each window gets a slot of the `kAreaHostWindows` area, which holds its
+  // guest view followed by a guard page, for accesses that straddle the end
+  // of the guest address space.
+  kSlotSize = HostWindow::kWindowSize * 2ULL,
+  kMaxNumWindows = 2048ULL
+};
+
+struct SaveErrno {
+  int no;
+  SaveErrno(void)
+      : no(errno) {}
+  ~SaveErrno(void) {
+    errno = no;
+  }
+};
+
+static HostWindow *gWindows[kMaxNumWindows] = {};
+
+static struct sigaction gPrevSignalHandler = {};
+
+static bool gCatchingFaults = false;
+
+// Returns `true` if the fault described by `context` is due to a write.
+static bool IsWriteFault(void *context) {
+#if defined(__linux__) && defined(__x86_64__)
+  auto uc = reinterpret_cast<ucontext_t *>(context);
+  return 0 != (uc->uc_mcontext.gregs[REG_ERR] & 0x2);
+#else
+  (void) context;
+  return false;
+#endif
+}
+
+static void CatchFault(int sig, siginfo_t *si, void *context) {
+  SaveErrno save_errno;
+
+  const auto addr = reinterpret_cast<uintptr_t>(si->si_addr);
+  if (kAreaHostWindows <= addr &&
+      addr < (kAreaHostWindows + kMaxNumWindows * kSlotSize)) {
+    const auto window = gWindows[(addr - kAreaHostWindows) / kSlotSize];
+    if (window && window->HandleFault(addr, IsWriteFault(context))) {
+      return;
+    }
+  }
+
+  if (gPrevSignalHandler.sa_flags & SA_SIGINFO) {
+    gPrevSignalHandler.sa_sigaction(sig, si, context);
+
+  } else if (gPrevSignalHandler.sa_handler != SIG_DFL &&
+             gPrevSignalHandler.sa_handler != SIG_IGN) {
+    gPrevSignalHandler.sa_handler(sig);
+
+  // Re-execute the faulting instruction with the default handler in place.
+  } else {
+    ::sigaction(SIGSEGV, &gPrevSignalHandler, nullptr);
+  }
+}
+
+static void CatchFaults(void) {
+  if (gCatchingFaults) {
+    return;
+  }
+
+  struct sigaction act = {};
+  act.sa_flags = SA_SIGINFO;
+  act.sa_sigaction = CatchFault;
+  sigfillset(&(act.sa_mask));
+
+  if (-1 == ::sigaction(SIGSEGV, &act, &gPrevSignalHandler)) {
+    auto err = errno;
+    LOG(FATAL)
+        << "Can't catch SIGSEGV for host-mapped memory: " << strerror(err);
+  }
+  gCatchingFaults = true;
+}
+
+}  // namespace
+
+std::unique_ptr<HostWindow> HostWindow::Create(void) {
+#ifdef __linux__
+  unsigned slot = 0;
+  while (slot < kMaxNumWindows && gWindows[slot]) {
+    ++slot;
+  }
+  CHECK(slot < kMaxNumWindows)
+      << "Too many host-mapped address spaces.";
+
+  auto fd = memfd_create("vmill_memory", MFD_CLOEXEC);
+  auto err = errno;
+  CHECK(-1 != fd)
+      << "Unable to create memfd for host-mapped memory: " << strerror(err);
+
+  CHECK(!ftruncate(fd, kWindowSize))
+      << "Unable to resize memfd for host-mapped memory.";
+
+  auto desired_base = reinterpret_cast<void *>(
+      kAreaHostWindows + slot * kSlotSize);
+  auto guest_view = mmap(desired_base, kWindowSize, PROT_NONE,
+                         MAP_SHARED | MAP_FIXED | MAP_NORESERVE, fd, 0);
+  err = errno;
+  CHECK(guest_view == desired_base)
+      << "Unable to map guest view of host-mapped memory at "
+      << desired_base << ": " << strerror(err);
+
+  auto guard = reinterpret_cast<uint8_t *>(guest_view) + kWindowSize;
+  CHECK(guard == mmap(guard, kPageSize, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+                      -1, 0))
+      << "Unable to map guard page of host-mapped memory.";
+
+  auto runtime_view = mmap(nullptr, kWindowSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_NORESERVE, fd, 0);
+  err = errno;
+  CHECK(MAP_FAILED != runtime_view)
+      << "Unable to map runtime view of host-mapped memory: "
+      << strerror(err);
+
+  CatchFaults();
+
+  auto window = new HostWindow(fd, slot,
+                               reinterpret_cast<uint8_t *>(guest_view),
+                               reinterpret_cast<uint8_t *>(runtime_view));
+  gWindows[slot] = window;
+  return std::unique_ptr<HostWindow>(window);
+#else
+  LOG(FATAL)
+      << "Host-mapped memory is only supported on Linux.";
+  return nullptr;
+#endif
+}
+
+HostWindow::HostWindow(int fd_, unsigned slot_, uint8_t *guest_view_,
+                       uint8_t *runtime_view_)
+    : fd(fd_),
+      slot(slot_),
+      guest_view(guest_view_),
+      runtime_view(runtime_view_),
+      has_fault(false),
+      fault_is_write(false),
+      fault_addr(0),
+      num_faulted_pages(0) {}
+
+HostWindow::~HostWindow(void) {
+  gWindows[slot] = nullptr;
+  munmap(guest_view, kWindowSize + kPageSize);
+  munmap(runtime_view, kWindowSize);
+  close(fd);
+}
+
+void HostWindow::Protect(uint64_t base, uint64_t size, bool can_read,
+                         bool can_write) {
+  auto prot = (can_read ? PROT_READ : 0) | (can_write ? PROT_WRITE : 0);
+  auto ret = mprotect(guest_view + base, size, prot);
+  auto err = errno;
+  CHECK(!ret)
+      << "Unable to protect host-mapped memory [" << std::hex << base << ", "
+      << (base + size) << ")" << std::dec << ": " << strerror(err);
+}
+
+void HostWindow::Clear(uint64_t base, uint64_t size) {
+  auto ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                       static_cast<off_t>(base), static_cast<off_t>(size));
+  auto err = errno;
+  CHECK(!ret)
+      << "Unable to clear host-mapped memory [" << std::hex << base << ", "
+      << (base + size) << ")" << std::dec << ": " << strerror(err);
+}
+
+// Only the parts of `that` which have ever been written are copied.
+void HostWindow::CopyFrom(const HostWindow &that) {
+  off_t offset = 0;
+  while (static_cast<uint64_t>(offset) < kWindowSize) {
+    const auto data_offset = lseek(that.fd, offset, SEEK_DATA);
+    if (0 > data_offset) {
+      break;
+    }
+    auto hole_offset = lseek(that.fd, data_offset, SEEK_HOLE);
+    if (0 > hole_offset) {
+      hole_offset = static_cast<off_t>(kWindowSize);
+    }
+    memcpy(runtime_view + data_offset, that.runtime_view + data_offset,
+           static_cast<size_t>(hole_offset - data_offset));
+    offset = hole_offset;
+  }
+}
+
+void HostWindow::CopyFromFile(uint64_t base, uint64_t size, int file_fd,
+                              uint64_t file_offset) {
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file_fd,
+                   static_cast<off_t>(file_offset));
+  auto err = errno;
+  CHECK(MAP_FAILED != data)
+      << "Unable to map file into host-mapped memory [" << std::hex << base
+      << ", " << (base + size) << ")" << std::dec << ": " << strerror(err);
+  memcpy(runtime_view + base, data, size);
+  munmap(data, size);
+}
+
+bool HostWindow::TakeFault(uint64_t *addr, bool *is_write,
+                           std::vector<uint64_t> *pages) {
+  if (likely(!num_faulted_pages)) {
+    return false;
+  }
+
+  for (auto i = 0U; i < num_faulted_pages; ++i) {
+    const auto page = faulted_pages[i];
+    void *ret = nullptr;
+    if (page < kWindowSize) {
+      ret = mmap(guest_view + page, kPageSize, PROT_NONE,
+                 MAP_SHARED | MAP_FIXED, fd, static_cast<off_t>(page));
+      pages->push_back(page);
+    } else {
+      ret = mmap(guest_view + page, kPageSize, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+                 -1, 0);
+    }
+    CHECK(MAP_FAILED != ret)
+        << "Unable to restore host-mapped page " << std::hex << page
+        << std::dec;
+  }
+
+  *addr = fault_addr;
+  *is_write = fault_is_write;
+  has_fault = false;
+  num_faulted_pages = 0;
+  return true;
+}
+
+// Lifted code can't be resumed after the faulting access, so instead we
+// patch a scratch page over the faulting page, and let the access complete.
+// A faulting read sees zeros, as on the slow path. A faulting write goes to a
+// private copy of the page, so it is dropped, as on the slow path, but reads
+// of the page still see its contents. The fault is recorded by the runtime
+// before the next hyper call, or once the lifted code returns.
+bool HostWindow::HandleFault(uintptr_t addr, bool is_write) {
+  const auto base = reinterpret_cast<uintptr_t>(guest_view);
+  if (addr < base || addr >= (base + kWindowSize + kPageSize) ||
+      num_faulted_pages >= kMaxNumFaultedPages) {
+    return false;
+  }
+
+  const auto page = (addr - base) & ~(kPageSize - 1ULL);
+  void *ret = MAP_FAILED;
+  if (is_write && page < kWindowSize) {
+    ret = mmap(guest_view + page, kPageSize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_FIXED, fd, static_cast<off_t>(page));
+  } else {
+    ret = mmap(guest_view + page, kPageSize, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+  }
+  if (MAP_FAILED == ret) {
+    return false;
+  }
+
+  faulted_pages[num_faulted_pages++] = page;
+  if (!has_fault) {
+    has_fault = true;
+    fault_is_write = is_write;
+    fault_addr = (addr - base) & (kWindowSize - 1ULL);
+  }
+  return true;
+}
+
+}  // namespace vmill
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_PROGRAM_HOSTWINDOW_H_
+#define VMILL_PROGRAM_HOSTWINDOW_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace vmill {
+
+// A host mapping of a whole 32-bit guest address space, such that guest
+// address `addr` is at host address `GuestView() + addr`.
+//
+// The guest memory lives in a `memfd`, which is mapped twice. The guest view
+// mirrors the guest page permissions, and is what lifted code accesses
+// directly. Invalid accesses through it raise `SIGSEGV`, which is caught and
+// recorded as a guest fault. The runtime view is always readable and
+// writable, and is what the runtime accesses.
+class HostWindow {
+ public:
+  enum : uint64_t {
+    kWindowSize = 1ULL << 32ULL,
+    kMaxNumFaultedPages = 64
+  };
+
+  static std::unique_ptr<HostWindow> Create(void);
+
+  ~HostWindow(void);
+
+  inline uint8_t *GuestView(void) const {
+    return guest_view;
+  }
+
+  inline uint8_t *RuntimeView(void) const {
+    return runtime_view;
+  }
+
+  // Mirror the guest permissions of the pages in `[base, base + size)`.
+  void Protect(uint64_t base, uint64_t size, bool can_read, bool can_write);
+
+  // Zero the pages in `[base, base + size)`, releasing their host memory.
+  void Clear(uint64_t base, uint64_t size);
+
+  // Copy the guest memory of `that` into this window.
+  void CopyFrom(const HostWindow &that);
+
+  // Copy the `size` bytes at `file_offset` in the file `file_fd` into the
+  // guest memory at `base`.
+  void CopyFromFile(uint64_t base, uint64_t size, int file_fd,
+                    uint64_t file_offset);
+
+  // Returns `true` if lifted code faulted while accessing the guest view, and
+  // if so, stores the address and kind of the first such fault. The pages
+  // that were patched over to let lifted code continue past the faults are
+  // mapped back in without any permissions, and added to `pages`.
+  bool TakeFault(uint64_t *addr, bool *is_write,
+                 std::vector<uint64_t> *pages);
+
+  // Handle a fault at `addr` within this window's guest view. Called from
+  // the `SIGSEGV` handler.
+  bool HandleFault(uintptr_t addr, bool is_write);
+
+ private:
+  HostWindow(void) = delete;
+  HostWindow(const HostWindow &) = delete;
+
+  HostWindow(int fd_, unsigned slot_, uint8_t *guest_view_,
+             uint8_t *runtime_view_);
+
+  const int fd;
+  const unsigned slot;
+  uint8_t * const guest_view;
+  uint8_t * const runtime_view;
+
+  // First fault in the guest view since the last call to `TakeFault`.
+  bool has_fault;
+  bool fault_is_write;
+  uint64_t fault_addr;
+
+  // Pages of the guest view that were replaced by scratch pages, so that the
+  // faulting host instructions could complete.
+  unsigned num_faulted_pages;
+  uint64_t faulted_pages[kMaxNumFaultedPages];
+};
+
+}  // namespace vmill
+
+#endif  // VMILL_PROGRAM_HOSTWINDOW_H_
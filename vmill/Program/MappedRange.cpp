@@ -17,6 +17,10 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <memory>
@@ -24,6 +28,10 @@
 #include <utility>
 #include <vector>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "vmill/Program/MappedRange.h"
 #include "vmill/Util/ZoneAllocator.h"
 #include "vmill/Util/Compiler.h"
@@ -42,8 +50,40 @@ class MappedRangeBase;
 class ArrayMemoryMap;
 class EmptyMemoryMap;
 class CopyOnWriteMemoryMap;
+class FileBackedMemoryMap;
+class HostMappedMemoryMap;
 class InvalidMemoryMap;
 
+// A page of a copy-on-write range that has been written to. The clones of a
+// range share its pages until one of them writes to a shared page.
+//
+// The data of a page is allocated on its own, so that it takes up exactly
+// one page of the zone.
+struct SharedPage {
+  uint8_t *data;
+  uint64_t ref_count;
+  ZoneAllocation alloc;
+};
+
+// A memory file that is mapped by file-backed ranges. It is closed once the
+// last range using it goes away.
+struct MemoryFile {
+  MemoryFile(int fd_, dev_t device_, ino_t inode_)
+      : fd(fd_),
+        device(device_),
+        inode(inode_) {}
+
+  ~MemoryFile(void) {
+    close(fd);
+  }
+
+  const int fd;
+
+  // Identifies the file, whichever descriptor it was opened through.
+  const dev_t device;
+  const ino_t inode;
+};
+
 // Basic information about some region of mapped memory within an address space.
 class MappedRangeBase : public MappedRange {
  public:
@@ -57,6 +97,18 @@ class MappedRangeBase : public MappedRange {
   bool code_version_is_valid;
   ZoneAllocation data;
   MemoryMapPtr parent;
+
+  // Pages of a copy-on-write range that no longer come from `parent`. This is
+  // empty until the range is first written to.
+  std::vector<SharedPage *> pages;
+
+  // Memory file mapped by a file-backed range, and the offset of the range's
+  // first byte within that file.
+  std::shared_ptr<MemoryFile> file;
+  uint64_t file_offset;
+
+  // Has a file-backed range been written to?
+  bool is_dirty;
 };
 
 // Implements an invalid range of memory that is unfilled.
@@ -115,6 +167,7 @@ class EmptyMemoryMap : public MappedRangeBase {
   CodeVersion ComputeCodeVersion(void) final;
   void *ToReadWriteVirtualAddress(uint64_t addr) final;
   const void *ToReadOnlyVirtualAddress(uint64_t addr) final;
+  bool IsCopyOnWrite(uint64_t addr) const final;
   MemoryMapPtr Copy(uint64_t clone_base, uint64_t clone_limit) final;
   std::string Provider(void) const final {
     return "empty";
@@ -135,6 +188,7 @@ class CopyOnWriteMemoryMap : public MappedRangeBase {
   void *ToReadWriteVirtualAddress(uint64_t addr) final;
   MemoryMapPtr Copy(uint64_t clone_base, uint64_t clone_limit) final;
   const void *ToReadOnlyVirtualAddress(uint64_t addr) final;
+  bool IsCopyOnWrite(uint64_t addr) const final;
 
   std::string Provider(void) const final {
     std::stringstream ss;
@@ -144,6 +198,72 @@ class CopyOnWriteMemoryMap : public MappedRangeBase {
 
  private:
   using MappedRangeBase::MappedRangeBase;
+
+  // Share the pages of this range in `[clone_base, clone_limit)` with `that`.
+  void SharePages(CopyOnWriteMemoryMap *that, uint64_t clone_base,
+                  uint64_t clone_limit);
+
+  // Returns the page containing `address`, or `nullptr` if the page is still
+  // read from `parent`.
+  inline SharedPage *PageFor(uint64_t address) const {
+    if (likely(pages.empty())) {
+      return nullptr;
+    }
+    return pages[(address - base_address) / kPageSize];
+  }
+};
+
+// Implements a range of memory whose initial contents live in a memory file,
+// which the range maps privately. The host kernel copies the pages of the
+// file as they are written to, so a clone of a range that hasn't been written
+// to is just another private mapping of the file.
+class FileBackedMemoryMap : public MappedRangeBase {
+ public:
+  FileBackedMemoryMap(uint64_t base_address_, uint64_t limit_address_,
+                      const char *name_, uint64_t offset_,
+                      std::shared_ptr<MemoryFile> file_,
+                      uint64_t file_offset_);
+
+  explicit FileBackedMemoryMap(FileBackedMemoryMap *steal);
+
+  virtual ~FileBackedMemoryMap(void);
+
+  bool Read(uint64_t address, uint8_t *out_val) final;
+  bool Write(uint64_t address, uint8_t val) final;
+  MemoryMapPtr Clone(void) final;
+  CodeVersion ComputeCodeVersion(void) final;
+  void *ToReadWriteVirtualAddress(uint64_t addr) final;
+  const void *ToReadOnlyVirtualAddress(uint64_t addr) final;
+  MemoryMapPtr Copy(uint64_t clone_base, uint64_t clone_limit) final;
+
+  std::string Provider(void) const final {
+    return "file-backed";
+  }
+};
+
+// Implements a range of memory that lives in a host mapping of the whole
+// guest address space. The mapping is owned by the address space.
+class HostMappedMemoryMap : public MappedRangeBase {
+ public:
+  HostMappedMemoryMap(uint64_t base_address_, uint64_t limit_address_,
+                      const char *name_, uint64_t offset_,
+                      uint8_t *host_base_);
+
+  virtual ~HostMappedMemoryMap(void);
+  bool Read(uint64_t address, uint8_t *out_val) final;
+  bool Write(uint64_t address, uint8_t val) final;
+  MemoryMapPtr Clone(void) final;
+  CodeVersion ComputeCodeVersion(void) final;
+  void *ToReadWriteVirtualAddress(uint64_t addr) final;
+  const void *ToReadOnlyVirtualAddress(uint64_t addr) final;
+  MemoryMapPtr Copy(uint64_t clone_base, uint64_t clone_limit) final;
+
+  std::string Provider(void) const final {
+    return "host-mapped";
+  }
+
+ private:
+  uint8_t * const host_base;
 };
 
 static_assert(sizeof(ArrayMemoryMap) == sizeof(MappedRangeBase),
@@ -158,6 +278,9 @@ static_assert(sizeof(InvalidMemoryMap) == sizeof(MappedRangeBase),
 static_assert(sizeof(CopyOnWriteMemoryMap) == sizeof(MappedRangeBase),
               "Vtable overwriting won't work!");
 
+static_assert(sizeof(FileBackedMemoryMap) == sizeof(MappedRangeBase),
+              "Vtable overwriting won't work!");
+
 MappedRangeBase::MappedRangeBase(
     uint64_t base_address_, uint64_t limit_address_,
     const char *name_, uint64_t offset_)
@@ -165,7 +288,10 @@ MappedRangeBase::MappedRangeBase(
       code_version(static_cast<CodeVersion>(0)),
       code_version_is_valid(false),
       data{nullptr, 0},
-      parent(nullptr) {}
+      parent(nullptr),
+      file(nullptr),
+      file_offset(0),
+      is_dirty(false) {}
 
 MappedRangeBase::~MappedRangeBase(void) {
   CHECK(!data.base);
@@ -249,12 +375,11 @@ MemoryMapPtr ArrayMemoryMap::Copy(uint64_t clone_base, uint64_t clone_limit) {
       clone_base, clone_limit,
       Name(), Offset() + (clone_base - BaseAddress()));
 
-  for (; clone_base < clone_limit; ++clone_base) {
-    if (Contains(clone_base)) {
-      uint8_t val = 0;
-      Read(clone_base, &val);
-      array_backed->Write(clone_base, val);
-    }
+  const auto copy_base = std::max(clone_base, BaseAddress());
+  const auto copy_limit = std::min(clone_limit, LimitAddress());
+  if (copy_base < copy_limit) {
+    memcpy(&(array_backed->data.base[copy_base - clone_base]),
+           &(data.base[copy_base - base_address]), copy_limit - copy_base);
   }
   return array_backed;
 }
@@ -263,8 +388,10 @@ MemoryMapPtr ArrayMemoryMap::Copy(uint64_t clone_base, uint64_t clone_limit) {
 // map, then we convert this array memory map into a copy-on-write memory map,
 // and then clone it.
 MemoryMapPtr ArrayMemoryMap::Clone(void) {
+  const auto owner = OwnerId();
   auto parent = std::make_shared<ArrayMemoryMap>(this);
   auto self = new (this) CopyOnWriteMemoryMap(parent);
+  self->SetOwnerId(owner);
   return self->Clone();
 }
 
@@ -311,18 +438,32 @@ CodeVersion EmptyMemoryMap::ComputeCodeVersion(void) {
   return static_cast<CodeVersion>(0);
 }
 
+// Anonymous memory is often reserved in bulk and only sparsely touched, so
+// instead of allocating the whole range on the first write, this range turns
+// into a copy-on-write view of an empty range, which allocates the pages that
+// are written to one at a time.
 void *EmptyMemoryMap::ToReadWriteVirtualAddress(uint64_t addr) {
-  auto self = new (this) ArrayMemoryMap(BaseAddress(), LimitAddress(),
-                                        Name(), Offset());
+  const auto owner = OwnerId();
+  auto zeroes = std::make_shared<EmptyMemoryMap>(BaseAddress(), LimitAddress(),
+                                                 Name(), Offset());
+  auto self = new (this) CopyOnWriteMemoryMap(zeroes);
+  self->SetOwnerId(owner);
   return self->ToReadWriteVirtualAddress(addr);
 }
 
-static const uint8_t kZeroes[512 / 8] = {};
+// Big enough to back a whole page, so that copy-on-write ranges can copy
+// their pages out of an empty range.
+static const uint8_t kZeroes[kPageSize] = {};
 
 const void *EmptyMemoryMap::ToReadOnlyVirtualAddress(uint64_t addr) {
   return &(kZeroes[0]);
 }
 
+// The first write replaces the shared zeroes with real memory.
+bool EmptyMemoryMap::IsCopyOnWrite(uint64_t) const {
+  return true;
+}
+
 MemoryMapPtr EmptyMemoryMap::Copy(uint64_t clone_base,
                                   uint64_t clone_limit) {
   return std::make_shared<EmptyMemoryMap>(
@@ -330,6 +471,24 @@ MemoryMapPtr EmptyMemoryMap::Copy(uint64_t clone_base,
       Name(), Offset() + (clone_base - BaseAddress()));
 }
 
+// Pages are allocated from the same zone as the data of array-backed ranges.
+// They are always filled in by copying a whole page, so they aren't zeroed.
+static SharedPage *AllocatePage(void) {
+  auto page = new SharedPage;
+  page->alloc = ArrayMemoryMap::gAllocator.Allocate(kPageSize,
+                                                    false /* zeroed */);
+  page->data = page->alloc.base;
+  page->ref_count = 1;
+  return page;
+}
+
+static void ReleasePage(SharedPage *page) {
+  if (page && !--(page->ref_count)) {
+    ArrayMemoryMap::gAllocator.Free(page->alloc);
+    delete page;
+  }
+}
+
 CopyOnWriteMemoryMap::CopyOnWriteMemoryMap(MemoryMapPtr parent_)
     : MappedRangeBase(parent_->BaseAddress(), parent_->LimitAddress(),
                       parent_->Name(), parent_->Offset()) {
@@ -342,20 +501,28 @@ CopyOnWriteMemoryMap::CopyOnWriteMemoryMap(MemoryMapPtr parent_)
 CopyOnWriteMemoryMap::CopyOnWriteMemoryMap(MemoryMapPtr parent_, uint64_t base,
                                            uint64_t limit)
     : MappedRangeBase(base, limit, parent_->Name(),
-                      parent_->Offset() + (base - parent->BaseAddress())) {
+                      parent_->Offset() + (base - parent_->BaseAddress())) {
   while (parent_) {
     parent = parent_;
     parent_ = reinterpret_cast<MappedRangeBase &>(*parent).parent;
   }
 }
 
-CopyOnWriteMemoryMap::~CopyOnWriteMemoryMap(void) {}
+CopyOnWriteMemoryMap::~CopyOnWriteMemoryMap(void) {
+  for (auto page : pages) {
+    ReleasePage(page);
+  }
+}
 
 bool CopyOnWriteMemoryMap::IsValid(void) const {
   return parent->IsValid();
 }
 
 bool CopyOnWriteMemoryMap::Read(uint64_t address, uint8_t *out_val) {
+  if (auto page = PageFor(address)) {
+    *out_val = page->data[address % kPageSize];
+    return true;
+  }
   return parent->Read(address, out_val);
 }
 
@@ -365,39 +532,289 @@ bool CopyOnWriteMemoryMap::Write(uint64_t address, uint8_t val) {
   return true;
 }
 
+void CopyOnWriteMemoryMap::SharePages(CopyOnWriteMemoryMap *that,
+                                      uint64_t clone_base,
+                                      uint64_t clone_limit) {
+  if (pages.empty()) {
+    return;
+  }
+
+  const auto first = (clone_base - base_address) / kPageSize;
+  const auto last = (clone_limit - base_address) / kPageSize;
+  that->pages.assign(pages.begin() + static_cast<ptrdiff_t>(first),
+                     pages.begin() + static_cast<ptrdiff_t>(last));
+  for (auto page : that->pages) {
+    if (page) {
+      page->ref_count++;
+    }
+  }
+}
+
+// Cloning only shares the pages; they are copied once they're written to.
 MemoryMapPtr CopyOnWriteMemoryMap::Clone(void) {
-  return std::make_shared<CopyOnWriteMemoryMap>(parent);
+  auto clone = std::make_shared<CopyOnWriteMemoryMap>(parent);
+  SharePages(clone.get(), BaseAddress(), LimitAddress());
+  return clone;
 }
 
+// Hashing the pages one at a time gives the same hash as hashing the whole
+// range at once, so the code version doesn't depend on which pages have been
+// written to.
 CodeVersion CopyOnWriteMemoryMap::ComputeCodeVersion(void) {
-  return parent->ComputeCodeVersion();
+  if (pages.empty()) {
+    return parent->ComputeCodeVersion();
+  } else if (code_version_is_valid) {
+    return code_version;
+  }
+
+  Hasher<uint64_t> hasher;
+  for (auto addr = base_address; addr < limit_address; addr += kPageSize) {
+    hasher.Update(ToReadOnlyVirtualAddress(addr), kPageSize);
+  }
+  code_version = static_cast<CodeVersion>(hasher.Digest());
+  code_version_is_valid = true;
+  return code_version;
 }
 
+// Only the page containing `address` is copied, and only if it is shared
+// with the parent or with a clone.
 void *CopyOnWriteMemoryMap::ToReadWriteVirtualAddress(uint64_t address) {
-  auto parent_ptr = parent;
-  auto base_addr = BaseAddress();
-  auto limit_addr = LimitAddress();
-
-  parent.reset();
+  if (unlikely(pages.empty())) {
+    pages.resize(Size() / kPageSize, nullptr);
+  }
 
-  auto self = new (this) ArrayMemoryMap(base_addr, limit_addr,
-                                        parent_ptr->Name(), Offset());
-  for (uint64_t index = 0; base_addr < limit_addr; ++base_addr, ++index) {
-    (void) parent_ptr->Read(base_addr, &(self->data.base[index]));
+  auto &page = pages[(address - base_address) / kPageSize];
+  if (!page) {
+    const auto page_addr = address & kPageMask;
+    page = AllocatePage();
+    memcpy(page->data, parent->ToReadOnlyVirtualAddress(page_addr),
+           kPageSize);
+
+  } else if (page->ref_count > 1) {
+    auto shared_page = page;
+    page = AllocatePage();
+    memcpy(page->data, shared_page->data, kPageSize);
+    ReleasePage(shared_page);
   }
-  return self->ToReadWriteVirtualAddress(address);
+
+  code_version_is_valid = false;
+  return &(page->data[address % kPageSize]);
 }
 
 MemoryMapPtr CopyOnWriteMemoryMap::Copy(uint64_t clone_base,
                                         uint64_t clone_limit) {
-  return std::make_shared<CopyOnWriteMemoryMap>(
+  auto copy = std::make_shared<CopyOnWriteMemoryMap>(
       parent, clone_base, clone_limit);
+  SharePages(copy.get(), clone_base, clone_limit);
+  return copy;
 }
 
 const void *CopyOnWriteMemoryMap::ToReadOnlyVirtualAddress(uint64_t address) {
+  if (auto page = PageFor(address)) {
+    return &(page->data[address % kPageSize]);
+  }
   return parent->ToReadOnlyVirtualAddress(address);
 }
 
+bool CopyOnWriteMemoryMap::IsCopyOnWrite(uint64_t address) const {
+  auto page = PageFor(address);
+  return !page || page->ref_count > 1;
+}
+
+// Maps `size` bytes of `file`, starting at `offset`, copy-on-write.
+static uint8_t *MapFilePrivately(const MemoryFile &file, uint64_t offset,
+                                 uint64_t size) {
+  auto addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_NORESERVE, file.fd,
+                   static_cast<off_t>(offset));
+  auto err = errno;
+  CHECK(MAP_FAILED != addr)
+      << "Unable to map " << std::hex << size << " bytes of memory file at "
+      << "offset " << offset << std::dec << ": " << strerror(err);
+  return reinterpret_cast<uint8_t *>(addr);
+}
+
+FileBackedMemoryMap::FileBackedMemoryMap(
+    uint64_t base_address_, uint64_t limit_address_, const char *name_,
+    uint64_t offset_, std::shared_ptr<MemoryFile> file_,
+    uint64_t file_offset_)
+    : MappedRangeBase(base_address_, limit_address_, name_, offset_) {
+  file = std::move(file_);
+  file_offset = file_offset_;
+  data.base = MapFilePrivately(*file, file_offset, Size());
+  data.size = Size();
+}
+
+FileBackedMemoryMap::FileBackedMemoryMap(FileBackedMemoryMap *steal)
+    : MappedRangeBase(steal->BaseAddress(), steal->LimitAddress(),
+                      steal->Name(), steal->Offset()) {
+  CHECK(steal->data.base != nullptr);
+  data = steal->data;
+  file = std::move(steal->file);
+  file_offset = steal->file_offset;
+  is_dirty = steal->is_dirty;
+  steal->data.Reset();
+}
+
+FileBackedMemoryMap::~FileBackedMemoryMap(void) {
+  if (data.base) {
+    munmap(data.base, data.size);
+    data.Reset();
+  }
+}
+
+bool FileBackedMemoryMap::Read(uint64_t address, uint8_t *out_val) {
+  *out_val = data.base[address - base_address];
+  return true;
+}
+
+bool FileBackedMemoryMap::Write(uint64_t address, uint8_t val) {
+  is_dirty = true;
+  data.base[address - base_address] = val;
+  return true;
+}
+
+// Until this range is written to, its clones just map the file again. After
+// that, like an `ArrayMemoryMap`, this range hands its mapping over to a new
+// range, and turns into a copy-on-write view of it.
+MemoryMapPtr FileBackedMemoryMap::Clone(void) {
+  if (!is_dirty) {
+    return std::make_shared<FileBackedMemoryMap>(
+        BaseAddress(), LimitAddress(), Name(), Offset(), file, file_offset);
+  }
+  const auto owner = OwnerId();
+  auto parent = std::make_shared<FileBackedMemoryMap>(this);
+  auto self = new (this) CopyOnWriteMemoryMap(parent);
+  self->SetOwnerId(owner);
+  return self->Clone();
+}
+
+CodeVersion FileBackedMemoryMap::ComputeCodeVersion(void) {
+  if (code_version_is_valid) {
+    return code_version;
+  }
+  code_version = static_cast<CodeVersion>(Hash(data.base, Size()));
+  code_version_is_valid = true;
+  return code_version;
+}
+
+void *FileBackedMemoryMap::ToReadWriteVirtualAddress(uint64_t address) {
+  DCHECK(address >= base_address);
+  DCHECK(address < limit_address);
+  is_dirty = true;
+  return &(data.base[address - base_address]);
+}
+
+const void *FileBackedMemoryMap::ToReadOnlyVirtualAddress(uint64_t address) {
+  DCHECK(address >= base_address);
+  DCHECK(address < limit_address);
+  return &(data.base[address - base_address]);
+}
+
+// Copies of a range that hasn't been written to map the same part of the
+// file. After that, like `Clone`, this range hands its mapping over to a new
+// range, and the copy is a copy-on-write view of part of it.
+MemoryMapPtr FileBackedMemoryMap::Copy(uint64_t clone_base,
+                                       uint64_t clone_limit) {
+  DCHECK(base_address <= clone_base);
+  DCHECK(clone_limit <= limit_address);
+  if (!is_dirty) {
+    return std::make_shared<FileBackedMemoryMap>(
+        clone_base, clone_limit, Name(),
+        Offset() + (clone_base - BaseAddress()), file,
+        file_offset + (clone_base - base_address));
+  }
+  const auto owner = OwnerId();
+  auto parent = std::make_shared<FileBackedMemoryMap>(this);
+  auto self = new (this) CopyOnWriteMemoryMap(parent);
+  self->SetOwnerId(owner);
+  return self->Copy(clone_base, clone_limit);
+}
+
+HostMappedMemoryMap::HostMappedMemoryMap(
+    uint64_t base_address_, uint64_t limit_address_, const char *name_,
+    uint64_t offset_, uint8_t *host_base_)
+    : MappedRangeBase(base_address_, limit_address_, name_, offset_),
+      host_base(host_base_) {}
+
+HostMappedMemoryMap::~HostMappedMemoryMap(void) {}
+
+bool HostMappedMemoryMap::Read(uint64_t address, uint8_t *out_val) {
+  *out_val = host_base[address];
+  return true;
+}
+
+bool HostMappedMemoryMap::Write(uint64_t address, uint8_t val) {
+  host_base[address] = val;
+  return true;
+}
+
+// A clone can't share the host mapping, so it gets its own copy of the data.
+MemoryMapPtr HostMappedMemoryMap::Clone(void) {
+  auto array_backed = std::make_shared<ArrayMemoryMap>(
+      BaseAddress(), LimitAddress(), Name(), Offset());
+  memcpy(array_backed->data.base, &(host_base[BaseAddress()]), Size());
+  return array_backed;
+}
+
+CodeVersion HostMappedMemoryMap::ComputeCodeVersion(void) {
+  if (code_version_is_valid) {
+    return code_version;
+  }
+  code_version = static_cast<CodeVersion>(
+      Hash(&(host_base[BaseAddress()]), Size()));
+  code_version_is_valid = true;
+  return code_version;
+}
+
+void *HostMappedMemoryMap::ToReadWriteVirtualAddress(uint64_t address) {
+  DCHECK(address >= base_address);
+  DCHECK(address < limit_address);
+  return &(host_base[address]);
+}
+
+const void *HostMappedMemoryMap::ToReadOnlyVirtualAddress(uint64_t address) {
+  DCHECK(address >= base_address);
+  DCHECK(address < limit_address);
+  return &(host_base[address]);
+}
+
+MemoryMapPtr HostMappedMemoryMap::Copy(uint64_t clone_base,
+                                       uint64_t clone_limit) {
+  return std::make_shared<HostMappedMemoryMap>(
+      clone_base, clone_limit, Name(),
+      Offset() + (clone_base - BaseAddress()), host_base);
+}
+
+// The most recently opened memory file. The ranges created from one file
+// (e.g. all of the ranges of a snapshot) share it, rather than each one
+// holding its own descriptor.
+static std::weak_ptr<MemoryFile> gLastMemoryFile;
+
+static std::shared_ptr<MemoryFile> OpenMemoryFile(int fd_) {
+  struct stat info = {};
+  auto ret = fstat(fd_, &info);
+  auto err = errno;
+  CHECK(!ret)
+      << "Unable to stat memory file descriptor " << fd_ << ": "
+      << strerror(err);
+
+  auto file = gLastMemoryFile.lock();
+  if (file && file->device == info.st_dev && file->inode == info.st_ino) {
+    return file;
+  }
+
+  auto fd = dup(fd_);
+  err = errno;
+  CHECK(-1 != fd)
+      << "Unable to duplicate memory file descriptor " << fd_ << ": "
+      << strerror(err);
+
+  file = std::make_shared<MemoryFile>(fd, info.st_dev, info.st_ino);
+  gLastMemoryFile = file;
+  return file;
+}
+
 }  // namespace
 
 MemoryMapPtr MappedRange::Create(uint64_t base_address_,
@@ -409,6 +826,27 @@ MemoryMapPtr MappedRange::Create(uint64_t base_address_,
   return ptr;
 }
 
+MemoryMapPtr MappedRange::CreateFileBacked(uint64_t base_address_,
+                                           uint64_t limit_address_,
+                                           const char *name_,
+                                           uint64_t offset_,
+                                           int fd_, uint64_t fd_offset_) {
+  MemoryMapPtr ptr(new FileBackedMemoryMap(
+      base_address_, limit_address_, name_, offset_, OpenMemoryFile(fd_),
+      fd_offset_));
+  return ptr;
+}
+
+MemoryMapPtr MappedRange::CreateHostMapped(uint64_t base_address_,
+                                           uint64_t limit_address_,
+                                           const char *name_,
+                                           uint64_t offset_,
+                                           uint8_t *host_base_) {
+  MemoryMapPtr ptr(new HostMappedMemoryMap(base_address_, limit_address_,
+                                           name_, offset_, host_base_));
+  return ptr;
+}
+
 MemoryMapPtr MappedRange::CreateInvalid(uint64_t base_address_,
                                         uint64_t limit_address_) {
   MemoryMapPtr ptr(new InvalidMemoryMap(base_address_, limit_address_, "", 0));
@@ -419,7 +857,8 @@ MappedRange::MappedRange(uint64_t base_address_, uint64_t limit_address_,
                          const char *name_, uint64_t offset_)
     : base_address(base_address_),
       limit_address(limit_address_),
-      offset(offset_) {
+      offset(offset_),
+      owner_id(0) {
   if (!name_) {
     name[0] = '\0';
   } else if (name_ != &(name[0])) {
@@ -440,4 +879,8 @@ const void *MappedRange::ToReadOnlyVirtualAddress(uint64_t) {
   return nullptr;
 }
 
+bool MappedRange::IsCopyOnWrite(uint64_t) const {
+  return false;
+}
+
 }  // namespace vmill
@@ -38,6 +38,23 @@ class MappedRange {
   static MemoryMapPtr CreateInvalid(uint64_t base_address_,
                                     uint64_t limit_address_);
 
+  // Creates a range whose initial contents are the bytes at `fd_offset_` in
+  // the memory file `fd_`. The range maps the file privately, so that the
+  // host kernel copies its pages as they are written to. `fd_` is duplicated
+  // (once for all of the ranges created from the same file), so the caller
+  // still owns it.
+  static MemoryMapPtr CreateFileBacked(uint64_t base_address_,
+                                       uint64_t limit_address_,
+                                       const char *name_, uint64_t offset_,
+                                       int fd_, uint64_t fd_offset_);
+
+  // Creates a range whose bytes live in a host mapping of the whole guest
+  // address space, where guest address `addr` is at `host_base + addr`.
+  static MemoryMapPtr CreateHostMapped(uint64_t base_address_,
+                                       uint64_t limit_address_,
+                                       const char *name_, uint64_t offset_,
+                                       uint8_t *host_base_);
+
   virtual ~MappedRange(void);
 
   virtual bool IsValid(void) const = 0;
@@ -66,6 +83,17 @@ class MappedRange {
     return base_address <= address && address < limit_address;
   }
 
+  // Identifies the address space that last made sure that it was the only
+  // one using this range, or is zero. See `AddressSpace::PrivateRange`. Ranges
+  // that turn themselves into another kind of range in place keep their owner.
+  ALWAYS_INLINE uint64_t OwnerId(void) const {
+    return owner_id;
+  }
+
+  ALWAYS_INLINE void SetOwnerId(uint64_t owner_id_) {
+    owner_id = owner_id_;
+  }
+
   ALWAYS_INLINE bool LessThan(const MemoryMapPtr &left,
                               const MemoryMapPtr &right) {
     return left->BaseAddress() < right->BaseAddress();
@@ -96,6 +124,10 @@ class MappedRange {
   // Return the virtual address of the memory backing `addr`.
   virtual const void *ToReadOnlyVirtualAddress(uint64_t addr);
 
+  // Returns `true` if the memory returned by `ToReadOnlyVirtualAddress(addr)`
+  // might stop backing `addr` once `addr` is written to.
+  virtual bool IsCopyOnWrite(uint64_t addr) const;
+
   // Type of this mapped range.
   virtual std::string Provider(void) const = 0;
 
@@ -110,6 +142,8 @@ class MappedRange {
   char name[256];
   const uint64_t offset;
 
+  uint64_t owner_id;
+
  private:
   MappedRange(const MappedRange &) = delete;
   MappedRange(void) = delete;
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glog/logging.h>
+
+#include "vmill/Program/PageTable.h"
+
+namespace vmill {
+namespace {
+
+// Returns the shift of the page number bits indexing the root of a table
+// for an address space with the address mask `addr_mask`.
+static uint64_t TopShift(uint64_t addr_mask, uint64_t page_shift,
+                         uint64_t level_bits) {
+  const auto num_bits = static_cast<uint64_t>(__builtin_popcountll(addr_mask));
+  CHECK(num_bits > page_shift)
+      << "Address mask " << std::hex << addr_mask << std::dec
+      << " is too small for a page table.";
+  const auto num_page_bits = num_bits - page_shift;
+  const auto num_levels = (num_page_bits + level_bits - 1) / level_bits;
+  return (num_levels - 1) * level_bits;
+}
+
+}  // namespace
+
+PageTable::PageTable(uint64_t addr_mask)
+    : top_shift(TopShift(addr_mask, kPageShift, kLevelBits)),
+      root(new Node()) {
+  root->ref_count = 1;
+}
+
+PageTable::PageTable(const PageTable &that)
+    : top_shift(that.top_shift),
+      root(that.root) {
+  root->ref_count++;
+}
+
+PageTable &PageTable::operator=(const PageTable &that) {
+  CHECK_EQ(top_shift, that.top_shift);
+  that.root->ref_count++;
+  ReleaseLevel(root, top_shift);
+  root = that.root;
+  return *this;
+}
+
+PageTable::~PageTable(void) {
+  ReleaseLevel(root, top_shift);
+}
+
+// Drops a reference to `level`, whose entries are indexed by the page number
+// bits at `shift`, and frees it along with any children that are no longer
+// referenced.
+void PageTable::ReleaseLevel(void *level, uint64_t shift) {
+  if (!shift) {
+    auto leaf = reinterpret_cast<Leaf *>(level);
+    if (!--(leaf->ref_count)) {
+      delete leaf;
+    }
+    return;
+  }
+
+  auto node = reinterpret_cast<Node *>(level);
+  if (--(node->ref_count)) {
+    return;
+  }
+
+  for (auto child : node->children) {
+    if (child) {
+      ReleaseLevel(child, shift - kLevelBits);
+    }
+  }
+  delete node;
+}
+
+// The copy of a node adds a reference to each of its children.
+void *PageTable::MakePrivate(void *level, uint64_t shift) {
+  if (!shift) {
+    auto leaf = reinterpret_cast<Leaf *>(level);
+    if (leaf->ref_count == 1) {
+      return leaf;
+    }
+    auto copy = new Leaf(*leaf);
+    copy->ref_count = 1;
+    leaf->ref_count--;
+    return copy;
+  }
+
+  auto node = reinterpret_cast<Node *>(level);
+  if (node->ref_count == 1) {
+    return node;
+  }
+
+  auto copy = new Node(*node);
+  copy->ref_count = 1;
+  for (auto child : copy->children) {
+    if (!child) {
+      continue;
+    } else if (shift == kLevelBits) {
+      reinterpret_cast<Leaf *>(child)->ref_count++;
+    } else {
+      reinterpret_cast<Node *>(child)->ref_count++;
+    }
+  }
+  node->ref_count--;
+  return copy;
+}
+
+PageTable::Leaf *PageTable::GetPrivateLeaf(uint64_t page_addr) {
+  const auto page_num = page_addr >> kPageShift;
+  root = reinterpret_cast<Node *>(MakePrivate(root, top_shift));
+
+  auto node = root;
+  for (auto shift = top_shift; shift > kLevelBits; shift -= kLevelBits) {
+    auto &child = node->children[(page_num >> shift) & kLevelMask];
+    if (!child) {
+      auto new_node = new Node();
+      new_node->ref_count = 1;
+      child = new_node;
+    } else {
+      child = MakePrivate(child, shift - kLevelBits);
+    }
+    node = reinterpret_cast<Node *>(child);
+  }
+
+  auto &leaf = node->children[(page_num >> kLevelBits) & kLevelMask];
+  if (!leaf) {
+    auto new_leaf = new Leaf();
+    new_leaf->ref_count = 1;
+    leaf = new_leaf;
+  } else {
+    leaf = MakePrivate(leaf, 0);
+  }
+  return reinterpret_cast<Leaf *>(leaf);
+}
+
+// Works one leaf at a time, so that the interior levels are only walked once
+// per leaf.
+void PageTable::SetPermissions(uint64_t base, uint64_t limit,
+                               uint8_t perms) {
+  const auto leaf_size = kLevelSize << kPageShift;
+  for (auto addr = base; addr < limit; ) {
+    auto leaf = GetPrivateLeaf(addr);
+    auto leaf_limit = (addr & ~(leaf_size - 1)) + leaf_size;
+
+    // The last leaf of a 64-bit address space ends at zero.
+    if (!leaf_limit || leaf_limit > limit) {
+      leaf_limit = limit;
+    }
+
+    for (; addr < leaf_limit; addr += (1ULL << kPageShift)) {
+      leaf->perms[(addr >> kPageShift) & kLevelMask] = perms;
+    }
+  }
+}
+
+void PageTable::Clear(void) {
+  ReleaseLevel(root, top_shift);
+  root = new Node();
+  root->ref_count = 1;
+}
+
+}  // namespace vmill
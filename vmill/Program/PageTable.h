@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2017 Trail of Bits, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef VMILL_PROGRAM_PAGETABLE_H_
+#define VMILL_PROGRAM_PAGETABLE_H_
+
+#include <cstdint>
+
+#include "vmill/Util/Compiler.h"
+
+namespace vmill {
+
+enum : uint8_t {
+  kPageIsReadable = 1 << 0,
+  kPageIsWritable = 1 << 1,
+  kPageIsExecutable = 1 << 2
+};
+
+// A multi-level radix table of the page permissions of an address space,
+// much like the page tables of a real MMU. Interior levels and leaves are
+// only allocated for the parts of the address space that have ever been
+// mapped, and updates only touch the entries of the pages being changed.
+//
+// Copies of a table share their levels. The levels are reference counted,
+// and a shared level is copied just before it is changed, so copying a table
+// takes constant time, and changes only copy the levels on the path to the
+// changed entries.
+class PageTable {
+ public:
+  // `addr_mask` is the mask of valid addresses of the address space, and
+  // decides how many levels the table has.
+  explicit PageTable(uint64_t addr_mask);
+
+  PageTable(const PageTable &that);
+
+  // Make this table share the levels of `that`, which must be of an address
+  // space with the same address mask.
+  PageTable &operator=(const PageTable &that);
+
+  ~PageTable(void);
+
+  // Returns the permissions of the page-aligned address `page_addr`.
+  inline uint8_t Find(uint64_t page_addr) const {
+    const auto page_num = page_addr >> kPageShift;
+    const void *node = root;
+    for (auto shift = top_shift; shift; shift -= kLevelBits) {
+      node = reinterpret_cast<const Node *>(node)->children[
+          (page_num >> shift) & kLevelMask];
+      if (unlikely(!node)) {
+        return 0;
+      }
+    }
+    return reinterpret_cast<const Leaf *>(node)->perms[page_num & kLevelMask];
+  }
+
+  // Set the permissions of the pages in `[base, limit)`.
+  void SetPermissions(uint64_t base, uint64_t limit, uint8_t perms);
+
+  // Forget about every page.
+  void Clear(void);
+
+ private:
+  PageTable(void) = delete;
+
+  enum : uint64_t {
+    kPageShift = 12,
+    kLevelBits = 9,
+    kLevelSize = 1ULL << kLevelBits,
+    kLevelMask = kLevelSize - 1ULL
+  };
+
+  struct Node {
+    uint64_t ref_count;
+    void *children[kLevelSize];
+  };
+
+  struct Leaf {
+    uint64_t ref_count;
+    uint8_t perms[kLevelSize];
+  };
+
+  // Returns the leaf containing the entry of `page_addr`, allocating it and
+  // any missing interior levels, and copying any shared ones.
+  Leaf *GetPrivateLeaf(uint64_t page_addr);
+
+  // Returns `level`, or a copy of it if it is shared with another table.
+  static void *MakePrivate(void *level, uint64_t shift);
+
+  static void ReleaseLevel(void *level, uint64_t shift);
+
+  // Shift of the page number bits that index into `root`. Every level below
+  // the root takes `kLevelBits` fewer bits, down to the leaves at zero.
+  const uint64_t top_shift;
+
+  Node *root;
+};
+
+}  // namespace vmill
+
+#endif  // VMILL_PROGRAM_PAGETABLE_H_
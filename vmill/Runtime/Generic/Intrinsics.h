@@ -35,6 +35,12 @@ extern void __vmill_yield(vmill::Task *task);
 [[gnu::used]]
 extern void __vmill_set_location(addr_t pc, vmill::TaskStopLocation loc);
 
+// Records the first fault of lifted code that directly accessed host-mapped
+// memory since the last call, if any. Returns `true` if there was such a
+// fault, in which case the lifted code has been running on scratch pages
+// since, and must not perform any hyper calls.
+extern bool __vmill_record_host_fault(Memory *memory);
+
 [[gnu::used, gnu::const]]
 extern Memory *__vmill_allocate_address_space(void);
 
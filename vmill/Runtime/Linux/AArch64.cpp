@@ -82,6 +82,13 @@ extern "C" {
 Memory *__remill_async_hyper_call(
     State &state, addr_t ret_addr, Memory *memory) {
 
+  // Don't make system calls on behalf of lifted code that has already
+  // faulted on host-mapped memory.
+  if (__vmill_record_host_fault(memory)) {
+    __vmill_set_location(ret_addr, vmill::kTaskStoppedAtError);
+    return memory;
+  }
+
   switch (state.hyper_call) {
     case AsyncHyperCall::kAArch64SupervisorCall: {
       AArch64SupervisorCall syscall;
@@ -106,6 +113,11 @@ Memory *__remill_async_hyper_call(
 Memory *__remill_sync_hyper_call(
     State &state, Memory *memory, SyncHyperCall::Name call) {
 
+  if (__vmill_record_host_fault(memory)) {
+    __vmill_set_location(state.gpr.pc.aword, vmill::kTaskStoppedAtError);
+    return memory;
+  }
+
   switch (call) {
     default:
       STRACE_ERROR(sync_hyper_call, "%u", call);
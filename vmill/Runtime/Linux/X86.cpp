@@ -213,6 +213,13 @@ extern "C" {
 Memory *__remill_async_hyper_call(
     State &state, addr_t ret_addr, Memory *memory) {
 
+  // Don't make system calls on behalf of lifted code that has already
+  // faulted on host-mapped memory.
+  if (__vmill_record_host_fault(memory)) {
+    __vmill_set_location(ret_addr, vmill::kTaskStoppedAtError);
+    return nullptr;
+  }
+
   switch (state.hyper_call) {
 #if 32 == ADDRESS_SIZE_BITS
     case AsyncHyperCall::kX86SysEnter: {
@@ -268,6 +275,11 @@ Memory *__remill_sync_hyper_call(
 
   auto task = __vmill_current();
 
+  if (__vmill_record_host_fault(mem)) {
+    __vmill_set_location(state.gpr.rip.aword, vmill::kTaskStoppedAtError);
+    return mem;
+  }
+
   switch (call) {
     case SyncHyperCall::kX86SetSegmentES:
       STRACE_ERROR(sync_hyper_call, "kX86SetSegmentES index=%u rpi=%u ti=%u",
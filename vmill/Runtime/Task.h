@@ -67,7 +67,8 @@ enum MemoryValueType : uint16_t {
   kMemoryValueTypeInvalid,
   kMemoryValueTypeInteger,
   kMemoryValueTypeFloatingPoint,
-  kMemoryValueTypeInstruction
+  kMemoryValueTypeInstruction,
+  kMemoryValueTypeVector
 };
 
 // A task is like a thread, but really, it's the runtime that gives a bit more
@@ -39,6 +39,7 @@ enum AreaPreferences : uint64_t {
   kAreaAddressSpace     = 0x20000000000ULL + kAreaBase,
   kAreaCoroutineStacks  = 0x30000000000ULL + kAreaBase,
   kAreaRuntimeHeap      = 0x40000000000ULL + kAreaBase,
+  kAreaHostWindows      = 0x50000000000ULL + kAreaBase,
 };
 
 enum : size_t {
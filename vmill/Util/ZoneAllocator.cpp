@@ -16,66 +16,93 @@
 
 #include <glog/logging.h>
 
+#include <cstring>
+#include <sys/mman.h>
+
 #include "vmill/Util/ZoneAllocator.h"
 
 namespace vmill {
 namespace {
 
 enum : size_t {
-  kPageSize = 4096ULL
+  kPageSize = 4096ULL,
+  kPageShift = 12ULL,
+
+  // Freed blocks at least this big are handed back to the kernel, so that
+  // they don't hold on to memory while they're free, and so that they read
+  // as zeroes once they're reused.
+  kMinReleasedBlockSize = 16 * kPageSize
 };
 
+// Returns the size class of `size`-byte allocations. Blocks of size class
+// `n` are `kPageSize << n` bytes.
+static size_t SizeClass(size_t size) {
+  if (size <= kPageSize) {
+    return 0;
+  }
+  const auto num_pages_minus_one = (size - 1) >> kPageShift;
+  return static_cast<size_t>(64 - __builtin_clzll(num_pages_minus_one));
+}
+
+// Returns `true` if freed `block_size`-byte blocks are handed back to the
+// kernel. `MADV_DONTNEED` only guarantees that the pages will read as zeroes
+// on Linux.
+static bool ReleasesBlock(size_t block_size) {
+#ifdef __linux__
+  return block_size >= kMinReleasedBlockSize;
+#else
+  (void) block_size;
+  return false;
+#endif
+}
+
 }  // namespace
 
 ZoneAllocator::ZoneAllocator(AreaAllocationPerms perms,
                              uintptr_t preferred_base,
                              size_t page_size)
-    : allocator(perms, preferred_base, page_size) {}
-
-ZoneAllocation ZoneAllocator::Allocate(size_t size) {
-  ZoneAllocation alloc = {};
-  auto lb = free_list.lower_bound(size);
-  if (lb != free_list.end() && !lb->second.empty()) {
-    alloc.base = lb->second.back();
-    alloc.size = lb->first;
-    lb->second.pop_back();
-
-    if (alloc.size != size) {
-      CHECK(alloc.size >= size);
-
-      auto diff = alloc.size - size;
-      if (diff > kPageSize) {
-        DLOG(INFO)
-            << "Splitting previously freed 0x" << std::hex << alloc.size
-            << "-byte allocation for a 0x" << size << "-byte allocation"
-            << std::dec;
-
-        ZoneAllocation split = {alloc.base, diff};
-        Free(split);
-
-        alloc.base = &(alloc.base[diff]);
-        alloc.size = size;
-      } else {
-        DLOG(INFO)
-            << "Re-using a previously freed 0x" << std::hex << alloc.size
-            << "-byte allocation for a 0x" << size << "-byte allocation"
-            << std::dec;
-      }
+    : allocator(perms, preferred_base, page_size),
+      fresh_blocks_are_zeroed(kAreaRW == perms) {}
+
+// Fresh blocks are only committed by the kernel once they're touched, so
+// they are never zeroed by hand.
+ZoneAllocation ZoneAllocator::Allocate(size_t size, bool zeroed) {
+  const auto size_class = SizeClass(size);
+  CHECK(size_class < kNumSizeClasses)
+      << "Cannot allocate 0x" << std::hex << size << std::dec << " bytes.";
+
+  const auto block_size = kPageSize << size_class;
+  auto &free_list = free_lists[size_class];
+
+  ZoneAllocation alloc = {nullptr, size};
+  if (!free_list.empty()) {
+    alloc.base = free_list.back();
+    free_list.pop_back();
+    if (zeroed && (!fresh_blocks_are_zeroed || !ReleasesBlock(block_size))) {
+      memset(alloc.base, 0, size);
     }
 
   } else {
-    alloc.base = allocator.Allocate(size, 64  /* Cache line size */);
-    alloc.size = size;
+    alloc.base = allocator.Allocate(block_size, kPageSize);
+    if (zeroed && !fresh_blocks_are_zeroed) {
+      memset(alloc.base, 0, size);
+    }
   }
-  bzero(alloc.base, size);
   return alloc;
 }
 
 void ZoneAllocator::Free(ZoneAllocation &alloc) {
-  if (alloc.base) {
-    free_list[alloc.size].push_back(alloc.base);
-    alloc.Reset();
+  if (!alloc.base) {
+    return;
+  }
+
+  const auto size_class = SizeClass(alloc.size);
+  const auto block_size = kPageSize << size_class;
+  if (ReleasesBlock(block_size)) {
+    madvise(alloc.base, block_size, MADV_DONTNEED);
   }
+  free_lists[size_class].push_back(alloc.base);
+  alloc.Reset();
 }
 
 }  // namespace vmill
@@ -17,7 +17,6 @@
 #ifndef VMILL_UTIL_ZONEALLOCATOR_H_
 #define VMILL_UTIL_ZONEALLOCATOR_H_
 
-#include <map>
 #include <vector>
 
 #include "vmill/Util/AreaAllocator.h"
@@ -34,19 +33,34 @@ struct ZoneAllocation {
   }
 };
 
+// Allocates blocks of memory out of an area. Every block belongs to a size
+// class, whose blocks are a power-of-two number of pages, and freed blocks
+// are kept in per-class free lists for reuse.
 class ZoneAllocator {
  public:
   ZoneAllocator(AreaAllocationPerms perms,
                 uintptr_t preferred_base=0,
                 size_t page_size=k2MiB);
 
-  ZoneAllocation Allocate(size_t size);
+  // Allocate `size` bytes of memory, which is zeroed unless `zeroed` is
+  // `false`.
+  ZoneAllocation Allocate(size_t size, bool zeroed=true);
 
   void Free(ZoneAllocation &alloc);
 
  private:
+  // One size class for each power-of-two number of pages that fits in a
+  // 64-bit size.
+  enum : size_t {
+    kNumSizeClasses = 52
+  };
+
   AreaAllocator allocator;
-  std::map<size_t, std::vector<uint8_t *>> free_list;
+
+  // Is memory that is fresh from `allocator` already zeroed?
+  const bool fresh_blocks_are_zeroed;
+
+  std::vector<uint8_t *> free_lists[kNumSizeClasses];
 };
 
 
@@ -18,12 +18,16 @@
 #include <glog/logging.h>
 
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <sstream>
 
 #include "remill/OS/FileSystem.h"
 
 #include "vmill/Executor/Executor.h"
+#include "vmill/Executor/Hooks.h"
 #include "vmill/Program/AddressSpace.h"
 #include "vmill/Program/Snapshot.h"
 #include "vmill/Workspace/Workspace.h"
@@ -52,6 +56,9 @@ DEFINE_string(runtime, "", "Name of a runtime, or absolute path to a "
 
 DECLARE_string(arch);
 DECLARE_string(os);
+DECLARE_string(code_model);
+DECLARE_bool(profile_blocks);
+DECLARE_bool(use_profile);
 
 namespace vmill {
 
@@ -118,11 +125,49 @@ const std::string &Workspace::BitcodeDir(void) {
   return path;
 }
 
+const std::string &Workspace::ProfilePath(void) {
+  static std::string path;
+  if (path.empty()) {
+    std::stringstream ss;
+    ss << Dir() << remill::PathSeparator() << "profile";
+    path = ss.str();
+    path = remill::CanonicalPath(path);
+  }
+  return path;
+}
+
+// Returns the size of the block profile that will guide lifting, or zero if
+// there is none.
+static uint64_t UsedProfileSize(void) {
+  struct stat info = {};
+  if (!FLAGS_use_profile || FLAGS_profile_blocks ||
+      stat(Workspace::ProfilePath().c_str(), &info)) {
+    return 0;
+  }
+  return static_cast<uint64_t>(info.st_size);
+}
+
+bool Workspace::UsesBlockProfile(void) {
+  return FLAGS_profile_blocks || UsedProfileSize();
+}
+
 const std::string &Workspace::ToolDir(void) {
   static std::string path;
   if (path.empty()) {
+
+    // Compiled code is specific to the tools and the code model, and to
+    // whether it is instrumented with, or guided by, a block profile. The
+    // profile only ever grows, so its size identifies its version.
+    std::stringstream key;
+    key << RuntimeBitcodePath() << FLAGS_tool << FLAGS_code_model;
+    if (FLAGS_profile_blocks) {
+      key << ":profile_blocks";
+    } else if (auto profile_size = UsedProfileSize()) {
+      key << ":profile:" << profile_size;
+    }
+
     std::hash<std::string> hasher;
-    auto hash = hasher(RuntimeBitcodePath() + FLAGS_tool);
+    auto hash = hasher(key.str());
 
     std::stringstream ss;
     ss << Dir() << remill::PathSeparator() << std::hex << hash;
@@ -207,9 +252,14 @@ namespace {
 using AddressSpaceIdToMemoryMap = \
     std::unordered_map<int64_t, std::shared_ptr<AddressSpace>>;
 
-// Load in the data from the snapshotted page range into the address space.
-static void LoadPageRangeFromFile(AddressSpace *addr_space,
-                                  const snapshot::PageRange &range) {
+static constexpr uint64_t kPageSize = 4096;
+
+// Load in the data from the snapshotted page range into the memory file
+// `mem_fd` at `file_offset`, which the address space then maps copy-on-write.
+// The executions that start from the snapshot thus only ever copy the pages
+// that they write to. Returns the offset at which the next range goes.
+static uint64_t LoadPageRangeIntoMemoryFile(const snapshot::PageRange &range,
+                                            int mem_fd, uint64_t file_offset) {
   std::stringstream ss;
   ss << Workspace::MemoryDir() << remill::PathSeparator() << range.name();
 
@@ -230,16 +280,27 @@ static void LoadPageRangeFromFile(AddressSpace *addr_space,
       << ", " << range.limit() << ")" << std::dec;
 
   auto fd = open(path.c_str(), O_RDONLY);
+  auto err = errno;
+  CHECK(-1 != fd)
+      << "Unable to open " << path << ": " << strerror(err);
 
-  // Read bytes from the file into the address space.
-  uint64_t base_addr = static_cast<uint64_t>(range.base());
+  const auto mem_size = (range_size + kPageSize - 1) & ~(kPageSize - 1);
+  CHECK(!ftruncate(mem_fd, static_cast<off_t>(file_offset + mem_size)))
+      << "Unable to resize memory file for " << path;
 
-  while (range_size) {
-    auto buff = addr_space->ToReadWriteVirtualAddress(base_addr);
+  auto mem = mmap(nullptr, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  mem_fd, static_cast<off_t>(file_offset));
+  err = errno;
+  CHECK(MAP_FAILED != mem)
+      << "Unable to map memory file for " << path << ": " << strerror(err);
+
+  // Read bytes from the file into the memory file.
+  auto buff = reinterpret_cast<uint8_t *>(mem);
 
+  while (range_size) {
     errno = 0;
     auto amount_read_ = read(fd, buff, range_size);
-    auto err = errno;
+    err = errno;
     if (-1 == amount_read_) {
       CHECK(!range_size)
           << "Failed to read all page range data from " << path
@@ -249,17 +310,20 @@ static void LoadPageRangeFromFile(AddressSpace *addr_space,
     }
 
     auto amount_read = static_cast<uint64_t>(amount_read_);
-    base_addr += amount_read;
+    buff += amount_read;
     range_size -= amount_read;
   }
 
+  munmap(mem, mem_size);
   close(fd);
+  return file_offset + mem_size;
 }
 
 // Go through the snapshotted pages and copy them into the address space.
 static void LoadAddressSpaceFromSnapshot(
     AddressSpaceIdToMemoryMap &addr_space_ids,
-    const snapshot::AddressSpace &orig_addr_space) {
+    const snapshot::AddressSpace &orig_addr_space,
+    int mem_fd, uint64_t *mem_size) {
 
   LOG(INFO)
       << "Initializing address space " << orig_addr_space.id();
@@ -332,11 +396,12 @@ static void LoadAddressSpaceFromSnapshot(
     auto size = limit - base;
     auto offset = static_cast<uint64_t>(
         page.has_file_offset() ? page.file_offset() : 0L);
-    emu_addr_space->AddMap(base, size, path, offset);
     if (snapshot::kAnonymousZeroRange == page.kind()) {
-
+      emu_addr_space->AddMap(base, size, path, offset);
     } else {
-      LoadPageRangeFromFile(emu_addr_space.get(), page);
+      auto file_offset = *mem_size;
+      *mem_size = LoadPageRangeIntoMemoryFile(page, mem_fd, file_offset);
+      emu_addr_space->AddMap(base, size, path, offset, mem_fd, file_offset);
     }
     emu_addr_space->SetPermissions(base, size, page.can_read(),
                                    page.can_write(), page.can_exec());
@@ -349,10 +414,41 @@ void Workspace::LoadSnapshotIntoExecutor(
     const ProgramSnapshotPtr &snapshot, Executor &executor) {
 
   LOG(INFO) << "Loading address space information from snapshot";
+
+  // The data of every page range goes into one memory file, so that the
+  // ranges (and their clones) all share one file descriptor.
+  auto mem_fd = memfd_create("vmill_snapshot", MFD_CLOEXEC);
+  auto err = errno;
+  CHECK(-1 != mem_fd)
+      << "Unable to create memory file for snapshot: " << strerror(err);
+
   AddressSpaceIdToMemoryMap address_space_ids;
+  uint64_t mem_size = 0;
   for (const auto &address_space : snapshot->address_spaces()) {
-    LoadAddressSpaceFromSnapshot(address_space_ids, address_space);
+    LoadAddressSpaceFromSnapshot(address_space_ids, address_space, mem_fd,
+                                 &mem_size);
   }
+  close(mem_fd);
+
+  LOG(INFO) << "Looking for hooked functions in executable files.";
+  HookMap hooks;
+  for (const auto &address_space : snapshot->address_spaces()) {
+    for (const auto &page : address_space.page_ranges()) {
+      if (snapshot::kFileBackedPageRange == page.kind() &&
+          page.has_file_path() && page.can_exec()) {
+        FindHookedFunctions(
+            page.file_path(), static_cast<uint64_t>(page.base()),
+            static_cast<uint64_t>(page.limit()),
+            static_cast<uint64_t>(page.file_offset()), hooks);
+      }
+    }
+  }
+
+  for (const auto &entry : hooks) {
+    executor.AddHook(static_cast<PC>(entry.first), entry.second);
+  }
+
+  LOG(INFO) << "Hooked " << hooks.size() << " guest functions.";
 
   LOG(INFO) << "Loading task information.";
   for (const auto &task : snapshot->tasks()) {
@@ -33,6 +33,11 @@ class Workspace {
   static const std::string &LibraryDir(void);
   static const std::string &RuntimeBitcodePath(void);
   static const std::string &RuntimeLibraryPath(void);
+  static const std::string &ProfilePath(void);
+
+  // Returns `true` if lifted code is instrumented to collect a block profile,
+  // or if lifting is guided by an existing block profile.
+  static bool UsesBlockProfile(void);
 
   static void LoadSnapshotIntoExecutor(
       const ProgramSnapshotPtr &snapshot, Executor &executor);